@@ -0,0 +1,47 @@
+# Writes the 16 byte line of syscalls.s 200000 times through the console
+# device (--console-device), with plain stores into its ring and a store of
+# the new head per line. Exits with the number of bytes published.
+# as --32 console.s -o console.o && ld -m elf_i386 -o console console.o
+	.intel_syntax noprefix
+	.globl _start
+
+	.set WRITES, 200000
+	.set CONSOLE, 0x0e000000
+	.set RING, CONSOLE + 0x1000
+	.set RING_MASK, 0xffff
+
+	.text
+_start:
+	mov esi, WRITES
+	mov edi, 0
+	mov ebp, offset line
+write:
+	# lines are 16 bytes, so one never wraps around the end of the ring
+	mov ebx, edi
+	and ebx, RING_MASK
+	mov eax, [ebp]
+	mov [ebx + RING], eax
+	mov eax, [ebp + 4]
+	mov [ebx + RING + 4], eax
+	mov eax, [ebp + 8]
+	mov [ebx + RING + 8], eax
+	mov eax, [ebp + 12]
+	mov [ebx + RING + 12], eax
+	# the line carries the low digit of the counter
+	mov eax, esi
+	and al, 7
+	add al, 0x30
+	mov byte ptr [ebx + RING + 14], al
+	# publish the line
+	add edi, 16
+	mov dword ptr [CONSOLE], edi
+	dec esi
+	jne write
+
+	mov ebx, edi
+	mov eax, 1
+	int 0x80
+
+	.data
+line:
+	.ascii "benchmark line \n"
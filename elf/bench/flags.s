@@ -0,0 +1,44 @@
+# Carries kept across inc and dec and read by adc and sbb, the flags paths
+# that --lockstep hands between its lanes and the CPU. Run under --lockstep
+# it has to exit the same as on its own. Exits with the sum of the carries.
+# as --32 flags.s -o flags.o && ld -m elf_i386 -o flags flags.o
+	.intel_syntax noprefix
+	.globl _start
+
+	.set ROUNDS, 1000000
+
+	.text
+_start:
+	mov esi, 0
+	mov ecx, 0
+	mov edi, ROUNDS
+round:
+	mov eax, edi
+	and eax, 3
+	# an add without carry in after a carry kept by inc, adc sees CF = 0
+	cmp eax, 2
+	inc ecx
+	mov ebx, -1
+	add ebx, 0
+	mov edx, 0
+	adc edx, 0
+	add esi, edx
+	# CF of cmp kept by inc
+	cmp eax, 2
+	inc ecx
+	adc esi, 0
+	# CF of sub kept by dec
+	mov ebx, eax
+	sub ebx, 3
+	dec ecx
+	sbb esi, 0
+	# carry out of an add
+	mov ebx, -1
+	add ebx, eax
+	adc esi, 0
+	dec edi
+	jne round
+
+	mov ebx, esi
+	mov eax, 1
+	int 0x80
@@ -0,0 +1,37 @@
+# Random read-modify-write accesses to a 64 MB heap, at addresses from a
+# linear congruential generator, so nearly every access misses the caches
+# and the TLB of the host. Exits with a checksum of the values read.
+# as --32 heap.s -o heap.o && ld -m elf_i386 -o heap heap.o
+	.intel_syntax noprefix
+	.globl _start
+
+	.set HEAP_WORDS, 0x1000000
+	.set ACCESSES, 3000000
+
+	.text
+_start:
+	mov ebx, 1
+	mov esi, 0
+	mov edi, ACCESSES
+access:
+	mov eax, ebx
+	mov edx, 1664525
+	mul edx
+	add eax, 1013904223
+	mov ebx, eax
+	mov ecx, eax
+	shr ecx, 6
+	and ecx, HEAP_WORDS - 1
+	xor esi, dword ptr [heap + ecx * 4]
+	add dword ptr [heap + ecx * 4], eax
+	dec edi
+	jne access
+
+	mov ebx, esi
+	mov eax, 1
+	int 0x80
+
+	.bss
+	.align 4096
+heap:
+	.space HEAP_WORDS * 4
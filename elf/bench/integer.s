@@ -0,0 +1,175 @@
+# CoreMark style integer kernels: a CRC-32 over a pseudo random buffer, a
+# 16x16 matrix multiply and a state machine classifying the same bytes.
+# Exits with a checksum of the results.
+# as --32 integer.s -o integer.o && ld -m elf_i386 -o integer integer.o
+	.intel_syntax noprefix
+	.globl _start
+
+	.set BUFFER_SIZE, 4096
+	.set CRC_ROUNDS, 60
+	.set MATRIX_ROUNDS, 300
+	.set STATE_ROUNDS, 200
+
+	.text
+_start:
+	# the buffer from a linear congruential generator
+	mov ecx, 0
+	mov eax, 12345
+fill:
+	mov edx, 1103515245
+	mul edx
+	add eax, 12345
+	mov byte ptr [buffer + ecx], ah
+	inc ecx
+	cmp ecx, BUFFER_SIZE
+	jne fill
+
+	# crc-32, bit by bit, seeded with the round
+	mov esi, 0
+	mov edi, CRC_ROUNDS
+crc_round:
+	mov eax, edi
+	not eax
+	mov ecx, 0
+crc_byte:
+	mov edx, 0
+	mov dl, byte ptr [buffer + ecx]
+	xor eax, edx
+	mov ebx, 8
+crc_bit:
+	shr eax, 1
+	jnc crc_next
+	xor eax, 0xEDB88320
+crc_next:
+	dec ebx
+	jne crc_bit
+	inc ecx
+	cmp ecx, BUFFER_SIZE
+	jne crc_byte
+	not eax
+	add esi, eax
+	dec edi
+	jne crc_round
+	mov dword ptr [total], esi
+
+	# a = buffer bytes, bt = b transposed with b[k][j] = 3 * (k + j) + 1
+	mov ecx, 0
+init_matrix:
+	mov edx, 0
+	mov dl, byte ptr [buffer + ecx]
+	mov dword ptr [matrix_a + ecx * 4], edx
+	mov eax, ecx
+	shr eax, 4
+	mov edx, ecx
+	and edx, 15
+	add eax, edx
+	lea eax, [eax + eax * 2 + 1]
+	mov dword ptr [matrix_bt + ecx * 4], eax
+	inc ecx
+	cmp ecx, 256
+	jne init_matrix
+
+	# c = a * b, the row of a in ebx, the row of bt in ecx, k in edi
+	mov ebp, MATRIX_ROUNDS
+matrix_round:
+	mov ebx, 0
+matrix_row:
+	mov ecx, 0
+matrix_column:
+	mov esi, 0
+	mov edi, 0
+matrix_dot:
+	mov eax, dword ptr [matrix_a + ebx + edi * 4]
+	mul dword ptr [matrix_bt + ecx + edi * 4]
+	add esi, eax
+	inc edi
+	cmp edi, 16
+	jne matrix_dot
+	mov edx, ecx
+	shr edx, 4
+	mov dword ptr [matrix_c + ebx + edx], esi
+	add ecx, 64
+	cmp ecx, 1024
+	jne matrix_column
+	add ebx, 64
+	cmp ebx, 1024
+	jne matrix_row
+	# the next round multiplies a + c
+	mov ecx, 0
+matrix_feedback:
+	mov eax, dword ptr [matrix_c + ecx * 4]
+	and eax, 0xFF
+	add dword ptr [matrix_a + ecx * 4], eax
+	inc ecx
+	cmp ecx, 256
+	jne matrix_feedback
+	dec ebp
+	jne matrix_round
+
+	mov ecx, 0
+matrix_sum:
+	mov eax, dword ptr [matrix_c + ecx * 4]
+	add dword ptr [total], eax
+	inc ecx
+	cmp ecx, 256
+	jne matrix_sum
+
+	# states 0 other, 1 digit, 2 letter, counting the transitions
+	mov ebp, STATE_ROUNDS
+state_round:
+	mov ecx, 0
+	mov ebx, 0
+state_scan:
+	mov edx, 0
+	mov dl, byte ptr [buffer + ecx]
+	add dl, byte ptr [total + 0]
+	cmp dl, 0x30
+	jb state_other
+	cmp dl, 0x3A
+	jb state_digit
+	cmp dl, 0x80
+	jb state_letter
+state_other:
+	cmp ebx, 0
+	je state_next
+	mov ebx, 0
+	inc dword ptr [transitions]
+	jmp state_next
+state_digit:
+	cmp ebx, 1
+	je state_next
+	mov ebx, 1
+	inc dword ptr [transitions]
+	jmp state_next
+state_letter:
+	cmp ebx, 2
+	je state_next
+	mov ebx, 2
+	inc dword ptr [transitions]
+state_next:
+	inc ecx
+	cmp ecx, BUFFER_SIZE
+	jne state_scan
+	inc byte ptr [total + 0]
+	dec ebp
+	jne state_round
+
+	mov ebx, dword ptr [total]
+	add ebx, dword ptr [transitions]
+	mov eax, 1
+	int 0x80
+
+	.bss
+	.align 16
+buffer:
+	.space BUFFER_SIZE
+matrix_a:
+	.space 1024
+matrix_bt:
+	.space 1024
+matrix_c:
+	.space 1024
+total:
+	.space 4
+transitions:
+	.space 4
@@ -0,0 +1,110 @@
+# memcpy and strlen kernels on 64 KB buffers: rep movsd, a dword loop, a
+# byte loop, repne scasb and a byte scan. Exits with a checksum of the
+# copies and the lengths.
+# as --32 memcpy.s -o memcpy.o && ld -m elf_i386 -o memcpy memcpy.o
+	.intel_syntax noprefix
+	.globl _start
+
+	.set SIZE, 0x10000
+	.set ROUNDS, 40
+
+	.text
+_start:
+	# source bytes 1 - 255, never 0, so the string is the whole buffer
+	mov ecx, 0
+	mov eax, 0
+fill:
+	inc al
+	jne fill_store
+	inc al
+fill_store:
+	mov byte ptr [source + ecx], al
+	inc ecx
+	cmp ecx, SIZE
+	jne fill
+
+	mov ebp, ROUNDS
+round:
+	# rep movsd into the first copy
+	cld
+	mov esi, offset source
+	mov edi, offset copy1
+	mov ecx, SIZE / 4
+	rep movsd
+
+	# dword loop into the second copy
+	mov ecx, 0
+copy_dwords:
+	mov eax, dword ptr [copy1 + ecx * 4]
+	mov dword ptr [copy2 + ecx * 4], eax
+	inc ecx
+	cmp ecx, SIZE / 4
+	jne copy_dwords
+
+	# byte loop back into the source, one byte shorter each round
+	mov esi, offset copy2
+	mov edi, offset source
+	mov ecx, SIZE - ROUNDS
+	add ecx, ebp
+copy_bytes:
+	mov al, byte ptr [esi]
+	mov byte ptr [edi], al
+	inc esi
+	inc edi
+	dec ecx
+	jne copy_bytes
+
+	# cut the string at a different place each round
+	mov ebx, ebp
+	shl ebx, 10
+	mov byte ptr [source + ebx], 0
+
+	# strlen with repne scasb
+	mov edi, offset source
+	mov ecx, 0xFFFFFFFF
+	mov al, 0
+	repne scasb
+	not ecx
+	dec ecx
+	add dword ptr [total], ecx
+
+	# strlen with a byte loop
+	mov esi, offset source
+strlen_loop:
+	mov al, byte ptr [esi]
+	inc esi
+	cmp al, 0
+	jne strlen_loop
+	sub esi, offset source + 1
+	add dword ptr [total], esi
+
+	# put the byte back for the copies of the next round
+	mov byte ptr [source + ebx], 1
+	dec ebp
+	je done
+	jmp round
+done:
+
+	# checksum of the last copy
+	mov ecx, 0
+	mov ebx, dword ptr [total]
+sum:
+	add ebx, dword ptr [copy2 + ecx * 4]
+	rol ebx, 1
+	inc ecx
+	cmp ecx, SIZE / 4
+	jne sum
+
+	mov eax, 1
+	int 0x80
+
+	.bss
+	.align 16
+source:
+	.space SIZE
+copy1:
+	.space SIZE
+copy2:
+	.space SIZE
+total:
+	.space 4
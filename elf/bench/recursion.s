@@ -0,0 +1,66 @@
+# Call heavy recursion: fib(27) with stack frames and arguments on the
+# stack, and Ackermann's function A(2, 600) with arguments in registers.
+# Exits with the sum of both results.
+# as --32 recursion.s -o recursion.o && ld -m elf_i386 -o recursion recursion.o
+	.intel_syntax noprefix
+	.globl _start
+
+	.text
+_start:
+	push 27
+	call fib
+	add esp, 4
+	mov esi, eax
+
+	mov eax, 2
+	mov ecx, 600
+	call ackermann
+	add esi, eax
+
+	mov ebx, esi
+	mov eax, 1
+	int 0x80
+
+# fib(n) of the argument on the stack into eax
+fib:
+	push ebp
+	mov ebp, esp
+	push ebx
+	mov eax, dword ptr [ebp + 8]
+	cmp eax, 2
+	jb fib_done
+	dec eax
+	push eax
+	call fib
+	mov ebx, eax
+	mov eax, dword ptr [ebp + 8]
+	sub eax, 2
+	mov dword ptr [esp], eax
+	call fib
+	add esp, 4
+	add eax, ebx
+fib_done:
+	pop ebx
+	pop ebp
+	ret
+
+# A(m, n) of eax and ecx into eax
+ackermann:
+	test eax, eax
+	jne ackermann_m
+	lea eax, [ecx + 1]
+	ret
+ackermann_m:
+	test ecx, ecx
+	jne ackermann_n
+	dec eax
+	mov ecx, 1
+	jmp ackermann
+ackermann_n:
+	push eax
+	dec ecx
+	call ackermann
+	mov ecx, eax
+	pop eax
+	dec eax
+	jmp ackermann
@@ -0,0 +1,34 @@
+# Writes a 16 byte line to stdout 200000 times with sys_write, so the time
+# goes to the syscall path. Exits with the number of bytes written.
+# as --32 syscalls.s -o syscalls.o && ld -m elf_i386 -o syscalls syscalls.o
+	.intel_syntax noprefix
+	.globl _start
+
+	.set WRITES, 200000
+
+	.text
+_start:
+	mov esi, WRITES
+	mov edi, 0
+write:
+	# the line carries the low digit of the counter
+	mov ecx, offset line
+	mov eax, esi
+	and al, 7
+	add al, 0x30
+	mov byte ptr [ecx + 14], al
+	mov eax, 4
+	mov ebx, 1
+	mov edx, 16
+	int 0x80
+	add edi, eax
+	dec esi
+	jne write
+
+	mov ebx, edi
+	mov eax, 1
+	int 0x80
+
+	.data
+line:
+	.ascii "benchmark line \n"
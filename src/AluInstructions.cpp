@@ -0,0 +1,210 @@
+#include "CPU.hpp"
+
+// add/or/adc/sbb/and/sub/xor/cmp in all their encodings.
+// Every combination of operation, operand size and operand form is its own
+// template instantiation, the opcode only selects which one to call.
+// With a lock prefix the memory operand is updated atomically.
+
+template<CPU::AluOp op>
+uint32_t CPU::aluCarryIn() {
+	if constexpr (op == AluOp::Adc || op == AluOp::Sbb) {
+		return this->registers.getFlag(Registers::Flag::CF) ? 1 : 0;
+	}
+	return 0;
+}
+
+template<CPU::AluOp op, typename T>
+T CPU::aluCompute(T value1, T value2) {
+	return aluCompute<op, T>(value1, value2, aluCarryIn<op>());
+}
+
+template<CPU::AluOp op, typename T>
+T CPU::aluCompute(T value1, T value2, uint32_t carryIn) {
+	// flags are computed from the operands only when they are read
+	T result;
+	if constexpr (op == AluOp::Add || op == AluOp::Adc) {
+		result = (T)(value1 + value2 + carryIn);
+		this->registers.setLazyFlags(Registers::FlagOp::Add, sizeof(T), value1, value2, result, carryIn);
+	}
+	else if constexpr (op == AluOp::Sub || op == AluOp::Sbb || op == AluOp::Cmp) {
+		result = (T)(value1 - value2 - carryIn);
+		this->registers.setLazyFlags(Registers::FlagOp::Sub, sizeof(T), value1, value2, result, carryIn);
+	}
+	else {
+		if constexpr (op == AluOp::Or) {
+			result = value1 | value2;
+		}
+		else if constexpr (op == AluOp::And) {
+			result = value1 & value2;
+		}
+		else {
+			result = value1 ^ value2;
+		}
+		this->registers.setLazyFlags(Registers::FlagOp::Logic, sizeof(T), value1, value2, result);
+	}
+
+	return result;
+}
+
+template<CPU::AluOp op, typename T, CPU::AluForm form>
+void CPU::alu(uint8_t modrm) {
+	constexpr bool w = sizeof(T) > 1;
+	constexpr bool bit16 = sizeof(T) == 2;
+
+	if constexpr (form == AluForm::AccImm) {
+		// [00 op 10 w] [imm]
+		T value1 = this->registers.get(Registers::Reg::EAX, w, bit16);
+		T value2 = readImmediate(w, bit16);
+		T result = aluCompute<op, T>(value1, value2);
+		if constexpr (op != AluOp::Cmp) {
+			this->registers.set(Registers::Reg::EAX, w, bit16, result);
+		}
+		return;
+	}
+	else {
+		// the effective address is decoded once, before the immediate
+		RmOperand operand = decodeRm(modrm);
+		Registers::Reg reg = (Registers::Reg)((modrm & 0b0011'1000) >> 3);
+
+		if constexpr (form == AluForm::RegRm) {
+			// [00 op 01 w] [mod reg r/m]
+			T result = aluCompute<op, T>(this->registers.get(reg, w, bit16), readRm<T>(operand));
+			if constexpr (op != AluOp::Cmp) {
+				this->registers.set(reg, w, bit16, result);
+			}
+			return;
+		}
+
+		T value2;
+		if constexpr (form == AluForm::RmReg) {
+			// [00 op 00 w] [mod reg r/m]
+			value2 = this->registers.get(reg, w, bit16);
+		}
+		else if constexpr (form == AluForm::RmImm) {
+			// [1000 000 w] [mod op r/m] [imm]
+			value2 = readImmediate(w, bit16);
+		}
+		else {
+			// [1000 0011] [mod op r/m] [imm8]
+			value2 = (T)(int32_t)(int8_t)readImmediate(false, false);
+		}
+
+		if constexpr (op != AluOp::Cmp) {
+			if (this->lockPrefix) {
+				// the flags are the ones of the operation that was written, the carry
+				// is read once since a retried update follows the flags of the first try
+				uint32_t carryIn = aluCarryIn<op>();
+				updateRm<T>(operand, [&](T value) { return aluCompute<op, T>(value, value2, carryIn); });
+				return;
+			}
+		}
+
+		T result = aluCompute<op, T>(readRm<T>(operand), value2);
+		if constexpr (op != AluOp::Cmp) {
+			writeRm<T>(operand, result);
+		}
+	}
+}
+
+template<typename T, CPU::AluForm form>
+std::array<CPU::AluHandler, 8> CPU::aluHandlers() {
+	return {
+		&CPU::alu<AluOp::Add, T, form>,
+		&CPU::alu<AluOp::Or, T, form>,
+		&CPU::alu<AluOp::Adc, T, form>,
+		&CPU::alu<AluOp::Sbb, T, form>,
+		&CPU::alu<AluOp::And, T, form>,
+		&CPU::alu<AluOp::Sub, T, form>,
+		&CPU::alu<AluOp::Xor, T, form>,
+		&CPU::alu<AluOp::Cmp, T, form>
+	};
+}
+
+void CPU::compareFlags(uint32_t value1, uint32_t value2, uint32_t size) {
+	// flags of value1 - value2 for operands of size bytes
+	if (size == 1) {
+		aluCompute<AluOp::Cmp, uint8_t>(value1, value2);
+	}
+	else if (size == 2) {
+		aluCompute<AluOp::Cmp, uint16_t>(value1, value2);
+	}
+	else {
+		aluCompute<AluOp::Cmp, uint32_t>(value1, value2);
+	}
+}
+
+void CPU::initAluInstructions() {
+	// [size prefix][w][op]
+	static const std::array<AluHandler, 8> rmReg[2][2] = {
+		{ aluHandlers<uint8_t, AluForm::RmReg>(), aluHandlers<uint32_t, AluForm::RmReg>() },
+		{ aluHandlers<uint8_t, AluForm::RmReg>(), aluHandlers<uint16_t, AluForm::RmReg>() }
+	};
+	static const std::array<AluHandler, 8> regRm[2][2] = {
+		{ aluHandlers<uint8_t, AluForm::RegRm>(), aluHandlers<uint32_t, AluForm::RegRm>() },
+		{ aluHandlers<uint8_t, AluForm::RegRm>(), aluHandlers<uint16_t, AluForm::RegRm>() }
+	};
+	static const std::array<AluHandler, 8> accImm[2][2] = {
+		{ aluHandlers<uint8_t, AluForm::AccImm>(), aluHandlers<uint32_t, AluForm::AccImm>() },
+		{ aluHandlers<uint8_t, AluForm::AccImm>(), aluHandlers<uint16_t, AluForm::AccImm>() }
+	};
+	// [size prefix][opcode & 0b11][op]
+	static const std::array<AluHandler, 8> group1[2][4] = {
+		{
+			aluHandlers<uint8_t, AluForm::RmImm>(), aluHandlers<uint32_t, AluForm::RmImm>(),
+			aluHandlers<uint8_t, AluForm::RmImm>(), aluHandlers<uint32_t, AluForm::RmImm8>()
+		},
+		{
+			aluHandlers<uint8_t, AluForm::RmImm>(), aluHandlers<uint16_t, AluForm::RmImm>(),
+			aluHandlers<uint8_t, AluForm::RmImm>(), aluHandlers<uint16_t, AluForm::RmImm8>()
+		}
+	};
+
+	for (uint8_t op = 0; op < 8; op++) {
+		instructions[(op << 3) >> 2] = [&, op](uint8_t opcode, bool sizePrefix) -> bool {
+			// op r/m, r
+			// [00 op 0 0 w] [mod reg r/m]
+
+			// op r, r/m
+			// [00 op 0 1 w] [mod reg r/m]
+			bool w = (opcode & 0b0000'0001) > 0;
+			bool d = (opcode & 0b0000'0010) > 0;
+			uint8_t modrm = readImmediate(false, false);
+			if (this->lockPrefix && (d || op == (uint8_t)AluOp::Cmp || (modrm & 0b1100'0000) == 0b1100'0000)) {
+				// lock needs a memory destination
+				return raise(Exception::InvalidOpcode);
+			}
+
+			AluHandler handler = (d ? regRm : rmReg)[sizePrefix][w][op];
+			(this->*handler)(modrm);
+			return true;
+		};
+
+		instructions[((op << 3) | 0b100) >> 2] = [&, op](uint8_t opcode, bool sizePrefix) -> bool {
+			// op AL/AX/EAX, imm
+			// [00 op 1 0 w] [imm]
+			if ((opcode & 0b0000'0010) > 0) {
+				return raise(Exception::InvalidOpcode);
+			}
+
+			bool w = (opcode & 0b0000'0001) > 0;
+			(this->*accImm[sizePrefix][w][op])(0);
+			return true;
+		};
+	}
+
+	instructions[0b1000'0000 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
+		// op r/m, imm
+		// [1000 00 s w] [mod op r/m] [imm]
+		//
+		// s = 0 -> imm8/16/32
+		// s = 1 -> imm8 sign extended to imm16/32
+		uint8_t modrm = readImmediate(false, false);
+		uint8_t op = (modrm & 0b0011'1000) >> 3;
+		if (this->lockPrefix && (op == (uint8_t)AluOp::Cmp || (modrm & 0b1100'0000) == 0b1100'0000)) {
+			return raise(Exception::InvalidOpcode);
+		}
+
+		(this->*group1[sizePrefix][opcode & 0b11][op])(modrm);
+		return true;
+	};
+}
@@ -0,0 +1,139 @@
+#include "CPU.hpp"
+
+// xchg, and xadd and cmpxchg behind the 0x0F escape. Their memory operand
+// is always read and written as one atomic access, so threads sharing the
+// memory can synchronize on them with or without a lock prefix.
+
+namespace {
+	using Handler = bool (CPU::*)(uint8_t modrm);
+}
+
+template<typename T>
+bool CPU::exchange(uint8_t modrm) {
+	// xchg r/m, r
+	// [1000 011 w] [mod reg r/m]
+	constexpr bool w = sizeof(T) > 1;
+	constexpr bool bit16 = sizeof(T) == 2;
+	RmOperand operand = decodeRm(modrm);
+	Registers::Reg reg = (Registers::Reg)((modrm & 0b0011'1000) >> 3);
+	if (this->lockPrefix && operand.isRegister) {
+		return raise(Exception::InvalidOpcode);
+	}
+
+	T value = (T)this->registers.get(reg, w, bit16);
+	T previous = updateRm<T>(operand, [value](T) { return value; });
+	this->registers.set(reg, w, bit16, previous);
+	return true;
+}
+
+template<typename T>
+bool CPU::exchangeAdd(uint8_t modrm) {
+	// xadd r/m, r
+	// [0000 1111] [1100 000 w] [mod reg r/m]
+	constexpr bool w = sizeof(T) > 1;
+	constexpr bool bit16 = sizeof(T) == 2;
+	RmOperand operand = decodeRm(modrm);
+	Registers::Reg reg = (Registers::Reg)((modrm & 0b0011'1000) >> 3);
+	if (this->lockPrefix && operand.isRegister) {
+		return raise(Exception::InvalidOpcode);
+	}
+
+	T value = (T)this->registers.get(reg, w, bit16);
+	T previous = updateRm<T>(operand, [&](T current) {
+		T result = (T)(current + value);
+		this->registers.setLazyFlags(Registers::FlagOp::Add, sizeof(T), current, value, result);
+		return result;
+	});
+	this->registers.set(reg, w, bit16, previous);
+	return true;
+}
+
+template<typename T>
+bool CPU::compareExchange(uint8_t modrm) {
+	// cmpxchg r/m, r
+	// [0000 1111] [1011 000 w] [mod reg r/m]
+	constexpr bool w = sizeof(T) > 1;
+	constexpr bool bit16 = sizeof(T) == 2;
+	RmOperand operand = decodeRm(modrm);
+	Registers::Reg reg = (Registers::Reg)((modrm & 0b0011'1000) >> 3);
+	if (this->lockPrefix && operand.isRegister) {
+		return raise(Exception::InvalidOpcode);
+	}
+
+	// like the processor, a failed compare writes the old value back
+	T expected = (T)this->registers.get(Registers::Reg::EAX, w, bit16);
+	T value = (T)this->registers.get(reg, w, bit16);
+	T previous = updateRm<T>(operand, [&](T current) { return (current == expected) ? value : current; });
+
+	compareFlags(expected, previous, sizeof(T));
+	if (previous != expected) {
+		this->registers.set(Registers::Reg::EAX, w, bit16, previous);
+	}
+	return true;
+}
+
+void CPU::initAtomicInstructions() {
+	// [size prefix][w]
+	static const Handler exchangeTable[2][2] = {
+		{ &CPU::exchange<uint8_t>, &CPU::exchange<uint32_t> },
+		{ &CPU::exchange<uint8_t>, &CPU::exchange<uint16_t> }
+	};
+	static const Handler exchangeAddTable[2][2] = {
+		{ &CPU::exchangeAdd<uint8_t>, &CPU::exchangeAdd<uint32_t> },
+		{ &CPU::exchangeAdd<uint8_t>, &CPU::exchangeAdd<uint16_t> }
+	};
+	static const Handler compareExchangeTable[2][2] = {
+		{ &CPU::compareExchange<uint8_t>, &CPU::compareExchange<uint32_t> },
+		{ &CPU::compareExchange<uint8_t>, &CPU::compareExchange<uint16_t> }
+	};
+
+	// test r/m, r shares the slot
+	auto test = instructions[0x84 >> 2];
+	instructions[0x84 >> 2] = [&, test](uint8_t opcode, bool sizePrefix) -> bool {
+		if ((opcode & 0b0000'0010) == 0) {
+			return test(opcode, sizePrefix);
+		}
+
+		bool w = (opcode & 0b0000'0001) > 0;
+		uint8_t modrm = readImmediate(false, false);
+		return (this->*exchangeTable[sizePrefix][w])(modrm);
+	};
+
+	// nop is xchg eax, eax
+	auto nop = instructions[0x90 >> 2];
+	instructions[0x90 >> 2] = instructions[0x94 >> 2] = [&, nop](uint8_t opcode, bool sizePrefix) -> bool {
+		if (opcode == 0x90) {
+			return nop(opcode, sizePrefix);
+		}
+
+		// xchg eAX, r
+		// [1001 0 reg]
+		Registers::Reg reg = (Registers::Reg)(opcode & 0b0000'0111);
+		uint32_t value = this->registers.get(reg, true, sizePrefix);
+		this->registers.set(reg, true, sizePrefix, this->registers.get(Registers::Reg::EAX, true, sizePrefix));
+		this->registers.set(Registers::Reg::EAX, true, sizePrefix, value);
+		return true;
+	};
+
+	// or AL/AX/EAX, imm shares the slot
+	auto orImm = instructions[0x0C >> 2];
+	instructions[0x0C >> 2] = [&, orImm](uint8_t opcode, bool sizePrefix) -> bool {
+		if (opcode != 0x0F) {
+			return orImm(opcode, sizePrefix);
+		}
+
+		// two byte opcodes, the second byte is read like a mod r/m
+		// [0000 1111] [opcode]
+		uint8_t second = readImmediate(false, false);
+		bool w = (second & 0b0000'0001) > 0;
+		if ((second & 0b1111'1110) == 0xB0) {
+			uint8_t modrm = readImmediate(false, false);
+			return (this->*compareExchangeTable[sizePrefix][w])(modrm);
+		}
+		if ((second & 0b1111'1110) == 0xC0) {
+			uint8_t modrm = readImmediate(false, false);
+			return (this->*exchangeAddTable[sizePrefix][w])(modrm);
+		}
+		return raise(Exception::InvalidOpcode);
+	};
+}
@@ -1,15 +1,81 @@
 #include "CPU.hpp"
 
+namespace {
+	// jcc rel8, loop/jcxz
+	bool isConditionalJump(uint8_t opcode) {
+		return (opcode & 0xF0) == 0x70 || (opcode & 0xFC) == 0xE0;
+	}
+}
 
 CPU::CPU(Memory* memory) :
 	memory(memory),
-	registers() {
+	registers(),
+	decodeCache(memory) {
 	registers.set(Registers::Reg::EIP, 0x00000000);
+	// stdin, stdout and stderr
+	files.assign(3, { -1, true, true, false });
 
 	initInstructions();
 }
 
-void CPU::run() {
+CPU::State CPU::run(uint64_t budget) {
+	this->state = State::Stopped;
+	this->metrics = &Metrics::local();
+	ExecutionCounts start = { this->metrics->get(Metric::Instructions), this->metrics->get(Metric::Decoded), this->metrics->get(Metric::Fused) };
+	if (this->perfCounters != nullptr) {
+		this->perfCounters->start();
+	}
+
+	// an access outside guest memory jumps back into executeTrapped() instead of throwing,
+	// the trap is disarmed when a C++ exception leaves execute() too
+	{
+		Memory::FaultTrapScope trap(&this->faultTrap);
+		while (true) {
+			uint64_t executed = this->metrics->get(Metric::Instructions);
+			if (!executeTrapped(budget)) {
+				break;
+			}
+
+			executed = this->metrics->get(Metric::Instructions) - executed;
+			if (!raise(Exception::PageFault, (uint32_t)this->faultTrap.address, this->faultTrap.write)) {
+				break;
+			}
+			if (executed >= budget) {
+				this->state = State::Yielded;
+				break;
+			}
+			budget -= executed;
+		}
+	}
+
+	if (this->perfCounters != nullptr) {
+		this->perfCounters->stop();
+	}
+
+	this->executionCounts.instructions += this->metrics->get(Metric::Instructions) - start.instructions;
+	this->executionCounts.decoded += this->metrics->get(Metric::Decoded) - start.decoded;
+	this->executionCounts.fused += this->metrics->get(Metric::Fused) - start.fused;
+	return this->state;
+}
+
+// Runs execute() until it returns, true if an access outside guest memory
+// jumped back instead. No local changes after setjmp(), longjmp() can't clobber one.
+bool CPU::executeTrapped(uint64_t budget) {
+	if (setjmp(this->faultTrap.jump) != 0) {
+		return true;
+	}
+	if (this->instrumentation != nullptr) {
+		execute<true>(budget);
+	}
+	else {
+		execute<false>(budget);
+	}
+	return false;
+}
+
+template<bool instrumented>
+void CPU::execute(uint64_t budget) {
+	bool sampling = (this->perfCounters != nullptr && this->perfCounters->isSampling());
 	while (true) {
 
 		uint32_t eip = this->registers.get(Registers::Reg::EIP);
@@ -35,19 +101,67 @@ void CPU::run() {
 			}
 		}
 
-		uint8_t opcode = readImmediate(false, false);
+		// faults while decoding point to the instruction too
+		this->instructionEip = eip;
+
+		// drop the code any thread overwrote since the last instruction,
+		// entries are not touched again until it executed
+		this->decodeCache.sync();
+		const DecodeCache::Entry* entry = this->decodeCache.lookup(eip);
+		DecodeCache::Entry decoded;
+		if (entry == nullptr) {
+			if (this->perfCounters != nullptr) {
+				this->perfCounters->enter();
+				decoded = decode(eip);
+				this->perfCounters->leave(PerfCounters::Engine::Decoder);
+			}
+			else {
+				decoded = decode(eip);
+			}
+			entry = &decoded;
+			this->metrics->add(Metric::Decoded);
+		}
+		this->metrics->add(Metric::Instructions);
+
+		if (sampling) {
+			bool fused = (!instrumented && entry->fusion != DecodeCache::Fusion::None && !this->debug);
+			this->perfCounters->step(eip, eip + (fused ? entry->fusedLength : entry->length));
+		}
+
+		// the fused instruction runs only if the handler fell through
+		uint32_t fallThrough = eip + entry->length;
+		this->registers.set(Registers::Reg::EIP, fallThrough);
+		this->repPrefix = entry->repPrefix;
+		this->lockPrefix = entry->lockPrefix;
 
-		bool sizePrefix = (opcode == 0x66);
-		if (sizePrefix) {
-			// if size prefix, read next opcode
-			opcode = readImmediate(false, false);
+		if constexpr (instrumented) {
+			this->instrumentation->eip = eip;
 		}
 
 		// execute instruction
-		bool result = this->instructions[opcode >> 2](opcode, sizePrefix);
+		bool result = this->instructions[entry->opcode >> 2](entry->opcode, entry->sizePrefix);
 		if (!result) {
 			break;
 		}
+
+		if constexpr (instrumented) {
+			uint32_t next = this->registers.get(Registers::Reg::EIP);
+			if (next != fallThrough || isConditionalJump(entry->opcode)) {
+				this->instrumentation->branch(eip, next);
+			}
+		}
+
+		// single stepping and instrumentation run the second instruction on its own, and so
+		// does a first one that faulted: EIP then points to it or to a signal handler
+		if (!instrumented && entry->fusion != DecodeCache::Fusion::None && !this->debug &&
+			this->registers.get(Registers::Reg::EIP) == fallThrough) {
+			runFused(*entry);
+		}
+
+		if (--budget == 0) {
+			this->state = State::Yielded;
+			break;
+		}
 	}
 }
 
@@ -90,9 +204,80 @@ void CPU::setDebug(bool debug) {
 	}
 }
 
+void CPU::setPerfCounters(PerfCounters* perfCounters) {
+	this->perfCounters = perfCounters;
+}
+
+void CPU::setInstrumentation(Instrumentation* instrumentation) {
+	this->instrumentation = instrumentation;
+	bool memoryAccesses = (instrumentation != nullptr && instrumentation->hasMemoryAccesses());
+	this->memory->setInstrumentation(memoryAccesses ? instrumentation : nullptr);
+}
+
+const ExecutionCounts& CPU::getExecutionCounts() {
+	return this->executionCounts;
+}
+
+void CPU::setHostFiles(int input, int output) {
+	this->files[0] = { input, true, false, false };
+	this->files[1] = { output, true, false, false };
+	this->files[2] = { output, true, false, false };
+}
+
+const CPU::Wait& CPU::getWait() {
+	return this->wait;
+}
+
+void CPU::setSyscallLog(SyscallLog* syscallLog) {
+	this->syscallLog = syscallLog;
+}
+
+void CPU::setDecodeCacheFile(DecodeCacheFile* decodeCacheFile) {
+	this->decodeCacheFile = decodeCacheFile;
+}
+
+DecodeCache& CPU::getDecodeCache() {
+	return this->decodeCache;
+}
+
+DecodeCache::Entry CPU::decode(uint32_t eip) {
+	DecodeCache::Entry entry = {};
+	this->decodeCache.watch(eip);
+	if (this->decodeCacheFile != nullptr && this->decodeCacheFile->find(eip, entry)) {
+		this->metrics->add(Metric::DecodeCacheFileHits);
+		this->decodeCache.insert(eip, entry);
+		return entry;
+	}
+
+	uint8_t opcode = readImmediate(false, false);
+
+	while (true) {
+		// read prefixes until the opcode
+		if (opcode == 0x66) {
+			entry.sizePrefix = true;
+		}
+		else if (opcode == 0xF2 || opcode == 0xF3) {
+			entry.repPrefix = opcode;
+		}
+		else if (opcode == 0xF0) {
+			entry.lockPrefix = true;
+		}
+		else {
+			break;
+		}
+		opcode = readImmediate(false, false);
+	}
+
+	entry.opcode = opcode;
+	entry.length = this->registers.get(Registers::Reg::EIP) - eip;
+	fuse(eip, entry);
+	this->decodeCache.insert(eip, entry);
+	return entry;
+}
+
 uint32_t CPU::readImmediate(bool w, bool bit16) {
 	uint32_t eip = this->registers.get(Registers::Reg::EIP);
-	uint32_t value = this->memory->read<uint32_t>(eip);
+	uint32_t value = this->memory->fetch<uint32_t>(eip);
 	int size = (w ? (bit16 ? 2 : 4) : 1);
 	uint32_t mask = (0xff'ff'ff'ffull << (size * 8));
 	mask = ~mask;
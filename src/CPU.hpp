@@ -2,34 +2,391 @@
 
 #include "Memory.hpp"
 #include "Registers.hpp"
+#include "SyscallLog.hpp"
+#include "DecodeCache.hpp"
+#include "DecodeCacheFile.hpp"
+#include "PerfCounters.hpp"
+#include "Metrics.hpp"
 #include <array>
+#include <vector>
+#include <span>
 #include <functional>
 #include <limits>
 
+class GuestThreads;
+
 class CPU {
 public:
+	// why run() returned
+	enum class State : uint8_t {
+		// the guest exited or hit an instruction it can't run
+		Stopped,
+		// a syscall waits for the host file in getWait(), run() again
+		// when it is ready to repeat the syscall
+		Blocked,
+		// the instruction budget passed to run() was used up
+		Yielded,
+		// a syscall left its I/O in getIoRequest() to the caller,
+		// pass the result to completeIo() before running again
+		Io
+	};
+
+	// host file a blocked guest waits for
+	struct Wait {
+		int fd = -1;
+		// writable instead of readable
+		bool output = false;
+	};
+
+	// read or write of a host file on guest memory
+	struct IoRequest {
+		bool output = false;
+		int fd = -1;
+		uint8_t* buffer = nullptr;
+		uint32_t size = 0;
+		// -1 for the file position
+		int64_t offset = -1;
+	};
+
+	// guest exceptions by vector number
+	enum class Exception : uint8_t {
+		// #DE, division by zero or a quotient that doesn't fit
+		DivideError = 0,
+		// #UD, an opcode the CPU doesn't know
+		InvalidOpcode = 6,
+		// #GP, an instruction a user mode guest may not run
+		GeneralProtection = 13,
+		// #PF, an access outside guest memory
+		PageFault = 14
+	};
+
+	// EIP points back to the faulting instruction, which has no effect
+	struct Fault {
+		Exception exception = Exception::InvalidOpcode;
+		uint32_t eip = 0;
+		// accessed address of a #PF
+		uint32_t address = 0;
+		bool write = false;
+	};
+
+	enum class FaultAction : uint8_t {
+		// continue at EIP, the faulting instruction unless the handler changed it
+		Resume,
+		// the guest's signal handler, or stop if it has none
+		Deliver,
+		// stop without printing the fault
+		Stop
+	};
+
+	using FaultHandler = std::function<FaultAction(CPU& cpu, const Fault& fault)>;
+
 	CPU(Memory* memory);
+	~CPU();
+	CPU(const CPU&) = delete;
+	CPU& operator=(const CPU&) = delete;
 
-	void run();
+	// Run until the guest stops, blocks or executed budget instructions.
+	State run(uint64_t budget = std::numeric_limits<uint64_t>::max());
 
 	Memory* getMemory();
 	Registers& getRegisters();
 	void setIP(uint32_t entry);
 	void print();
 	void setDebug(bool debug);
+	// Record or replay the nondeterministic syscall inputs, nullptr for none.
+	void setSyscallLog(SyscallLog* syscallLog);
+	// Entries saved by an earlier run used before decoding, nullptr for none.
+	void setDecodeCacheFile(DecodeCacheFile* decodeCacheFile);
+	DecodeCache& getDecodeCache();
+	// Host counters enabled while run() executes, nullptr for none.
+	void setPerfCounters(PerfCounters* perfCounters);
+	const ExecutionCounts& getExecutionCounts();
+	// Nonblocking host files behind the guest's stdin and stdout/stderr,
+	// used instead of the console. A syscall that would block makes run()
+	// return State::Blocked.
+	void setHostFiles(int input, int output);
+	const Wait& getWait();
+	// Let the caller of run() do the reads and writes of host files,
+	// so they can be queued on an asynchronous backend.
+	void setAsyncIo(bool asyncIo);
+	const IoRequest& getIoRequest();
+	// Result of the request as the syscall returns it, negative errno on failure.
+	void completeIo(int32_t result);
+	// Called first for every fault, before the guest sees it.
+	void setFaultHandler(FaultHandler faultHandler);
+	// The last fault, nullptr if there was none.
+	const Fault* getFault();
+	// Read stdin from data instead of the console and discard stdout and
+	// stderr, for running many inputs. data has to outlive the runs.
+	void setInput(std::span<const uint8_t> data);
+	// Close the files the guest opened and forget its signal handlers, as
+	// for a new process. Memory and registers are left to the caller.
+	void restart();
+	// Tool called for the loads, stores and branches of the guest, nullptr for none.
+	void setInstrumentation(Instrumentation* instrumentation);
+	// Threads started by the guest's clone, nullptr to fail clone with ENOSYS.
+	void setThreads(GuestThreads* threads);
+	// Handler, flags and restorer of every signal, then the blocked signals,
+	// as saved in checkpoints.
+	std::vector<uint32_t> getSignalState();
+	void setSignalState(std::span<const uint32_t> state);
+	// Files the guest opened itself and threads it started, which a checkpoint can't hold.
+	bool hasOpenedFiles();
+	bool hasStartedThreads();
 
 private:
+	// operation in bits 5-3 of the opcode or the reg field of group 1
+	enum class AluOp : uint8_t {
+		Add = 0,
+		Or = 1,
+		Adc = 2,
+		Sbb = 3,
+		And = 4,
+		Sub = 5,
+		Xor = 6,
+		Cmp = 7
+	};
+
+	enum class AluForm : uint8_t {
+		// op r/m, r
+		RmReg,
+		// op r, r/m
+		RegRm,
+		// op AL/AX/EAX, imm
+		AccImm,
+		// op r/m, imm
+		RmImm,
+		// op r/m16/32, imm8 sign extended
+		RmImm8
+	};
+
+	using AluHandler = void (CPU::*)(uint8_t modrm);
+
+	// operation in the reg field of group 2 (0xC0, 0xC1, 0xD0 - 0xD3)
+	enum class ShiftOp : uint8_t {
+		Rol = 0,
+		Ror = 1,
+		Rcl = 2,
+		Rcr = 3,
+		Shl = 4,
+		Shr = 5,
+		Sal = 6,
+		Sar = 7
+	};
+
+	enum class ShiftCount : uint8_t {
+		// 0xD0, 0xD1
+		One,
+		// 0xD2, 0xD3
+		CL,
+		// 0xC0, 0xC1
+		Imm8
+	};
+
+	// operation in the reg field of group 3 (0xF6, 0xF7)
+	enum class Group3Op : uint8_t {
+		Test = 0,
+		Test1 = 1,
+		Not = 2,
+		Neg = 3,
+		Mul = 4,
+		Imul = 5,
+		Div = 6,
+		Idiv = 7
+	};
+
+	// returns false if the instruction faulted
+	using Group3Handler = bool (CPU::*)(uint8_t modrm);
+
+	// register or decoded memory address of a r/m operand
+	struct RmOperand {
+		bool isRegister;
+		Registers::Reg reg;
+		uint32_t address;
+	};
+
 	Memory* memory;
 	Registers registers;
 	std::array<std::function<bool(uint8_t opcode, bool sizePrefix)>, 0b11'1111+1> instructions;
+	DecodeCache decodeCache;
 
 	bool debug = false;
+	SyscallLog* syscallLog = nullptr;
+	DecodeCacheFile* decodeCacheFile = nullptr;
+	PerfCounters* perfCounters = nullptr;
+	Instrumentation* instrumentation = nullptr;
+	// counters of the thread in run()
+	ThreadMetrics* metrics = nullptr;
+	ExecutionCounts executionCounts;
+	// 0xF2 (repne), 0xF3 (rep/repe) or 0 if the current instruction has no repeat prefix
+	uint8_t repPrefix = 0;
+	// the current instruction has a lock prefix
+	bool lockPrefix = false;
+	// host file behind a guest file descriptor
+	struct File {
+		// -1 for the console and while replaying
+		int fd = -1;
+		bool open = false;
+		// stdin and stdout of the emulator, read by lines and shown in green
+		bool console = false;
+		// opened by the guest, closed with its descriptor
+		bool owned = false;
+		// reads the input buffer, writes are discarded
+		bool buffer = false;
+	};
+
+	// indexed by guest file descriptor
+	std::vector<File> files;
+	State state = State::Stopped;
+	Wait wait;
+	bool asyncIo = false;
+	IoRequest ioRequest;
+	// syscall waiting for completeIo()
+	uint32_t ioSyscall = 0;
+	// stdin of setInput()
+	std::span<const uint8_t> input;
+	size_t inputOffset = 0;
+	// address of the first prefix of the current instruction
+	uint32_t instructionEip = 0;
+
+	// handler registered by the guest with signal() or sigaction()
+	struct GuestSignal {
+		// SIG_DFL (0), SIG_IGN (1) or the guest address
+		uint32_t handler = 0;
+		uint32_t flags = 0;
+		uint32_t restorer = 0;
+	};
+
+	FaultHandler faultHandler;
+	// armed in memory while run() executes
+	Memory::FaultTrap faultTrap;
+	Fault fault;
+	bool faulted = false;
+	// indexed by signal number
+	std::array<GuestSignal, 32> signals = {};
+	// signals whose handler is running
+	uint32_t blockedSignals = 0;
 
+	GuestThreads* threads = nullptr;
+	// thread id returned by clone and gettid, 1 for the first thread
+	uint32_t threadId = 1;
+	// cleared with a futex wake when the thread exits, 0 for none
+	uint32_t clearThreadId = 0;
+
+	bool executeTrapped(uint64_t budget);
+	template<bool instrumented>
+	void execute(uint64_t budget);
+	DecodeCache::Entry decode(uint32_t eip);
+	void fuse(uint32_t eip, DecodeCache::Entry& entry);
+	void runFused(const DecodeCache::Entry& entry);
 	uint32_t readImmediate(bool w, bool bit16);
 	uint32_t getEffectiveAddress(uint8_t mod, uint8_t rm);
 	void memoryWrite(bool w, bool bit16, uint32_t address, uint32_t value);
 	uint32_t memoryRead(bool w, bool bit16, uint32_t address);
 	uint32_t rmRead(bool w, bool bit16, uint8_t mod, uint8_t rm);
 	void rmWrite(bool w, bool bit16, uint8_t mod, uint8_t rm, uint32_t value);
+	RmOperand decodeRm(uint8_t modrm);
+	template<typename T>
+	T readRm(const RmOperand& operand);
+	template<typename T>
+	void writeRm(const RmOperand& operand, T value);
+	template<typename T, typename F>
+	T updateRm(const RmOperand& operand, F f);
+	// CF for adc and sbb, 0 for the other operations
+	template<AluOp op>
+	uint32_t aluCarryIn();
+	template<AluOp op, typename T>
+	T aluCompute(T value1, T value2);
+	template<AluOp op, typename T>
+	T aluCompute(T value1, T value2, uint32_t carryIn);
+	template<AluOp op, typename T, AluForm form>
+	void alu(uint8_t modrm);
+	template<typename T, AluForm form>
+	static std::array<AluHandler, 8> aluHandlers();
+	void compareFlags(uint32_t value1, uint32_t value2, uint32_t size);
+	template<ShiftOp op, typename T, ShiftCount count>
+	void shift(uint8_t modrm);
+	template<typename T, ShiftCount count>
+	static std::array<AluHandler, 8> shiftHandlers();
+	template<Group3Op op, typename T>
+	bool group3(uint8_t modrm);
+	template<typename T>
+	static std::array<Group3Handler, 8> group3Handlers();
+	bool raise(Exception exception, uint32_t address = 0, bool write = false);
+	bool deliverSignal(uint32_t signal);
+	void printFault();
+	bool sysSignal(uint32_t signal, uint32_t handler);
+	bool sysSigaction(uint32_t signal, uint32_t action, uint32_t oldAction);
+	bool sysSigreturn();
+	bool sysClone(uint32_t flags, uint32_t stack, uint32_t parentTid, uint32_t childTid);
+	bool sysFutex(uint32_t address, uint32_t operation, uint32_t value, uint32_t timeout);
+	bool exitThread();
+	bool isConsole(uint32_t fd);
+	const File* findFile(uint32_t fd);
+	bool blockOn(int fd, bool output);
+	bool fileRead(uint32_t syscall, uint32_t fd, uint32_t buffer, uint32_t size, int64_t offset);
+	bool fileWrite(uint32_t syscall, uint32_t fd, uint32_t buffer, uint32_t size, int64_t offset);
+	bool fileOpen(uint32_t path, uint32_t flags, uint32_t mode);
+	bool fileClose(uint32_t fd);
+	void finishIo(uint32_t syscall, int32_t result, const uint8_t* data);
+	// Append the result and the size bytes of data given to the guest to the syscall log.
+	void recordIo(uint32_t syscall, int32_t result, const uint8_t* data, size_t size);
+	int32_t replayResult(uint32_t syscall, uint32_t buffer);
+	void movs(bool w, bool bit16);
+	void cmps(bool w, bool bit16);
+	void stos(bool w, bool bit16);
+	void lods(bool w, bool bit16);
+	void scas(bool w, bool bit16);
 	void initInstructions();
+	void initAluInstructions();
+	void initShiftInstructions();
+	void initMulDivInstructions();
+	void initAtomicInstructions();
+	template<typename T>
+	bool exchange(uint8_t modrm);
+	template<typename T>
+	bool exchangeAdd(uint8_t modrm);
+	template<typename T>
+	bool compareExchange(uint8_t modrm);
 };
+
+inline CPU::RmOperand CPU::decodeRm(uint8_t modrm) {
+	uint8_t mod = (modrm & 0b1100'0000) >> 6;
+	uint8_t rm = modrm & 0b0000'0111;
+
+	if (mod == 0b11) {
+		return { true, (Registers::Reg)rm, 0 };
+	}
+	return { false, (Registers::Reg)rm, getEffectiveAddress(mod, rm) };
+}
+
+template<typename T>
+T CPU::readRm(const RmOperand& operand) {
+	if (operand.isRegister) {
+		return (T)this->registers.get(operand.reg, sizeof(T) > 1, sizeof(T) == 2);
+	}
+	return this->memory->read<T>(operand.address);
+}
+
+template<typename T>
+void CPU::writeRm(const RmOperand& operand, T value) {
+	if (operand.isRegister) {
+		this->registers.set(operand.reg, sizeof(T) > 1, sizeof(T) == 2, value);
+	}
+	else {
+		this->memory->write<T>(operand.address, value);
+	}
+}
+
+// Replace the operand with f(operand) and return the old value. A memory
+// operand is read and written as one atomic access, other threads see
+// either the old or the new value.
+template<typename T, typename F>
+T CPU::updateRm(const RmOperand& operand, F f) {
+	if (operand.isRegister) {
+		T value = readRm<T>(operand);
+		writeRm<T>(operand, f(value));
+		return value;
+	}
+	return this->memory->update<T>(operand.address, f);
+}
@@ -0,0 +1,270 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include "Memory.hpp"
+#include "CPU.hpp"
+
+// Snapshot of the whole VM state (registers, signal handlers and modified
+// memory) in a versioned binary file. Only dirty pages are stored, each one
+// compressed on its own, so a page can be restored without touching the rest
+// of the file. A guest with files it opened or threads it started can't be
+// saved, the checkpoint would lose them.
+//
+// File format (little endian):
+// [magic "VXM86CKP"] [u32 version]
+// [u64 memory size] [u32 page size] [u32 register count] [registers]
+// [u32 signal state count] [signal state as in CPU::getSignalState()]
+// [u32 page count]
+// pages: [u32 page index] [u8 encoding] [u32 payload size] [payload]
+class Checkpoint {
+public:
+	Checkpoint(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open()) {
+			throw std::runtime_error("Failed to open checkpoint");
+		}
+
+		file.seekg(0, std::ios::end);
+		size_t size = file.tellg();
+		file.seekg(0, std::ios::beg);
+		data.resize(size);
+		file.read((char*)data.data(), size);
+
+		if (size < sizeof(magic) || memcmp(data.data(), magic, sizeof(magic)) != 0) {
+			throw std::runtime_error("Invalid checkpoint");
+		}
+		position = sizeof(magic);
+		if (readValue<uint32_t>() != version) {
+			throw std::runtime_error("Unsupported checkpoint version");
+		}
+
+		memorySize = readValue<uint64_t>();
+		if (readValue<uint32_t>() != Memory::pageSize || readValue<uint32_t>() != registerCount) {
+			throw std::runtime_error("Incompatible checkpoint");
+		}
+		for (size_t i = 0; i < registerCount; i++) {
+			registerValues[i] = readValue<uint32_t>();
+		}
+		signalState.resize(readValue<uint32_t>());
+		for (uint32_t& value : signalState) {
+			value = readValue<uint32_t>();
+		}
+		pagesPosition = position;
+	}
+
+	// Size of the memory the checkpoint has to be restored into.
+	size_t getMemorySize() {
+		return this->memorySize;
+	}
+
+	void restore(CPU& cpu, Memory& memory) {
+		if (memory.getSize() != this->memorySize) {
+			throw std::runtime_error("Checkpoint memory size mismatch");
+		}
+
+		for (size_t i = 0; i < registerCount; i++) {
+			cpu.getRegisters().set(savedRegisters[i], registerValues[i]);
+		}
+		cpu.setSignalState(signalState);
+
+		position = pagesPosition;
+		uint32_t pageCount = readValue<uint32_t>();
+		std::vector<uint8_t> page(Memory::pageSize);
+
+		for (uint32_t i = 0; i < pageCount; i++) {
+			uint32_t index = readValue<uint32_t>();
+			Encoding encoding = (Encoding)readValue<uint8_t>();
+			uint32_t payloadSize = readValue<uint32_t>();
+			if (position + payloadSize > data.size()) {
+				throw std::runtime_error("Invalid checkpoint");
+			}
+
+			const uint8_t* payload = data.data() + position;
+			position += payloadSize;
+
+			size_t address = (size_t)index * Memory::pageSize;
+			size_t size = std::min(Memory::pageSize, memory.getSize() - std::min(address, memory.getSize()));
+
+			if (encoding == Encoding::Zero) {
+				std::fill(page.begin(), page.end(), 0);
+			}
+			else if (encoding == Encoding::Raw && payloadSize == size) {
+				memcpy(page.data(), payload, size);
+			}
+			else if (encoding == Encoding::PackBits) {
+				unpack(payload, payloadSize, page.data(), size);
+			}
+			else {
+				throw std::runtime_error("Invalid checkpoint");
+			}
+
+			memory.write(address, page.data(), size);
+		}
+	}
+
+	static void save(const std::string& path, CPU& cpu, Memory& memory) {
+		if (cpu.hasOpenedFiles() || cpu.hasStartedThreads()) {
+			throw std::runtime_error("Checkpoint of a guest with opened files or threads isn't supported");
+		}
+
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			throw std::runtime_error("Failed to create checkpoint");
+		}
+
+		auto writeValue = [&](auto value) {
+			file.write((const char*)&value, sizeof(value));
+		};
+
+		file.write(magic, sizeof(magic));
+		writeValue(version);
+		writeValue((uint64_t)memory.getSize());
+		writeValue((uint32_t)Memory::pageSize);
+		writeValue((uint32_t)registerCount);
+		for (size_t i = 0; i < registerCount; i++) {
+			writeValue(cpu.getRegisters().get(savedRegisters[i]));
+		}
+		std::vector<uint32_t> signals = cpu.getSignalState();
+		writeValue((uint32_t)signals.size());
+		for (uint32_t value : signals) {
+			writeValue(value);
+		}
+
+		std::vector<size_t> pages;
+		memory.forEachDirtyPage([&](size_t page) {
+			pages.push_back(page);
+		});
+		writeValue((uint32_t)pages.size());
+
+		std::vector<uint8_t> packed;
+		for (size_t index : pages) {
+			size_t address = index * Memory::pageSize;
+			size_t size = std::min(Memory::pageSize, memory.getSize() - address);
+			const uint8_t* page = memory.view(address, size);
+
+			writeValue((uint32_t)index);
+			if (std::all_of(page, page + size, [](uint8_t byte) { return byte == 0; })) {
+				writeValue((uint8_t)Encoding::Zero);
+				writeValue((uint32_t)0);
+				continue;
+			}
+
+			pack(page, size, packed);
+			if (packed.size() < size) {
+				writeValue((uint8_t)Encoding::PackBits);
+				writeValue((uint32_t)packed.size());
+				file.write((const char*)packed.data(), packed.size());
+			}
+			else {
+				writeValue((uint8_t)Encoding::Raw);
+				writeValue((uint32_t)size);
+				file.write((const char*)page, size);
+			}
+		}
+
+		if (!file.good()) {
+			throw std::runtime_error("Failed to write checkpoint");
+		}
+	}
+
+private:
+	enum class Encoding : uint8_t {
+		Zero = 0,
+		Raw = 1,
+		PackBits = 2
+	};
+
+	static constexpr char magic[8] = { 'V', 'X', 'M', '8', '6', 'C', 'K', 'P' };
+	static constexpr uint32_t version = 2;
+	static constexpr size_t registerCount = 10;
+	static constexpr Registers::Reg savedRegisters[registerCount] = {
+		Registers::Reg::EAX, Registers::Reg::ECX, Registers::Reg::EDX, Registers::Reg::EBX,
+		Registers::Reg::ESP, Registers::Reg::EBP, Registers::Reg::ESI, Registers::Reg::EDI,
+		Registers::Reg::EIP, Registers::Reg::EFLAGS
+	};
+
+	std::vector<uint8_t> data;
+	size_t position = 0;
+	size_t pagesPosition = 0;
+	size_t memorySize = 0;
+	uint32_t registerValues[registerCount] = {};
+	std::vector<uint32_t> signalState;
+
+	template<typename T>
+	T readValue() {
+		if (position + sizeof(T) > data.size()) {
+			throw std::runtime_error("Invalid checkpoint");
+		}
+
+		T value;
+		memcpy(&value, data.data() + position, sizeof(T));
+		position += sizeof(T);
+		return value;
+	}
+
+	// PackBits run-length encoding:
+	// [n < 128] [n + 1 literal bytes] or [n > 128] [byte repeated 257 - n times]
+	static void pack(const uint8_t* input, size_t size, std::vector<uint8_t>& output) {
+		output.clear();
+		size_t i = 0;
+		while (i < size) {
+			size_t run = 1;
+			while (i + run < size && run < 128 && input[i + run] == input[i]) {
+				run++;
+			}
+
+			if (run >= 2) {
+				output.push_back((uint8_t)(257 - run));
+				output.push_back(input[i]);
+				i += run;
+				continue;
+			}
+
+			// literal bytes until the next run of at least 2
+			size_t literal = 1;
+			while (i + literal < size && literal < 128 &&
+				!(i + literal + 1 < size && input[i + literal] == input[i + literal + 1])) {
+				literal++;
+			}
+
+			output.push_back((uint8_t)(literal - 1));
+			output.insert(output.end(), input + i, input + i + literal);
+			i += literal;
+		}
+	}
+
+	static void unpack(const uint8_t* input, size_t inputSize, uint8_t* output, size_t size) {
+		size_t i = 0;
+		size_t o = 0;
+		while (i < inputSize) {
+			uint8_t header = input[i++];
+			if (header < 128) {
+				size_t literal = header + 1;
+				if (i + literal > inputSize || o + literal > size) {
+					throw std::runtime_error("Invalid checkpoint");
+				}
+				memcpy(output + o, input + i, literal);
+				i += literal;
+				o += literal;
+			}
+			else if (header > 128) {
+				size_t run = 257 - header;
+				if (i >= inputSize || o + run > size) {
+					throw std::runtime_error("Invalid checkpoint");
+				}
+				memset(output + o, input[i++], run);
+				o += run;
+			}
+		}
+
+		if (o != size) {
+			throw std::runtime_error("Invalid checkpoint");
+		}
+	}
+};
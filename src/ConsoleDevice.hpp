@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <ostream>
+#include "Memory.hpp"
+#include "Metrics.hpp"
+
+// Console output through shared memory. The guest copies its text into a
+// ring buffer with plain stores and publishes it by storing the new head,
+// the host writes what was published in bulk. Only the first page, holding
+// head, tail and capacity, is claimed as a device: the ring behind it is
+// ordinary memory and keeps the fast path of the store TLB.
+//
+// Layout from the address of the device, all counts are free running:
+//   +0x0000 head, bytes the guest published
+//   +0x0004 tail, bytes the host wrote out
+//   +0x0008 capacity of the ring, a power of 2
+//   +0x1000 ring, byte n of the output at +0x1000 + n % capacity
+//
+// The host drains the ring when a published head leaves it half full,
+// before every sys_write of the guest to the console and when it exited.
+// So a guest publishing at most capacity / 2 bytes at a time always finds
+// room for them without reading the tail.
+class ConsoleDevice : public Device {
+public:
+	static constexpr uint32_t defaultAddress = 0x0e00'0000;
+	static constexpr uint32_t capacity = 0x1'0000;
+	static constexpr uint32_t ringOffset = 0x1000;
+	// the device and its ring
+	static constexpr uint32_t size = ringOffset + capacity;
+
+	// out nullptr discards the output
+	ConsoleDevice(Memory& memory, std::ostream* out, uint32_t address = defaultAddress) :
+		memory(memory),
+		out(out),
+		address(address) {
+		if (!memory.contains(address, size)) {
+			throw std::runtime_error("Console device outside memory");
+		}
+		uint32_t header[3] = { 0, 0, capacity };
+		memcpy(memory.writable(address, sizeof(header)), header, sizeof(header));
+		memory.attach(this, address, Memory::pageSize);
+	}
+
+	void store(uint32_t offset, uint32_t size) override {
+		// only a new head matters, the tail and capacity are the host's
+		if (offset >= 4) {
+			return;
+		}
+
+		// most heads leave the ring less than half full and need no lock
+		if (published() - this->tail.load(std::memory_order_relaxed) >= capacity / 2) {
+			std::lock_guard lock(this->mutex);
+			drain();
+		}
+	}
+
+	void flush() override {
+		std::lock_guard lock(this->mutex);
+		drain();
+	}
+
+private:
+	Memory& memory;
+	std::ostream* out;
+	uint32_t address;
+	// bytes written out, changed under the mutex; the guest's copy is only informational
+	std::atomic<uint32_t> tail = 0;
+	std::mutex mutex;
+
+	uint32_t published() {
+		uint32_t head;
+		memcpy(&head, this->memory.view(this->address, 4), 4);
+		return head;
+	}
+
+	void drain() {
+		uint32_t head = published();
+		uint32_t tail = this->tail.load(std::memory_order_relaxed);
+		uint32_t count = head - tail;
+		if (count == 0) {
+			return;
+		}
+		// the guest overran the ring, the oldest bytes are lost
+		if (count > capacity) {
+			tail = head - capacity;
+			count = capacity;
+		}
+
+		const uint8_t* ring = this->memory.view(this->address + ringOffset, capacity);
+		uint32_t from = tail % capacity;
+		uint32_t first = std::min(count, capacity - from);
+		if (this->out != nullptr) {
+			this->out->write((const char*)ring + from, first);
+			this->out->write((const char*)ring, count - first);
+		}
+		Metrics::local().add(Metric::IoBytesWritten, count);
+
+		this->tail.store(head, std::memory_order_relaxed);
+		memcpy(this->memory.writable(this->address + 4, 4), &head, 4);
+	}
+};
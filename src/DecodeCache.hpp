@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include "Memory.hpp"
+
+// Prefixes and opcode of already executed instructions.
+// Direct-mapped on the low bits of the address, so a lookup is a single load
+// and a tag compare. Every page with cached entries is write-protected in
+// Memory, the first write to it from any thread advances the generation of
+// the page. The CPU owning the cache calls sync() before every instruction,
+// which drops the entries of such pages; no other thread touches the cache.
+class DecodeCache {
+public:
+	// instruction executed together with the cached one in a single dispatch
+	enum class Fusion : uint8_t {
+		None,
+		// jcc rel8 after an instruction setting the flags
+		Jcc,
+		// jmp rel8/32
+		Jmp,
+		// mov ebp, esp after push ebp
+		MovEbpEsp,
+		// ret after pop ebp
+		Ret
+	};
+
+	// bump when decode() or the fusion rules change what an entry holds
+	static constexpr uint32_t rulesVersion = 1;
+
+	struct Entry {
+		uint32_t eip;
+		uint8_t opcode;
+		// bytes taken by the prefixes and the opcode, 0 if the entry is empty
+		uint8_t length;
+		bool sizePrefix;
+		uint8_t repPrefix;
+		// 0xF0, the memory operand is read and written as one atomic access
+		bool lockPrefix;
+		Fusion fusion;
+		// cccn of a fused jcc
+		uint8_t condition;
+		// bytes taken by both instructions
+		uint8_t fusedLength;
+		// destination of a fused jcc or jmp
+		uint32_t target;
+	};
+
+	DecodeCache(Memory* memory) :
+		memory(memory),
+		entries(new Entry[entryCount]()),
+		codeWrites(memory->getCodeWrites()) {
+	}
+
+	DecodeCache(const DecodeCache&) = delete;
+	DecodeCache& operator=(const DecodeCache&) = delete;
+
+	// Cached entry for eip or nullptr if it has to be decoded.
+	const Entry* lookup(uint32_t eip) {
+		const Entry* entry = &entries[eip % entryCount];
+		return (entry->eip == eip && entry->length != 0) ? entry : nullptr;
+	}
+
+	// Write-protect the page of eip before its code is read, so a write
+	// racing with the decode still reaches sync() and drops the entry.
+	void watch(uint32_t eip) {
+		uint32_t page = eip / Memory::pageSize;
+		if (!pages.contains(page)) {
+			memory->protectCode(page);
+			pages[page] = memory->getCodeGeneration(page);
+		}
+	}
+
+	// eip has to be watched since the last sync().
+	void insert(uint32_t eip, Entry entry) {
+		if ((eip % Memory::pageSize) + entry.length > Memory::pageSize) {
+			// instructions crossing a page are decoded every time
+			return;
+		}
+
+		entry.eip = eip;
+		entries[eip % entryCount] = entry;
+	}
+
+	// Drop the entries of pages written since they were watched. Returns true
+	// if it dropped any, entries looked up before are stale then.
+	bool sync() {
+		uint64_t writes = memory->getCodeWrites();
+		if (writes == codeWrites) {
+			return false;
+		}
+		return syncPages(writes);
+	}
+
+	void invalidate(size_t page) {
+		// entries of a page are in one window of pageSize slots
+		size_t from = (page * Memory::pageSize) % entryCount;
+		for (size_t i = from; i < from + Memory::pageSize; i++) {
+			if (entries[i].eip / Memory::pageSize == page) {
+				entries[i].length = 0;
+			}
+		}
+	}
+
+	template<typename F>
+	void forEachEntry(F f) {
+		for (size_t i = 0; i < entryCount; i++) {
+			if (entries[i].length != 0) {
+				f(entries[i]);
+			}
+		}
+	}
+
+private:
+	static constexpr size_t entryCount = 0x1'0000;
+
+	Memory* memory;
+	std::unique_ptr<Entry[]> entries;
+	// watched pages and their generation when they were
+	std::unordered_map<uint32_t, uint32_t> pages;
+	// Memory::getCodeWrites() at the last sync()
+	uint64_t codeWrites;
+
+	bool syncPages(uint64_t writes) {
+		codeWrites = writes;
+		bool dropped = false;
+		for (auto it = pages.begin(); it != pages.end();) {
+			if (memory->getCodeGeneration(it->first) != it->second) {
+				invalidate(it->first);
+				it = pages.erase(it);
+				dropped = true;
+			}
+			else {
+				it++;
+			}
+		}
+		return dropped;
+	}
+};
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <filesystem>
+#include <type_traits>
+#include <cstddef>
+#include "Memory.hpp"
+#include "DecodeCache.hpp"
+#include "Hash.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define VXM86_MMAP
+#endif
+
+// Decode cache entries saved from an earlier run of the same image.
+// The file is named after the hash of the loaded segments and mapped
+// read-only, so processes running the same binary share its pages.
+// The entries of a page are used only after the page content is checked
+// against the hash saved with them, on the first miss in that page.
+//
+// File format (little endian):
+// [magic "VXM86DCC"] [u32 version] [u32 page size] [u64 image hash] [u64 build id]
+// [u32 page count] [u32 entry count]
+// pages: [u32 page index] [u32 first entry] [u32 entry count] [u32 reserved] [u64 content hash]
+// entries sorted by address: [DecodeCache::Entry]
+class DecodeCacheFile {
+public:
+	// Open the cache of the image in directory, missing or outdated files are ignored.
+	DecodeCacheFile(const std::string& directory, uint64_t imageHash, Memory* memory) :
+		path(fileName(directory, imageHash)),
+		imageHash(imageHash),
+		memory(memory) {
+		map();
+
+		if (size < sizeof(Header)) {
+			return;
+		}
+		Header header;
+		memcpy(&header, data, sizeof(header));
+		if (memcmp(header.magic, magic, sizeof(magic)) != 0 || header.version != version ||
+			header.pageSize != Memory::pageSize || header.imageHash != imageHash || header.buildId != buildId() ||
+			sizeof(Header) + (size_t)header.pageCount * sizeof(Page) + (size_t)header.entryCount * sizeof(DecodeCache::Entry) > size) {
+			return;
+		}
+
+		// find() relies on sorted pages whose entries are inside the file
+		const Page* filePages = (const Page*)(data + sizeof(Header));
+		for (size_t i = 0; i < header.pageCount; i++) {
+			if ((uint64_t)filePages[i].firstEntry + filePages[i].entryCount > header.entryCount ||
+				(i > 0 && filePages[i].index <= filePages[i - 1].index)) {
+				return;
+			}
+		}
+
+		pages = filePages;
+		pageCount = header.pageCount;
+		entries = (const DecodeCache::Entry*)(data + sizeof(Header) + pageCount * sizeof(Page));
+		entryCount = header.entryCount;
+		pageStates.reset(new std::atomic<uint64_t>[pageCount]());
+	}
+
+	DecodeCacheFile(const DecodeCacheFile&) = delete;
+	DecodeCacheFile& operator=(const DecodeCacheFile&) = delete;
+
+	~DecodeCacheFile() {
+		unmap();
+	}
+
+	// Saved entry for eip if its page still has the content it was decoded
+	// from. The page of eip has to be write-protected, so writes to it
+	// advance its generation. CPUs on several threads may call it.
+	bool find(uint32_t eip, DecodeCache::Entry& entry) {
+		const Page* page = std::lower_bound(pages, pages + pageCount, eip / Memory::pageSize,
+			[](const Page& page, size_t index) { return page.index < index; });
+		if (page == pages + pageCount || page->index != eip / Memory::pageSize) {
+			return false;
+		}
+
+		// the content is checked again once the page was written, a thread
+		// racing with another one at worst checks it twice
+		uint32_t generation = memory->getCodeGeneration(page->index);
+		std::atomic<uint64_t>& state = pageStates[page - pages];
+		uint64_t checked = state.load(std::memory_order_relaxed);
+		if ((checked & checkedBit) == 0 || (uint32_t)(checked >> 2) != generation) {
+			bool valid = contentHash(*memory, page->index) == page->contentHash;
+			checked = ((uint64_t)generation << 2) | checkedBit | (valid ? validBit : 0);
+			state.store(checked, std::memory_order_relaxed);
+		}
+		if ((checked & validBit) == 0) {
+			return false;
+		}
+
+		const DecodeCache::Entry* first = entries + page->firstEntry;
+		const DecodeCache::Entry* last = first + page->entryCount;
+		const DecodeCache::Entry* found = std::lower_bound(first, last, eip,
+			[](const DecodeCache::Entry& entry, uint32_t eip) { return entry.eip < eip; });
+		if (found == last || found->eip != eip) {
+			return false;
+		}
+
+		entry = *found;
+		return true;
+	}
+
+	size_t getEntryCount() {
+		return this->entryCount;
+	}
+
+	// Write all entries of cache, replacing the file atomically.
+	void save(DecodeCache& cache) {
+		std::vector<DecodeCache::Entry> saved;
+		cache.forEachEntry([&](const DecodeCache::Entry& entry) {
+			saved.push_back(entry);
+		});
+		if (saved.size() <= this->entryCount) {
+			// nothing new since the file was written
+			return;
+		}
+		std::sort(saved.begin(), saved.end(), [](const DecodeCache::Entry& a, const DecodeCache::Entry& b) {
+			return a.eip < b.eip;
+		});
+
+		std::vector<Page> savedPages;
+		for (size_t i = 0; i < saved.size(); i++) {
+			uint32_t index = saved[i].eip / Memory::pageSize;
+			if (savedPages.empty() || savedPages.back().index != index) {
+				savedPages.push_back({ index, (uint32_t)i, 0, 0, contentHash(*memory, index) });
+			}
+			savedPages.back().entryCount++;
+		}
+
+		std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+		std::string temporary = path + ".tmp" + std::to_string((uintptr_t)this);
+		{
+			std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+			if (!file.is_open()) {
+				throw std::runtime_error("Failed to create decode cache");
+			}
+
+			Header header = {};
+			memcpy(header.magic, magic, sizeof(magic));
+			header.version = version;
+			header.pageSize = Memory::pageSize;
+			header.imageHash = imageHash;
+			header.buildId = buildId();
+			header.pageCount = (uint32_t)savedPages.size();
+			header.entryCount = (uint32_t)saved.size();
+
+			file.write((const char*)&header, sizeof(header));
+			file.write((const char*)savedPages.data(), savedPages.size() * sizeof(Page));
+			file.write((const char*)saved.data(), saved.size() * sizeof(DecodeCache::Entry));
+			if (!file.good()) {
+				throw std::runtime_error("Failed to write decode cache");
+			}
+		}
+
+		// readers keep the old file mapped until they exit
+		std::filesystem::rename(temporary, path);
+	}
+
+private:
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t pageSize;
+		uint64_t imageHash;
+		uint64_t buildId;
+		uint32_t pageCount;
+		uint32_t entryCount;
+	};
+
+	struct Page {
+		uint32_t index;
+		uint32_t firstEntry;
+		uint32_t entryCount;
+		uint32_t reserved;
+		uint64_t contentHash;
+	};
+
+	// bits of a page state below the code generation it was checked at
+	static constexpr uint64_t checkedBit = 1;
+	static constexpr uint64_t validBit = 2;
+
+	static_assert(std::is_trivially_copyable_v<DecodeCache::Entry>);
+
+	static constexpr char magic[8] = { 'V', 'X', 'M', '8', '6', 'D', 'C', 'C' };
+	static constexpr uint32_t version = 3;
+
+	std::string path;
+	uint64_t imageHash;
+	Memory* memory;
+
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+	// file content when it can't be mapped
+	std::vector<uint8_t> buffer;
+
+	const Page* pages = nullptr;
+	size_t pageCount = 0;
+	const DecodeCache::Entry* entries = nullptr;
+	size_t entryCount = 0;
+	// per page, 0 until its content was checked
+	std::unique_ptr<std::atomic<uint64_t>[]> pageStates;
+
+	// Layout of an entry and version of the rules filling it, entries saved
+	// by a build that decodes or fuses differently are not used.
+	static uint64_t buildId() {
+		const uint64_t build[] = {
+			sizeof(DecodeCache::Entry), offsetof(DecodeCache::Entry, fusion), offsetof(DecodeCache::Entry, target),
+			sizeof(DecodeCache::Fusion), DecodeCache::rulesVersion
+		};
+		return fnv1a(build, sizeof(build));
+	}
+
+	static std::string fileName(const std::string& directory, uint64_t imageHash) {
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.dcc", (unsigned long long)imageHash);
+		return (std::filesystem::path(directory) / name).string();
+	}
+
+	static uint64_t contentHash(Memory& memory, size_t page) {
+		size_t address = page * Memory::pageSize;
+		if (address >= memory.getSize()) {
+			return 0;
+		}
+		size_t size = std::min(Memory::pageSize, memory.getSize() - address);
+		return fnv1a(memory.view(address, size), size);
+	}
+
+	void map() {
+#ifdef VXM86_MMAP
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return;
+		}
+
+		struct stat status;
+		if (fstat(fd, &status) == 0 && status.st_size > 0) {
+			void* mapped = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (mapped != MAP_FAILED) {
+				data = (const uint8_t*)mapped;
+				size = status.st_size;
+			}
+		}
+		close(fd);
+#else
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open()) {
+			return;
+		}
+
+		file.seekg(0, std::ios::end);
+		buffer.resize(file.tellg());
+		file.seekg(0, std::ios::beg);
+		file.read((char*)buffer.data(), buffer.size());
+		data = buffer.data();
+		size = buffer.size();
+#endif
+	}
+
+	void unmap() {
+#ifdef VXM86_MMAP
+		if (data != nullptr) {
+			munmap((void*)data, size);
+		}
+#endif
+	}
+};
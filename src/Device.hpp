@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+// Device claiming a page aligned range of guest memory with Memory::attach().
+// The store TLB never lets its pages on the fast path, so every store of the
+// guest there reaches store() after the bytes landed in guest memory. Loads
+// read guest memory as usual, a device keeps the values the guest reads up
+// to date itself. Pages nobody claimed keep their fast path.
+class Device {
+public:
+	virtual ~Device() = default;
+
+	// After size bytes at offset into the range were written by the guest,
+	// on the thread of the writing CPU.
+	virtual void store(uint32_t offset, uint32_t size) = 0;
+
+	// Finish what the device buffered, before the guest's other output and
+	// when it exited.
+	virtual void flush() {
+	}
+};
@@ -1,64 +1,53 @@
 #pragma once
 
 #include <string>
-#include <fstream>
-#include <vector>
+#include <memory>
+#include <algorithm>
 #include "Memory.hpp"
+#include "Hash.hpp"
+#include "ImageCache.hpp"
 
 class ELFLoader {
 public:
-	ELFLoader(const std::string& path) {
-		std::ifstream file(path, std::ios::binary);
-		if (!file.is_open()) {
-			throw std::runtime_error("Failed to open file");
-		}
-
-		file.seekg(0, std::ios::end);
-		size_t size = file.tellg();
-		file.seekg(0, std::ios::beg);
-		data.resize(size);
-		file.read((char*)data.data(), size);
-
-		if (data[0] != 0x7f || data[1] != 'E' || data[2] != 'L' || data[3] != 'F') {
-			throw std::runtime_error("Invalid ELF file");
-		}
+	ELFLoader(const std::string& path) :
+		image(ImageCache::get(path)) {
 	}
 
 	// Load the ELF file into memory and return the entry point.
 	uint32_t load(Memory& memory) {
-		uint32_t entry = *(uint32_t*)(data.data() + 0x18);
-
-		uint32_t shoff = *(uint32_t*)(data.data() + 0x20);
-		uint16_t shentsize = *(uint16_t*)(data.data() + 0x2E);
-		uint16_t shnum = *(uint16_t*)(data.data() + 0x30);
-
-		uint32_t phoff = *(uint32_t*)(data.data() + 0x1C);
-		uint16_t phentsize = *(uint16_t*)(data.data() + 0x2A);
-		uint16_t phnum = *(uint16_t*)(data.data() + 0x2C);
+		for (const Image::Segment& segment : image->segments) {
+			uint64_t end = (uint64_t)segment.vaddr + segment.memsz;
+			uint64_t address = segment.vaddr;
+			while (address < end) {
+				uint32_t page = (uint32_t)(address / Memory::pageSize);
+				uint64_t pageEnd = std::min<uint64_t>((uint64_t)(page + 1) * Memory::pageSize, end);
+
+				auto shared = image->sharedPages.find(page);
+				if (shared == image->sharedPages.end() || !memory.share(page, image->sharedFile, shared->second)) {
+					// zero the part past filesz
+					uint64_t inSegment = address - segment.vaddr;
+					uint64_t fromFile = (inSegment < segment.filesz) ? std::min<uint64_t>(pageEnd - address, segment.filesz - inSegment) : 0;
+					memory.write(address, image->data.data() + segment.offset + inSegment, fromFile);
+					memory.clear(address + fromFile, pageEnd - address - fromFile);
+				}
+				address = pageEnd;
+			}
+		}
 
-		for (uint16_t i = 0; i < phnum; i++) {
-			// Type of segment.
-			uint32_t type = *(uint32_t*)(data.data() + phoff + i * phentsize + 0x00);
-			// Offset of the segment in the file image. 
-			uint32_t offset = *(uint32_t*)(data.data() + phoff + i * phentsize + 0x04);
-			// Virtual address of the segment in memory. 
-			uint32_t vaddr = *(uint32_t*)(data.data() + phoff + i * phentsize + 0x08);
-			// Size in bytes of the segment in the file image.
-			uint32_t filesz = *(uint32_t*)(data.data() + phoff + i * phentsize + 0x10);
-			// Size in bytes of the segment in memory.
-			uint32_t memsz = *(uint32_t*)(data.data() + phoff + i * phentsize + 0x14);
-			// Segment-dependent flags.
-			uint32_t flags = *(uint32_t*)(data.data() + phoff + i * phentsize + 0x18);
+		return image->entry;
+	}
 
-			//if (flags & 0x04) {
-			memory.clear(vaddr, memsz);
-			memory.write(vaddr, data.data() + offset, filesz);
-			//}
+	// Hash of the entry point and the segments as load() places them.
+	uint64_t hash() {
+		uint64_t hash = fnv1a(&image->entry, sizeof(image->entry));
+		for (const Image::Segment& segment : image->segments) {
+			hash = fnv1a(&segment.vaddr, sizeof(segment.vaddr), hash);
+			hash = fnv1a(&segment.memsz, sizeof(segment.memsz), hash);
+			hash = fnv1a(image->data.data() + segment.offset, segment.filesz, hash);
 		}
-
-		return entry;
+		return hash;
 	}
 
 private:
-	std::vector<uint8_t> data;
+	std::shared_ptr<const Image> image;
 };
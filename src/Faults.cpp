@@ -0,0 +1,252 @@
+#include "CPU.hpp"
+#include "GuestThreads.hpp"
+#include <cerrno>
+
+// Guest faults. An instruction that can't run raises its exception with EIP
+// pointing back to it and nothing else changed, accesses outside guest memory
+// arrive the same way from run() through the fault trap of the memory. The
+// fault handler of the host sees the fault first, then the guest gets the
+// signal Linux would send if it registered a handler, otherwise it stops
+// and the fault is printed. A host handler stopping the guest prints nothing.
+//
+// The signal frame is the i386 kernel's frame for signal() and sigaction()
+// without the FPU state, so guest handlers find the context where they expect
+// it and return through the code in the frame calling sigreturn.
+
+namespace {
+	constexpr uint32_t illegalInstruction = 4;
+	constexpr uint32_t floatingPointException = 8;
+	constexpr uint32_t killSignal = 9;
+	constexpr uint32_t segmentationFault = 11;
+	constexpr uint32_t stopSignal = 19;
+
+	// sa_flags
+	constexpr uint32_t restorerFlag = 0x0400'0000;
+	constexpr uint32_t noDeferFlag = 0x4000'0000;
+	constexpr uint32_t resetHandFlag = 0x8000'0000;
+
+	// struct sigcontext in 32 bit words
+	enum ContextWord : uint32_t {
+		Gs, Fs, Es, Ds,
+		Edi, Esi, Ebp, Esp, Ebx, Edx, Ecx, Eax,
+		Trapno, Err, Eip, Cs, Eflags, EspAtSignal, Ss,
+		Fpstate, Oldmask, Cr2,
+		ContextWords
+	};
+
+	// struct sigframe: return address, signal number, context, extra mask, return code
+	constexpr uint32_t contextWord = 2;
+	constexpr uint32_t retcodeWord = contextWord + ContextWords + 1;
+	constexpr uint32_t frameWords = retcodeWord + 2;
+
+	// popl %eax; movl $119, %eax; int $0x80
+	constexpr uint8_t retcode[8] = { 0x58, 0xB8, 0x77, 0x00, 0x00, 0x00, 0xCD, 0x80 };
+
+	// struct old_sigaction: handler, mask, flags, restorer
+	constexpr uint32_t sigactionSize = 16;
+
+	uint32_t signalOf(CPU::Exception exception) {
+		switch (exception) {
+			case CPU::Exception::DivideError:
+				return floatingPointException;
+			case CPU::Exception::InvalidOpcode:
+				return illegalInstruction;
+			default:
+				return segmentationFault;
+		}
+	}
+
+	const Registers::Reg contextRegisters[] = {
+		Registers::Reg::EDI, Registers::Reg::ESI, Registers::Reg::EBP, Registers::Reg::ESP,
+		Registers::Reg::EBX, Registers::Reg::EDX, Registers::Reg::ECX, Registers::Reg::EAX
+	};
+}
+
+void CPU::setFaultHandler(FaultHandler faultHandler) {
+	this->faultHandler = faultHandler;
+}
+
+const CPU::Fault* CPU::getFault() {
+	return this->faulted ? &this->fault : nullptr;
+}
+
+std::vector<uint32_t> CPU::getSignalState() {
+	std::vector<uint32_t> state;
+	for (const GuestSignal& signal : this->signals) {
+		state.insert(state.end(), { signal.handler, signal.flags, signal.restorer });
+	}
+	state.push_back(this->blockedSignals);
+	return state;
+}
+
+void CPU::setSignalState(std::span<const uint32_t> state) {
+	if (state.size() != this->signals.size() * 3 + 1) {
+		throw std::runtime_error("Invalid signal state");
+	}
+	for (size_t i = 0; i < this->signals.size(); i++) {
+		this->signals[i] = { state[i * 3], state[i * 3 + 1], state[i * 3 + 2] };
+	}
+	this->blockedSignals = state.back();
+}
+
+bool CPU::raise(Exception exception, uint32_t address, bool write) {
+	// a fault leaves EIP at the faulting instruction
+	this->registers.set(Registers::Reg::EIP, this->instructionEip);
+	this->fault = { exception, this->instructionEip, address, write };
+	this->faulted = true;
+
+	FaultAction action = FaultAction::Deliver;
+	if (this->faultHandler) {
+		action = this->faultHandler(*this, this->fault);
+	}
+
+	if (action == FaultAction::Resume) {
+		return true;
+	}
+	if (action == FaultAction::Deliver) {
+		if (deliverSignal(signalOf(exception))) {
+			return true;
+		}
+		printFault();
+	}
+
+	// like a fatal signal, the fault stops every thread of the guest
+	if (this->threads != nullptr) {
+		this->threads->exitGroup();
+	}
+	this->state = State::Stopped;
+	return false;
+}
+
+bool CPU::deliverSignal(uint32_t signal) {
+	GuestSignal action = this->signals[signal];
+	uint32_t mask = 1u << signal;
+	// like the kernel, a fault inside the handler of its own signal stops the guest
+	if (action.handler <= 1 || (this->blockedSignals & mask) != 0) {
+		return false;
+	}
+
+	// (ESP + 4) is a multiple of 16 when the handler starts, as after a call
+	uint32_t esp = this->registers.get(Registers::Reg::ESP);
+	uint32_t frame = ((esp - frameWords * 4) & ~15u) - 4;
+	if (frame > esp || !this->memory->contains(frame, frameWords * 4)) {
+		return false;
+	}
+
+	std::array<uint32_t, frameWords> words = {};
+	words[0] = ((action.flags & restorerFlag) != 0) ? action.restorer : frame + retcodeWord * 4;
+	words[1] = signal;
+	uint32_t* context = &words[contextWord];
+	for (size_t i = 0; i < std::size(contextRegisters); i++) {
+		context[Edi + i] = this->registers.get(contextRegisters[i]);
+	}
+	context[Trapno] = (uint32_t)this->fault.exception;
+	// #PF error code: from user mode, bit 1 for a write
+	context[Err] = (this->fault.exception == Exception::PageFault) ? (0b100 | (this->fault.write ? 0b10 : 0)) : 0;
+	context[Eip] = this->registers.get(Registers::Reg::EIP);
+	context[Eflags] = this->registers.get(Registers::Reg::EFLAGS);
+	context[EspAtSignal] = esp;
+	context[Oldmask] = this->blockedSignals;
+	context[Cr2] = this->fault.address;
+	memcpy(&words[retcodeWord], retcode, sizeof(retcode));
+	this->memory->write(frame, (const uint8_t*)words.data(), sizeof(words));
+
+	if ((action.flags & resetHandFlag) != 0) {
+		this->signals[signal] = {};
+	}
+	if ((action.flags & noDeferFlag) == 0) {
+		this->blockedSignals |= mask;
+	}
+
+	this->registers.set(Registers::Reg::ESP, frame);
+	this->registers.set(Registers::Reg::EIP, action.handler);
+	this->registers.set(Registers::Reg::EAX, signal);
+	this->registers.set(Registers::Reg::ECX, 0);
+	this->registers.set(Registers::Reg::EDX, 0);
+	this->registers.setFlag(Registers::Flag::DF, false);
+	return true;
+}
+
+void CPU::printFault() {
+	std::cout << std::hex;
+	switch (this->fault.exception) {
+		case Exception::DivideError:
+			std::cout << "Divide error (#DE) at " << this->fault.eip;
+			break;
+		case Exception::InvalidOpcode:
+			std::cout << "Invalid opcode (#UD) at " << this->fault.eip << ":";
+			for (uint32_t i = 0; i < 4 && this->memory->contains(this->fault.eip + i, 1); i++) {
+				std::cout << " " << std::setw(2) << std::setfill('0') << (int)this->memory->read<uint8_t>(this->fault.eip + i);
+			}
+			std::cout << std::setfill(' ');
+			break;
+		case Exception::GeneralProtection:
+			std::cout << "General protection fault (#GP) at " << this->fault.eip;
+			break;
+		case Exception::PageFault:
+			std::cout << "Page fault (#PF) at " << this->fault.eip << (this->fault.write ? " writing " : " reading ") << this->fault.address;
+			break;
+	}
+	std::cout << std::dec << std::endl;
+}
+
+bool CPU::sysSignal(uint32_t signal, uint32_t handler) {
+	if (signal == 0 || signal >= this->signals.size() || signal == killSignal || signal == stopSignal) {
+		this->registers.set(Registers::Reg::EAX, (uint32_t)-EINVAL);
+		return true;
+	}
+
+	// the System V semantics of the system call: reset when delivered, not blocked
+	uint32_t previous = this->signals[signal].handler;
+	this->signals[signal] = { handler, resetHandFlag | noDeferFlag, 0 };
+	this->registers.set(Registers::Reg::EAX, previous);
+	return true;
+}
+
+bool CPU::sysSigaction(uint32_t signal, uint32_t action, uint32_t oldAction) {
+	if (signal == 0 || signal >= this->signals.size() || signal == killSignal || signal == stopSignal) {
+		this->registers.set(Registers::Reg::EAX, (uint32_t)-EINVAL);
+		return true;
+	}
+	if ((action != 0 && !this->memory->contains(action, sigactionSize)) ||
+		(oldAction != 0 && !this->memory->contains(oldAction, sigactionSize))) {
+		this->registers.set(Registers::Reg::EAX, (uint32_t)-EFAULT);
+		return true;
+	}
+
+	GuestSignal previous = this->signals[signal];
+	if (action != 0) {
+		// the mask is ignored, only the signal itself is blocked in its handler
+		this->signals[signal] = {
+			this->memory->read<uint32_t>(action),
+			this->memory->read<uint32_t>(action + 8),
+			this->memory->read<uint32_t>(action + 12)
+		};
+	}
+	if (oldAction != 0) {
+		this->memory->write<uint32_t>(oldAction, previous.handler);
+		this->memory->write<uint32_t>(oldAction + 4, 0);
+		this->memory->write<uint32_t>(oldAction + 8, previous.flags);
+		this->memory->write<uint32_t>(oldAction + 12, previous.restorer);
+	}
+	this->registers.set(Registers::Reg::EAX, 0);
+	return true;
+}
+
+bool CPU::sysSigreturn() {
+	// the return code popped the signal number, ESP points to the context
+	uint32_t esp = this->registers.get(Registers::Reg::ESP);
+	if (!this->memory->contains(esp, ContextWords * 4)) {
+		return raise(Exception::GeneralProtection);
+	}
+
+	std::array<uint32_t, ContextWords> context;
+	this->memory->read(esp, (uint8_t*)context.data(), sizeof(context));
+	for (size_t i = 0; i < std::size(contextRegisters); i++) {
+		this->registers.set(contextRegisters[i], context[Edi + i]);
+	}
+	this->registers.set(Registers::Reg::EIP, context[Eip]);
+	this->registers.set(Registers::Reg::EFLAGS, context[Eflags]);
+	this->blockedSignals = context[Oldmask];
+	return true;
+}
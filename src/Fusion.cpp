@@ -0,0 +1,155 @@
+#include "CPU.hpp"
+#include <cstring>
+
+// Pairs like cmp + jcc, push ebp + mov ebp, esp, pop ebp + ret and inc + jmp
+// are found when the first instruction is decoded. The first one runs through
+// its normal handler, the second one is executed here from the values stored
+// in the cache entry, without going through the dispatch loop again.
+
+namespace {
+	// longest pair considered for fusion
+	constexpr uint32_t maxFusedLength = 16;
+
+	// bytes taken by mod r/m, SIB and displacement
+	uint32_t modrmLength(const uint8_t* code) {
+		uint8_t mod = (code[0] & 0b1100'0000) >> 6;
+		uint8_t rm = code[0] & 0b0000'0111;
+		if (mod == 0b11) {
+			return 1;
+		}
+
+		uint32_t length = 1;
+		if (rm == 0b100) {
+			// SIB, the base takes the place of r/m
+			rm = code[1] & 0b0000'0111;
+			length++;
+		}
+
+		if (mod == 0b01) {
+			length += 1;
+		}
+		else if (mod == 0b10 || rm == 0b101) {
+			length += 4;
+		}
+		return length;
+	}
+}
+
+void CPU::fuse(uint32_t eip, DecodeCache::Entry& entry) {
+	// both instructions have to be on the page of the entry to be invalidated with it,
+	// a lock prefix may make the first one fault
+	if (entry.repPrefix != 0 || entry.lockPrefix || (eip % Memory::pageSize) + maxFusedLength > Memory::pageSize ||
+		(size_t)eip + maxFusedLength > this->memory->getSize()) {
+		return;
+	}
+
+	const uint8_t* code = this->memory->view(eip, maxFusedLength);
+	uint8_t opcode = entry.opcode;
+	uint32_t length = entry.length;
+	uint32_t immediateSize = entry.sizePrefix ? 2 : 4;
+	if (length + 6 > maxFusedLength) {
+		return;
+	}
+
+	// length of the first instruction
+	bool setsFlags = true;
+	if (opcode < 0x40 && (opcode & 0b111) < 0b110) {
+		// add/or/adc/sbb/and/sub/xor/cmp
+		if ((opcode & 0b100) == 0) {
+			length += modrmLength(code + length);
+		}
+		else {
+			length += (opcode & 1) ? immediateSize : 1;
+		}
+	}
+	else if (opcode >= 0x40 && opcode < 0x50) {
+		// inc/dec reg
+	}
+	else if (opcode >= 0x80 && opcode <= 0x83) {
+		length += modrmLength(code + length) + ((opcode == 0x81) ? immediateSize : 1);
+	}
+	else if (opcode == 0x84 || opcode == 0x85) {
+		// test r/m, r
+		length += modrmLength(code + length);
+	}
+	else if ((opcode == 0xF6 || opcode == 0xF7) && (code[length] & 0b0011'1000) == 0) {
+		// test r/m, imm
+		length += modrmLength(code + length) + ((opcode == 0xF7) ? immediateSize : 1);
+	}
+	else if ((opcode == 0x55 || opcode == 0x5D) && !entry.sizePrefix) {
+		// push ebp / pop ebp
+		setsFlags = false;
+	}
+	else {
+		return;
+	}
+
+	if (length + 5 > maxFusedLength) {
+		return;
+	}
+
+	// the second instruction, without prefixes
+	const uint8_t* next = code + length;
+	if (setsFlags && (next[0] & 0b1111'0000) == 0b0111'0000) {
+		entry.fusion = DecodeCache::Fusion::Jcc;
+		entry.condition = next[0] & 0b0000'1111;
+		entry.fusedLength = length + 2;
+		entry.target = eip + entry.fusedLength + (int32_t)(int8_t)next[1];
+	}
+	else if (next[0] == 0xEB) {
+		entry.fusion = DecodeCache::Fusion::Jmp;
+		entry.fusedLength = length + 2;
+		entry.target = eip + entry.fusedLength + (int32_t)(int8_t)next[1];
+	}
+	else if (next[0] == 0xE9) {
+		int32_t displacement;
+		memcpy(&displacement, next + 1, sizeof(displacement));
+		entry.fusion = DecodeCache::Fusion::Jmp;
+		entry.fusedLength = length + 5;
+		entry.target = eip + entry.fusedLength + displacement;
+	}
+	else if (opcode == 0x55 && ((next[0] == 0x89 && next[1] == 0xE5) || (next[0] == 0x8B && next[1] == 0xEC))) {
+		entry.fusion = DecodeCache::Fusion::MovEbpEsp;
+		entry.fusedLength = length + 2;
+	}
+	else if (opcode == 0x5D && next[0] == 0xC3) {
+		entry.fusion = DecodeCache::Fusion::Ret;
+		entry.fusedLength = length + 1;
+	}
+}
+
+void CPU::runFused(const DecodeCache::Entry& entry) {
+	// the first instruction may have overwritten the second one,
+	// EIP already points to it and it is decoded again on the next step
+	this->decodeCache.sync();
+	if (this->decodeCache.lookup(this->instructionEip) == nullptr) {
+		return;
+	}
+
+	uint32_t next = this->instructionEip + entry.fusedLength;
+	this->metrics->add(Metric::Instructions);
+	this->metrics->add(Metric::Fused);
+	switch (entry.fusion) {
+		case DecodeCache::Fusion::Jcc:
+			this->registers.set(Registers::Reg::EIP, this->registers.testCondition(entry.condition) ? entry.target : next);
+			break;
+		case DecodeCache::Fusion::Jmp:
+			this->registers.set(Registers::Reg::EIP, entry.target);
+			break;
+		case DecodeCache::Fusion::MovEbpEsp:
+			this->registers.set(Registers::Reg::EBP, this->registers.get(Registers::Reg::ESP));
+			this->registers.set(Registers::Reg::EIP, next);
+			break;
+		case DecodeCache::Fusion::Ret: {
+			// a fault points to the ret, the pop already happened
+			this->instructionEip = this->registers.get(Registers::Reg::EIP);
+			uint32_t esp = this->registers.get(Registers::Reg::ESP);
+			uint32_t eip = this->memory->read<uint32_t>(esp);
+			this->registers.set(Registers::Reg::EIP, eip);
+			this->registers.set(Registers::Reg::ESP, esp + 4);
+			break;
+		}
+		default:
+			break;
+	}
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <bit>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include "CPU.hpp"
+#include "ELFLoader.hpp"
+#include "Instrumentation.hpp"
+
+// AFL style edge coverage: a hit count for every pair of consecutive branch
+// targets, hashed into a 64 KB map.
+class Coverage : public Instrumentation {
+public:
+	static constexpr size_t mapSize = 0x1'0000;
+
+	Coverage() :
+		Instrumentation(false) {
+	}
+
+	void branch(uint32_t from, uint32_t to) override {
+		uint32_t location = (to * 0x9E37'79B1u) >> 16;
+		this->map[location ^ this->previous]++;
+		// shifted so A -> B and B -> A are different edges
+		this->previous = location >> 1;
+	}
+
+	void clear() {
+		this->map.fill(0);
+		this->previous = 0;
+	}
+
+	const std::array<uint8_t, mapSize>& getMap() {
+		return this->map;
+	}
+
+private:
+	std::array<uint8_t, mapSize> map = {};
+	uint32_t previous = 0;
+};
+
+// Fuzzes a guest through its stdin in this process. The guest is loaded
+// once, every input then starts from a snapshot taken right after loading:
+// only the pages the last input dirtied are copied back, and the decode
+// cache stays warm across inputs.
+//
+// Inputs come from the files in a directory, mutated AFL style. Inputs
+// reaching new edges or new hit count ranges are added to the corpus and
+// saved to the directory as id-<n>, inputs faulting at a new instruction as
+// crash-<n>.
+class Fuzzer {
+public:
+	// instructions an input may run before it counts as a hang
+	static constexpr uint64_t hangBudget = 0x100'0000;
+
+	Fuzzer(const std::string& path, const std::string& directory, Memory::Placement placement) :
+		memory(memorySize, placement),
+		cpu(&memory),
+		directory(directory),
+		random(std::random_device()()) {
+		ELFLoader loader(path);
+		this->cpu.setIP(loader.load(this->memory));
+		this->cpu.getRegisters().set(Registers::Reg::ESP, 0x0f'ff'ff'00);
+		this->registers = this->cpu.getRegisters();
+
+		for (size_t page : this->memory.takeDirtyPages()) {
+			size_t size = std::min(Memory::pageSize, this->memory.getSize() - page * Memory::pageSize);
+			const uint8_t* data = this->memory.view(page * Memory::pageSize, size);
+			this->snapshotPages[page] = this->snapshot.size();
+			this->snapshot.insert(this->snapshot.end(), data, data + size);
+			this->snapshot.resize(this->snapshotPages[page] + Memory::pageSize);
+		}
+
+		this->cpu.setInstrumentation(&this->coverage);
+		// every fault ends the input, the guest's own handlers don't run
+		this->cpu.setFaultHandler([](CPU&, const CPU::Fault&) { return CPU::FaultAction::Stop; });
+
+		for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+			if (entry.is_regular_file() && entry.path().filename().string().rfind("crash-", 0) != 0) {
+				std::ifstream file(entry.path(), std::ios::binary);
+				this->corpus.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+			}
+		}
+		if (this->corpus.empty()) {
+			this->corpus.emplace_back();
+		}
+	}
+
+	// Run runs inputs, 0 to keep going until the process is stopped.
+	void run(uint64_t runs) {
+		// the seeds go first, unchanged
+		size_t seeds = this->corpus.size();
+		for (size_t i = 0; i < seeds; i++) {
+			execute(this->corpus[i]);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		auto report = start;
+		while (runs == 0 || this->executions < runs) {
+			std::vector<uint8_t> input = mutate(this->corpus[this->random() % this->corpus.size()]);
+			if (execute(input)) {
+				write("id-", input);
+				this->corpus.push_back(std::move(input));
+			}
+
+			if ((this->executions & 0xFF) == 0) {
+				auto now = std::chrono::steady_clock::now();
+				if (now - report >= std::chrono::seconds(1)) {
+					report = now;
+					printStatus(now - start);
+				}
+			}
+		}
+		printStatus(std::chrono::steady_clock::now() - start);
+	}
+
+private:
+	static constexpr size_t memorySize = 0x0f'ff'ff'ff;
+	// mutated inputs don't grow past it
+	static constexpr size_t maxInputSize = 0x1000;
+
+	Memory memory;
+	CPU cpu;
+	Coverage coverage;
+	std::string directory;
+	std::mt19937_64 random;
+
+	Registers registers;
+	// content of the pages dirty after loading, pageSize bytes each
+	std::vector<uint8_t> snapshot;
+	std::unordered_map<size_t, size_t> snapshotPages;
+
+	std::vector<std::vector<uint8_t>> corpus;
+	// hit count classes seen for every edge
+	std::array<uint8_t, Coverage::mapSize> seen = {};
+	size_t edges = 0;
+	// faulting instructions already saved
+	std::unordered_set<uint64_t> crashSites;
+	uint64_t executions = 0;
+	uint64_t crashes = 0;
+	uint64_t hangs = 0;
+	uint64_t saved = 0;
+
+	void restore() {
+		for (size_t page : this->memory.takeDirtyPages()) {
+			auto found = this->snapshotPages.find(page);
+			this->memory.restorePage(page, (found != this->snapshotPages.end()) ? this->snapshot.data() + found->second : nullptr);
+		}
+		this->cpu.getRegisters() = this->registers;
+		this->cpu.restart();
+	}
+
+	// Run one input, true if it reached new coverage without crashing or hanging.
+	bool execute(const std::vector<uint8_t>& input) {
+		restore();
+		this->cpu.setInput(input);
+		this->coverage.clear();
+		CPU::State state = this->cpu.run(hangBudget);
+		this->executions++;
+
+		const CPU::Fault* fault = this->cpu.getFault();
+		if (fault != nullptr) {
+			this->crashes++;
+			uint64_t site = ((uint64_t)fault->exception << 32) | fault->eip;
+			if (this->crashSites.insert(site).second) {
+				write("crash-", input);
+			}
+		}
+		else if (state == CPU::State::Yielded) {
+			this->hangs++;
+		}
+
+		bool found = classify();
+		return found && fault == nullptr && state != CPU::State::Yielded;
+	}
+
+	// Add the hit count classes of the last run to seen, true if one was new.
+	bool classify() {
+		const std::array<uint8_t, Coverage::mapSize>& map = this->coverage.getMap();
+		bool found = false;
+		for (size_t i = 0; i < Coverage::mapSize; i += 8) {
+			uint64_t word;
+			memcpy(&word, map.data() + i, sizeof(word));
+			if (word == 0) {
+				continue;
+			}
+			for (size_t j = i; j < i + 8; j++) {
+				if (map[j] == 0) {
+					continue;
+				}
+				uint8_t bucket = hitClass(map[j]);
+				if ((this->seen[j] & bucket) == 0) {
+					this->edges += (this->seen[j] == 0) ? 1 : 0;
+					this->seen[j] |= bucket;
+					found = true;
+				}
+			}
+		}
+		return found;
+	}
+
+	// 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ hits as one bit each
+	static uint8_t hitClass(uint8_t hits) {
+		if (hits <= 3) {
+			return 1 << (hits - 1);
+		}
+		if (hits < 32) {
+			return 1 << std::bit_width(hits);
+		}
+		return (hits < 128) ? 0x40 : 0x80;
+	}
+
+	std::vector<uint8_t> mutate(const std::vector<uint8_t>& parent) {
+		static constexpr int8_t interesting[] = { -128, -1, 0, 1, 16, 32, 64, 100, 127 };
+
+		std::vector<uint8_t> input = parent;
+		size_t count = 1 + this->random() % 8;
+		for (size_t i = 0; i < count; i++) {
+			size_t size = input.size();
+			switch (this->random() % (size == 0 ? 1 : 7)) {
+				case 0:
+					// insert a random byte, the only way out of an empty input
+					if (size < maxInputSize) {
+						input.insert(input.begin() + (size == 0 ? 0 : this->random() % (size + 1)), (uint8_t)this->random());
+					}
+					break;
+				case 1:
+					input[this->random() % size] ^= 1 << (this->random() % 8);
+					break;
+				case 2:
+					input[this->random() % size] = (uint8_t)this->random();
+					break;
+				case 3:
+					input[this->random() % size] = (uint8_t)interesting[this->random() % std::size(interesting)];
+					break;
+				case 4:
+					input[this->random() % size] += (uint8_t)(this->random() % 35) - 17;
+					break;
+				case 5: {
+					// delete a block
+					size_t from = this->random() % size;
+					size_t length = 1 + this->random() % std::min<size_t>(size - from, 16);
+					input.erase(input.begin() + from, input.begin() + from + length);
+					break;
+				}
+				case 6: {
+					// copy a block of another input over this one
+					const std::vector<uint8_t>& other = this->corpus[this->random() % this->corpus.size()];
+					if (other.empty()) {
+						break;
+					}
+					size_t from = this->random() % other.size();
+					size_t to = this->random() % size;
+					size_t length = std::min({ other.size() - from, size - to, (size_t)1 + this->random() % 32 });
+					std::copy_n(other.begin() + from, length, input.begin() + to);
+					break;
+				}
+			}
+		}
+		return input;
+	}
+
+	void write(const std::string& prefix, const std::vector<uint8_t>& input) {
+		std::ostringstream name;
+		name << prefix << std::setw(6) << std::setfill('0') << this->saved++;
+		std::ofstream file(std::filesystem::path(this->directory) / name.str(), std::ios::binary | std::ios::trunc);
+		file.write((const char*)input.data(), input.size());
+	}
+
+	void printStatus(std::chrono::steady_clock::duration elapsed) {
+		double seconds = std::chrono::duration<double>(elapsed).count();
+		std::cout << "runs " << this->executions << ", " << (uint64_t)(this->executions / std::max(seconds, 0.001)) << "/s"
+			<< ", corpus " << this->corpus.size() << ", edges " << this->edges
+			<< ", crashes " << this->crashes << " (" << this->crashSites.size() << " unique)"
+			<< ", hangs " << this->hangs << std::endl;
+	}
+};
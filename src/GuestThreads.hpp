@@ -0,0 +1,157 @@
+#pragma once
+
+#include <list>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include "CPU.hpp"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+#endif
+
+// Threads of one guest: CPUs sharing its Memory, each run by a host thread
+// of its own, so a guest creating threads with clone runs them on as many
+// cores. A guest futex is the host futex on the same guest memory, a thread
+// waiting for it blocks its host thread in the kernel.
+//
+// Threads run in slices of sliceSize instructions and stop between two
+// slices after exit_group. A thread waiting on a futex wakes up for it
+// every wakePeriod, which looks like a spurious wakeup to the guest.
+class GuestThreads {
+public:
+	static constexpr uint64_t sliceSize = 0x10'0000;
+	static constexpr std::chrono::milliseconds wakePeriod{ 50 };
+
+	GuestThreads() = default;
+	GuestThreads(const GuestThreads&) = delete;
+	GuestThreads& operator=(const GuestThreads&) = delete;
+
+	~GuestThreads() {
+		exitGroup();
+		join();
+	}
+
+	// Run the first thread of the guest on the calling thread, until it
+	// stopped and every other thread exited.
+	void run(CPU& cpu) {
+		runThread(cpu);
+		join();
+	}
+
+	// Start running a thread created by clone on a host thread of its own.
+	void start(std::unique_ptr<CPU> cpu) {
+		std::lock_guard lock(this->mutex);
+		Thread& thread = this->threads.emplace_back();
+		thread.cpu = std::move(cpu);
+		thread.thread = std::thread([this, cpu = thread.cpu.get()]() {
+			runThread(*cpu);
+		});
+	}
+
+	// Whether the guest started any thread.
+	bool hasStarted() {
+		return this->threadIds.load(std::memory_order_relaxed) > 2;
+	}
+
+	uint32_t nextThreadId() {
+		return this->threadIds.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Stop every thread, as for exit_group.
+	void exitGroup() {
+		this->exiting.store(true, std::memory_order_relaxed);
+	}
+
+	// Block while the word is expected, up to timeout nanoseconds or
+	// without a limit for -1. Returns the result of FUTEX_WAIT for the guest.
+	int32_t wait(uint32_t* word, uint32_t expected, int64_t timeout) {
+#ifdef __linux__
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::nanoseconds(std::max<int64_t>(timeout, 0));
+		while (!this->exiting.load(std::memory_order_relaxed)) {
+			std::chrono::nanoseconds period = wakePeriod;
+			if (timeout >= 0) {
+				period = std::min(period, std::chrono::nanoseconds(deadline - std::chrono::steady_clock::now()));
+				if (period.count() <= 0) {
+					return -ETIMEDOUT;
+				}
+			}
+
+			timespec time = { (time_t)(period.count() / 1'000'000'000), (long)(period.count() % 1'000'000'000) };
+			if (syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, &time, nullptr, 0) == 0) {
+				return 0;
+			}
+			// EAGAIN if the word changed, EINTR for a host signal
+			if (errno != ETIMEDOUT) {
+				return -errno;
+			}
+		}
+		return -EINTR;
+#else
+		return -ENOSYS;
+#endif
+	}
+
+	// Wake up to count threads waiting on the word, returns how many woke up.
+	int32_t wake(uint32_t* word, uint32_t count) {
+#ifdef __linux__
+		long woken = syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, std::min<uint32_t>(count, INT32_MAX), nullptr, nullptr, 0);
+		return (woken < 0) ? -errno : (int32_t)woken;
+#else
+		return -ENOSYS;
+#endif
+	}
+
+private:
+	struct Thread {
+		std::unique_ptr<CPU> cpu;
+		std::thread thread;
+	};
+
+	// a list, so starting a thread doesn't move the others
+	std::list<Thread> threads;
+	std::mutex mutex;
+	// the first thread is 1
+	std::atomic<uint32_t> threadIds = 2;
+	std::atomic<bool> exiting = false;
+
+	void runThread(CPU& cpu) {
+		try {
+			CPU::State state = CPU::State::Yielded;
+			while (state == CPU::State::Yielded && !this->exiting.load(std::memory_order_relaxed)) {
+				state = cpu.run(sliceSize);
+			}
+		}
+		catch (const std::exception& e) {
+			// the thread stops, the others keep running
+			std::cout << e.what() << std::endl;
+		}
+	}
+
+	// Join the threads, also the ones started meanwhile.
+	void join() {
+		while (true) {
+			std::thread thread;
+			{
+				std::lock_guard lock(this->mutex);
+				auto running = std::find_if(this->threads.begin(), this->threads.end(), [](Thread& thread) {
+					return thread.thread.joinable();
+				});
+				if (running == this->threads.end()) {
+					return;
+				}
+				thread = std::move(running->thread);
+			}
+			thread.join();
+		}
+	}
+};
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// 64 bit FNV-1a, continue a running hash by passing it as hash.
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
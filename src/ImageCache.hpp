@@ -0,0 +1,233 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <filesystem>
+#include "Memory.hpp"
+
+#ifdef VXM86_MMAP
+#include <sys/stat.h>
+#endif
+
+// ELF file parsed once per process and shared by every guest loading it.
+// Pages covered entirely by a non-writable segment are copied once into an
+// anonymous shared file, guests map them from there instead of holding
+// their own copy.
+struct Image {
+	struct Segment {
+		uint32_t offset;
+		uint32_t vaddr;
+		uint32_t filesz;
+		uint32_t memsz;
+		uint32_t flags;
+	};
+
+	// PT_LOAD segment flag
+	static constexpr uint32_t writable = 0x2;
+
+	std::vector<uint8_t> data;
+	uint32_t entry = 0;
+	std::vector<Segment> segments;
+
+	// host file holding the shared pages, -1 if pages can't be shared
+	int sharedFile = -1;
+	// guest page -> offset in sharedFile
+	std::map<uint32_t, size_t> sharedPages;
+
+	Image() = default;
+	Image(const Image&) = delete;
+	Image& operator=(const Image&) = delete;
+
+	~Image() {
+#ifdef VXM86_MMAP
+		if (sharedFile >= 0) {
+			close(sharedFile);
+		}
+#endif
+	}
+};
+
+class ImageCache {
+public:
+	// Image of the file at path, read again only if the file changed.
+	static std::shared_ptr<const Image> get(const std::string& path) {
+		Key key = { path, 0, 0, 0 };
+#ifdef VXM86_MMAP
+		struct stat status;
+		if (stat(path.c_str(), &status) == 0) {
+			// nanoseconds, a file rewritten within the same second is read again
+#ifdef __APPLE__
+			const struct timespec& modified = status.st_mtimespec;
+#else
+			const struct timespec& modified = status.st_mtim;
+#endif
+			key = { path, (uint64_t)status.st_ino, (int64_t)modified.tv_sec * 1'000'000'000 + modified.tv_nsec, (uint64_t)status.st_size };
+		}
+#else
+		std::error_code error;
+		auto time = std::filesystem::last_write_time(path, error);
+		if (!error) {
+			key = { path, 0, (int64_t)time.time_since_epoch().count(), (uint64_t)std::filesystem::file_size(path, error) };
+		}
+#endif
+
+		static std::mutex mutex;
+		static std::map<Key, std::shared_ptr<const Image>> images;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = images.find(key);
+		if (found != images.end()) {
+			return found->second;
+		}
+
+		std::shared_ptr<const Image> image = read(path);
+		// the file changed, guests still running the old image keep it alive
+		std::erase_if(images, [&path](const auto& entry) { return std::get<0>(entry.first) == path; });
+		images[key] = image;
+		return image;
+	}
+
+private:
+	static constexpr uint32_t loadable = 1;
+
+	// path, inode, modification time at the precision of the file system and size
+	using Key = std::tuple<std::string, uint64_t, int64_t, uint64_t>;
+
+	static std::shared_ptr<Image> read(const std::string& path) {
+		auto image = std::make_shared<Image>();
+
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open()) {
+			throw std::runtime_error("Failed to open file");
+		}
+
+		file.seekg(0, std::ios::end);
+		size_t size = file.tellg();
+		file.seekg(0, std::ios::beg);
+		image->data.resize(size);
+		file.read((char*)image->data.data(), size);
+
+		const std::vector<uint8_t>& data = image->data;
+		if (size < 0x34 || data[0] != 0x7f || data[1] != 'E' || data[2] != 'L' || data[3] != 'F') {
+			throw std::runtime_error("Invalid ELF file");
+		}
+
+		image->entry = value<uint32_t>(data, 0x18);
+
+		uint32_t phoff = value<uint32_t>(data, 0x1C);
+		uint16_t phentsize = value<uint16_t>(data, 0x2A);
+		uint16_t phnum = value<uint16_t>(data, 0x2C);
+
+		for (uint16_t i = 0; i < phnum; i++) {
+			size_t header = phoff + (size_t)i * phentsize;
+			// only PT_LOAD segments are placed in memory
+			if (value<uint32_t>(data, header + 0x00) != loadable) {
+				continue;
+			}
+
+			Image::Segment segment;
+			// Offset of the segment in the file image.
+			segment.offset = value<uint32_t>(data, header + 0x04);
+			// Virtual address of the segment in memory.
+			segment.vaddr = value<uint32_t>(data, header + 0x08);
+			// Size in bytes of the segment in the file image.
+			segment.filesz = value<uint32_t>(data, header + 0x10);
+			// Size in bytes of the segment in memory.
+			segment.memsz = value<uint32_t>(data, header + 0x14);
+			// Segment-dependent flags.
+			segment.flags = value<uint32_t>(data, header + 0x18);
+
+			if ((size_t)segment.offset + segment.filesz > size || segment.filesz > segment.memsz) {
+				throw std::runtime_error("Invalid ELF segment");
+			}
+			image->segments.push_back(segment);
+		}
+
+		share(*image);
+		return image;
+	}
+
+	template<typename T>
+	static T value(const std::vector<uint8_t>& data, size_t offset) {
+		if (offset + sizeof(T) > data.size()) {
+			throw std::runtime_error("Invalid ELF file");
+		}
+
+		T value;
+		memcpy(&value, data.data() + offset, sizeof(T));
+		return value;
+	}
+
+	static void share(Image& image) {
+#ifdef __linux__
+		// pages inside a read-only segment and not touched by a writable one
+		std::map<uint32_t, bool> pages;
+		for (const Image::Segment& segment : image.segments) {
+			if (segment.memsz == 0) {
+				continue;
+			}
+
+			uint32_t first = segment.vaddr / Memory::pageSize;
+			uint32_t last = (uint32_t)(((uint64_t)segment.vaddr + segment.memsz - 1) / Memory::pageSize);
+			for (uint32_t page = first; page <= last; page++) {
+				uint64_t from = (uint64_t)page * Memory::pageSize;
+				bool covered = from >= segment.vaddr && from + Memory::pageSize <= (uint64_t)segment.vaddr + segment.memsz;
+				bool readOnly = (segment.flags & Image::writable) == 0;
+
+				auto found = pages.find(page);
+				bool shareable = covered && readOnly;
+				pages[page] = (found == pages.end()) ? shareable : (found->second && shareable);
+			}
+		}
+
+		std::vector<uint8_t> content;
+		for (auto& [page, shareable] : pages) {
+			if (!shareable) {
+				continue;
+			}
+
+			size_t offset = content.size();
+			content.resize(offset + Memory::pageSize);
+			for (const Image::Segment& segment : image.segments) {
+				uint64_t from = (uint64_t)page * Memory::pageSize;
+				if (from < segment.vaddr || from >= (uint64_t)segment.vaddr + segment.memsz) {
+					continue;
+				}
+
+				// the bytes past filesz stay zero
+				uint64_t inSegment = from - segment.vaddr;
+				if (inSegment < segment.filesz) {
+					size_t count = std::min<uint64_t>(Memory::pageSize, segment.filesz - inSegment);
+					memcpy(content.data() + offset, image.data.data() + segment.offset + inSegment, count);
+				}
+			}
+			image.sharedPages[page] = offset;
+		}
+
+		if (content.empty()) {
+			return;
+		}
+
+		int file = memfd_create("vxm86-image", MFD_CLOEXEC);
+		if (file < 0) {
+			image.sharedPages.clear();
+			return;
+		}
+		if (::write(file, content.data(), content.size()) != (ssize_t)content.size()) {
+			close(file);
+			image.sharedPages.clear();
+			return;
+		}
+		image.sharedFile = file;
+#endif
+	}
+};
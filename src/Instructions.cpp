@@ -1,10 +1,13 @@
 #include "CPU.hpp"
+#include "GuestThreads.hpp"
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
 
 void CPU::initInstructions() {
 	auto invalidInstruction = [&](uint8_t opcode, bool sizePrefix) -> bool {
-		std::cout << "Unknown opcode: " << (int)opcode << std::endl;
-		return false;
+		return raise(Exception::InvalidOpcode);
 	};
 
 	// set all instructions to invalid
@@ -37,7 +40,7 @@ void CPU::initInstructions() {
 	instructions[0b1100'0100 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
 		// mov r/m, imm
 		// [1100 011 w] [mod 000 r/m] [imm]
-		bool w = (opcode & 0b0000'1000) > 0;
+		bool w = (opcode & 0b0000'0001) > 0;
 
 		uint8_t modrm = readImmediate(false, false);
 
@@ -85,107 +88,7 @@ void CPU::initInstructions() {
 		return true;
 	};
 
-	instructions[0b0000'0000 >> 2] = instructions[0b0010'1000 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
-		// add r/m, r
-		// [0000 00 d w] [mod reg r/m]
-
-		// sub r/m, r
-		// [0010 10 d w] [mod reg r/m]
-
-		bool isAdd = (opcode & 0b1111'1100) == 0b0000'0000;
-
-		bool w = (opcode & 0b0000'0001) > 0;
-		bool d = (opcode & 0b0000'0010) > 0;
-
-		uint32_t modregrm = readImmediate(false, false);
-
-		uint8_t mod = (modregrm & 0b1100'0000) >> 6;
-		uint8_t reg = (modregrm & 0b0011'1000) >> 3;
-		uint8_t rm = (modregrm & 0b0000'0111);
-
-		uint32_t valueReg = this->registers.get((Registers::Reg)reg, w, sizePrefix);
-
-		// rmRead will increment eip if needed to read immediate
-		uint32_t eipBackup = this->registers.get(Registers::Reg::EIP);
-		uint32_t valueRm = rmRead(w, sizePrefix, mod, rm);
-
-		uint32_t result = valueReg + valueRm;
-		if (d) {
-			if (!isAdd) {
-				result = valueReg - valueRm;
-			}
-			// add/sub r, r/m
-			this->registers.set((Registers::Reg)reg, w, sizePrefix, result);
-		}
-		else {
-			if (!isAdd) {
-				result = valueRm - valueReg;
-			}
-			// add/sub r/m, r
-			// restore eip to before rmRead, since we need to read the immediate again
-			this->registers.set(Registers::Reg::EIP, eipBackup);
-			rmWrite(w, sizePrefix, mod, rm, result);
-		}
-
-		return true;
-	};
-
-	instructions[0b1000'0000 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
-		// add r/m, imm
-		// [1000 00 s w] [mod 000 r/m] [imm]
-		// 
-		// sub r/m, imm
-		// [1000 00 s w] [mod 101 r/m] [imm]
-		// 
-		// s = 0 -> imm8/16/32 
-		// s = 1 -> imm8 sign extended to imm16/32
-
-		bool w = (opcode & 0b0000'0001) > 0;
-		bool s = (opcode & 0b0000'0010) > 0;
-
-		uint32_t modregrm = readImmediate(false, false);
-
-		uint8_t mod = (modregrm & 0b1100'0000) >> 6;
-		uint8_t op = (modregrm & 0b0011'1000) >> 3;
-		uint8_t rm = (modregrm & 0b0000'0111);
-
-		uint32_t eipBackup = this->registers.get(Registers::Reg::EIP);
-		uint32_t value1 = rmRead(w, sizePrefix, mod, rm);
-		uint32_t value2 = readImmediate(w && !s, sizePrefix);
-
-		if (s) {
-			// sign extend imm8 to imm16/32
-			value2 = (int32_t)(int8_t)value2;
-		}
-
-		this->registers.setFlag(Registers::Flag::ZF, value1 == value2);
-
-		uint32_t result = 0;
-		if (op == 0b000) {
-			// add
-			result = value1 + value2;
-			this->registers.setFlag(Registers::Flag::CF, result < value1);
-		}
-		else if (op == 0b101 || op == 0b111) {
-			// sub
-			result = value1 - value2;
-			this->registers.setFlag(Registers::Flag::CF, value2 > value1);
-		}
-		else {
-			// not implemented
-			std::cout << "Not implemented variant of 0b1000'0000" << std::endl;
-		}
-
-		if (op == 0b000 || op == 0b101) {
-			// restore eip to before rmRead, since we need to read the immediate again, then set it to the instruction end
-			uint32_t eipBackup2 = this->registers.get(Registers::Reg::EIP);
-			this->registers.set(Registers::Reg::EIP, eipBackup);
-			rmWrite(w, sizePrefix, mod, rm, result);
-			this->registers.set(Registers::Reg::EIP, eipBackup2);
-		}
-
-		return true;
-	};
+	initAluInstructions();
 
 	instructions[0b1110'0000 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
 		// loop
@@ -203,23 +106,43 @@ void CPU::initInstructions() {
 			}
 		}
 		else {
-			std::cout << "Unknown loop type: " << (int)type << std::endl;
-			return false;
+			// loopne, loope and jcxz
+			return raise(Exception::InvalidOpcode);
 		}
 		return true;
 	};
 
-	instructions[0b01110100 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
-		// jz/jnz
-		// [0111 010 n] [imm8]	
-		bool n = (opcode & 1) > 0;
+	instructions[0b0111'0000 >> 2] = instructions[0b0111'0100 >> 2] = instructions[0b0111'1000 >> 2] = instructions[0b0111'1100 >> 2] =
+		[&](uint8_t opcode, bool sizePrefix) -> bool {
+		// jcc rel8
+		// [0111 cccn] [imm8]
 		int8_t displacement = readImmediate(false, false);
-		if (this->registers.getFlag(Registers::Flag::ZF) != n) {
+		if (this->registers.testCondition(opcode & 0b0000'1111)) {
 			this->registers.set(Registers::Reg::EIP, this->registers.get(Registers::Reg::EIP) + (int32_t)displacement);
 		}
 		return true;
 	};
 
+	instructions[0b1000'0100 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
+		// test r/m, r
+		// [1000 010 w] [mod reg r/m]
+		if ((opcode & 0b0000'0010) > 0) {
+			return raise(Exception::InvalidOpcode);
+		}
+
+		bool w = (opcode & 0b0000'0001) > 0;
+		uint8_t modrm = readImmediate(false, false);
+		uint8_t mod = (modrm & 0b1100'0000) >> 6;
+		Registers::Reg reg = (Registers::Reg)((modrm & 0b0011'1000) >> 3);
+		uint8_t rm = modrm & 0b0000'0111;
+
+		uint32_t value1 = rmRead(w, sizePrefix, mod, rm);
+		uint32_t value2 = this->registers.get(reg, w, sizePrefix);
+		uint32_t size = w ? (sizePrefix ? 2 : 4) : 1;
+		this->registers.setLazyFlags(Registers::FlagOp::Logic, size, value1, value2, value1 & value2);
+		return true;
+	};
+
 	instructions[0b1100'1100 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
 		if (opcode == 0b1100'1101) {
 			// int
@@ -235,17 +158,36 @@ void CPU::initInstructions() {
 				uint32_t edx = this->registers.get(Registers::Reg::EDX);
 				uint32_t esi = this->registers.get(Registers::Reg::ESI);
 				uint32_t edi = this->registers.get(Registers::Reg::EDI);
+				this->metrics->addSyscall(eax);
+
+				// no host I/O while replaying
+				bool replaying = (this->syscallLog != nullptr && this->syscallLog->isReplaying());
 
-				// green text
-				std::cout << "\033[1;32m";
+				// the console shows guest output in green
+				bool console = !replaying && isConsole(1);
+				if (console) std::cout << "\033[1;32m";
 
 				switch (eax) {
+					case 252:
+						// sys_exit_group
+						// ebx = exit code
+						if (this->threads != nullptr) {
+							this->threads->exitGroup();
+						}
+						[[fallthrough]];
+
 					case 1:
 					{
 						// sys_exit
 						// ebx = exit code
-						std::cout << "Program exited with code " << ebx << std::endl;
-						std::cout << "\033[0m";
+						if (eax == 1 && this->threadId != 1) {
+							// only a thread created by clone, the others keep running
+							return exitThread();
+						}
+						if (console) {
+							std::cout << "Program exited with code " << ebx << std::endl;
+							std::cout << "\033[0m";
+						}
 						return false;
 					}
 
@@ -256,14 +198,38 @@ void CPU::initInstructions() {
 						// ecx = buffer
 						// edx = size
 
-						char* tmpBuffer = new char[edx];
-						std::cin.getline(tmpBuffer, edx);
-						int len = strlen(tmpBuffer);
+						if (!isConsole(ebx)) {
+							return fileRead(eax, ebx, ecx, edx, -1);
+						}
+
+						if (!this->memory->contains(ecx, edx)) {
+							this->registers.set(Registers::Reg::EAX, (uint32_t)-EFAULT);
+							return true;
+						}
+
+						// the input is nondeterministic, so it goes through the syscall log
+						// like the reads of files
+						if (replaying) {
+							replayResult(eax, ecx);
+							return true;
+						}
+
+						std::vector<char> tmpBuffer(edx + 2, '\0');
+						std::cin.getline(tmpBuffer.data(), edx);
+						size_t len = strlen(tmpBuffer.data());
 						if (len + 1 < edx) {
 							tmpBuffer[len] = '\n';
-							tmpBuffer[len + 1] = '\0';
+							len++;
 						}
-						this->memory->write(ecx, (uint8_t*)tmpBuffer, edx);
+						// the line with its terminator
+						std::vector<uint8_t> input(tmpBuffer.begin(), tmpBuffer.begin() + std::min<size_t>(len + 1, edx));
+
+						this->memory->write(ecx, input.data(), input.size());
+						this->metrics->add(Metric::IoBytesRead, input.size());
+						// number of bytes read, without the terminator
+						int32_t result = (int32_t)strnlen((char*)input.data(), input.size());
+						this->registers.set(Registers::Reg::EAX, (uint32_t)result);
+						recordIo(eax, result, input.data(), input.size());
 						return true;
 					}
 
@@ -274,14 +240,119 @@ void CPU::initInstructions() {
 						// ecx = buffer
 						// edx = size
 
-						char* tmpBuffer = new char[edx + 1];
-						tmpBuffer[edx] = '\0';
-						this->memory->read(ecx, (uint8_t*)tmpBuffer, edx);
+						if (!isConsole(ebx)) {
+							return fileWrite(eax, ebx, ecx, edx, -1);
+						}
 
-						std::cout << tmpBuffer;
+						if (!this->memory->contains(ecx, edx)) {
+							this->registers.set(Registers::Reg::EAX, (uint32_t)-EFAULT);
+							return true;
+						}
+
+						this->metrics->add(Metric::IoBytesWritten, edx);
+						if (replaying) {
+							return true;
+						}
+
+						// after what the guest wrote to console devices before
+						this->memory->flushDevices();
+						// shown up to the first null byte
+						const char* text = (const char*)this->memory->view(ecx, edx);
+						std::cout.write(text, strnlen(text, edx));
 						return true;
 					}
 
+					case 5:
+					{
+						// sys_open
+						// ebx = path
+						// ecx = flags
+						// edx = mode
+						return fileOpen(ebx, ecx, edx);
+					}
+
+					case 6:
+					{
+						// sys_close
+						// ebx = file descriptor
+						return fileClose(ebx);
+					}
+
+					case 48:
+					{
+						// sys_signal
+						// ebx = signal
+						// ecx = handler
+						return sysSignal(ebx, ecx);
+					}
+
+					case 67:
+					{
+						// sys_sigaction
+						// ebx = signal
+						// ecx = new struct old_sigaction or 0
+						// edx = old struct old_sigaction or 0
+						return sysSigaction(ebx, ecx, edx);
+					}
+
+					case 119:
+					{
+						// sys_sigreturn, called by the code in the signal frame
+						return sysSigreturn();
+					}
+
+					case 120:
+					{
+						// sys_clone
+						// ebx = flags
+						// ecx = stack of the new thread
+						// edx = parent thread id pointer
+						// esi = tls
+						// edi = child thread id pointer
+						return sysClone(ebx, ecx, edx, edi);
+					}
+
+					case 224:
+					{
+						// sys_gettid
+						this->registers.set(Registers::Reg::EAX, this->threadId);
+						return true;
+					}
+
+					case 240:
+					{
+						// sys_futex
+						// ebx = address
+						// ecx = operation
+						// edx = value
+						// esi = timeout
+						return sysFutex(ebx, ecx, edx, esi);
+					}
+
+					case 258:
+					{
+						// sys_set_tid_address
+						// ebx = thread id pointer cleared on exit
+						this->clearThreadId = ebx;
+						this->registers.set(Registers::Reg::EAX, this->threadId);
+						return true;
+					}
+
+					case 180:
+					case 181:
+					{
+						// sys_pread64 / sys_pwrite64
+						// ebx = file descriptor
+						// ecx = buffer
+						// edx = size
+						// edi:esi = offset
+						int64_t offset = (int64_t)(((uint64_t)edi << 32) | esi);
+						if (eax == 180) {
+							return fileRead(eax, ebx, ecx, edx, offset);
+						}
+						return fileWrite(eax, ebx, ecx, edx, offset);
+					}
+
 					default:
 					{
 						std::cout << "Unknown syscall: " << eax << std::endl;
@@ -293,13 +364,13 @@ void CPU::initInstructions() {
 				std::cout << "\033[0m";
 			}
 			else {
-				std::cout << "Unknown interrupt: " << (int)intId << std::endl;
-				return false;
+				// the gates of other vectors aren't open to user mode
+				return raise(Exception::GeneralProtection);
 			}
 		}
 		else {
-			std::cout << "Unknown int opcode: " << std::hex << (int)opcode << std::endl;
-			return false;
+			// int3, into and iret
+			return raise(Exception::InvalidOpcode);
 		}
 		return true;
 	};
@@ -400,23 +471,28 @@ void CPU::initInstructions() {
 			rel = (int32_t)(int8_t)rel;
 		}
 
+		if (op == 0b00) {
+			// only call pushes the return address
+			if (sizePrefix) {
+				esp -= 2;
+				this->memory->write<uint16_t>(esp, eip);
+			}
+			else {
+				esp -= 4;
+				this->memory->write<uint32_t>(esp, eip);
+			}
+			this->registers.set(Registers::Reg::ESP, esp);
+		}
+
 		if (sizePrefix) {
-			esp -= 2;
-			this->memory->write<uint16_t>(esp, eip);
 			rel = (int32_t)(int16_t)rel;
 			eip += rel;
 			eip &= 0xffff;
 		}
 		else {
-			esp -= 4;
-			this->memory->write<uint32_t>(esp, eip);
 			eip += rel;
 		}
 
-		if (op == 0b00) {
-			this->registers.set(Registers::Reg::ESP, esp);
-		}
-
 		this->registers.set(Registers::Reg::EIP, eip);
 		return true;
 	};
@@ -427,38 +503,22 @@ void CPU::initInstructions() {
 			// popa(d)
 			// [0110 0001]
 
-			uint32_t value;
+			// all values are read before the first register changes, so a fault leaves them as they were
 			uint32_t increment = (sizePrefix) ? 2 : 4;
+			uint32_t values[8];
+			for (uint32_t& value : values) {
+				value = this->memory->read<uint32_t>(esp);
+				esp += increment;
+			}
 
-			value = this->memory->read<uint32_t>(esp);
-			esp += increment;
-			this->registers.set(Registers::Reg::EDI, true, sizePrefix, value);
-
-			value = this->memory->read<uint32_t>(esp);
-			esp += increment;
-			this->registers.set(Registers::Reg::ESI, value);
-
-			value = this->memory->read<uint32_t>(esp);
-			esp += increment;
-			this->registers.set(Registers::Reg::EBP, value);
-
-			esp += increment; // skip ESP
-
-			value = this->memory->read<uint32_t>(esp);
-			esp += increment;
-			this->registers.set(Registers::Reg::EBX, value);
-
-			value = this->memory->read<uint32_t>(esp);
-			esp += increment;
-			this->registers.set(Registers::Reg::EDX, value);
-
-			value = this->memory->read<uint32_t>(esp);
-			esp += increment;
-			this->registers.set(Registers::Reg::ECX, value);
-
-			value = this->memory->read<uint32_t>(esp);
-			esp += increment;
-			this->registers.set(Registers::Reg::EAX, value);
+			// the pushed ESP is skipped
+			this->registers.set(Registers::Reg::EDI, true, sizePrefix, values[0]);
+			this->registers.set(Registers::Reg::ESI, values[1]);
+			this->registers.set(Registers::Reg::EBP, values[2]);
+			this->registers.set(Registers::Reg::EBX, values[4]);
+			this->registers.set(Registers::Reg::EDX, values[5]);
+			this->registers.set(Registers::Reg::ECX, values[6]);
+			this->registers.set(Registers::Reg::EAX, values[7]);
 		}
 		else {
 			// pusha(d)
@@ -488,8 +548,7 @@ void CPU::initInstructions() {
 		// [1100 0011]
 
 		if ((opcode & 0b11) != 0b11) {
-			std::cout << "Unknown opcode: " << (int)opcode << std::endl;
-			return false;
+			return raise(Exception::InvalidOpcode);
 		}
 
 		uint32_t esp = this->registers.get(Registers::Reg::ESP);
@@ -521,10 +580,147 @@ void CPU::initInstructions() {
 		bool inc = (opcode & 0b1000) == 0;
 
 		uint32_t value = this->registers.get((Registers::Reg)reg, true, sizePrefix);
-		if (inc) value++;
-		else value--;
+		uint32_t result = inc ? value + 1 : value - 1;
 
-		this->registers.set((Registers::Reg)reg, true, sizePrefix, value);
+		// CF is not affected
+		uint32_t size = sizePrefix ? 2 : 4;
+		bool carry = this->registers.getFlag(Registers::Flag::CF);
+		this->registers.setLazyFlags(inc ? Registers::FlagOp::Inc : Registers::FlagOp::Dec, size, value, 1,
+			sizePrefix ? (result & 0xFFFF) : result, carry);
+
+		this->registers.set((Registers::Reg)reg, true, sizePrefix, result);
+		return true;
+	};
+
+	instructions[0b1010'0100 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
+		// movs
+		// [1010 010 w]
+
+		// cmps
+		// [1010 011 w]
+		bool w = (opcode & 0b0000'0001) > 0;
+		if ((opcode & 0b0000'0010) > 0) {
+			cmps(w, sizePrefix);
+		}
+		else {
+			movs(w, sizePrefix);
+		}
+		return true;
+	};
+
+	instructions[0b1010'1000 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
+		// stos
+		// [1010 101 w]
+		if ((opcode & 0b0000'0010) == 0) {
+			return raise(Exception::InvalidOpcode);
+		}
+
+		stos((opcode & 0b0000'0001) > 0, sizePrefix);
+		return true;
+	};
+
+	instructions[0b1010'1100 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
+		// lods
+		// [1010 110 w]
+
+		// scas
+		// [1010 111 w]
+		bool w = (opcode & 0b0000'0001) > 0;
+		if ((opcode & 0b0000'0010) > 0) {
+			scas(w, sizePrefix);
+		}
+		else {
+			lods(w, sizePrefix);
+		}
+		return true;
+	};
+
+	instructions[0b1111'1100 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
+		if ((opcode & 0b0000'0010) == 0) {
+			// cld / std
+			// [1111 110 d]
+			this->registers.setFlag(Registers::Flag::DF, (opcode & 0b0000'0001) > 0);
+			return true;
+		}
+
+		// inc/dec/call/jmp/push r/m
+		// [1111 111 w] [mod op r/m]
+		bool w = (opcode & 0b0000'0001) > 0;
+		uint8_t modrm = readImmediate(false, false);
+		uint8_t op = (modrm & 0b0011'1000) >> 3;
+		RmOperand operand = decodeRm(modrm);
+		if (this->lockPrefix && (op > 0b001 || operand.isRegister)) {
+			// only inc/dec of memory can be locked
+			return raise(Exception::InvalidOpcode);
+		}
+
+		if (op <= 0b001) {
+			// inc/dec r/m, CF is not affected
+			uint32_t size = w ? (sizePrefix ? 2 : 4) : 1;
+			bool carry = this->registers.getFlag(Registers::Flag::CF);
+			auto step = [&](uint32_t value) {
+				uint32_t result = (op == 0b000) ? value + 1 : value - 1;
+				result &= (0xFFFF'FFFFull >> (32 - size * 8));
+				this->registers.setLazyFlags((op == 0b000) ? Registers::FlagOp::Inc : Registers::FlagOp::Dec, size, value, 1, result, carry);
+				return result;
+			};
+
+			if (this->lockPrefix) {
+				if (!w) {
+					updateRm<uint8_t>(operand, step);
+				}
+				else if (sizePrefix) {
+					updateRm<uint16_t>(operand, step);
+				}
+				else {
+					updateRm<uint32_t>(operand, step);
+				}
+				return true;
+			}
+
+			uint32_t value = !w ? readRm<uint8_t>(operand) : (sizePrefix ? readRm<uint16_t>(operand) : readRm<uint32_t>(operand));
+			uint32_t result = step(value);
+
+			if (!w) {
+				writeRm<uint8_t>(operand, result);
+			}
+			else if (sizePrefix) {
+				writeRm<uint16_t>(operand, result);
+			}
+			else {
+				writeRm<uint32_t>(operand, result);
+			}
+			return true;
+		}
+
+		if (!w || op == 0b011 || op == 0b101 || op == 0b111) {
+			// far call/jmp are not supported
+			return raise(Exception::InvalidOpcode);
+		}
+
+		uint32_t value = sizePrefix ? readRm<uint16_t>(operand) : readRm<uint32_t>(operand);
+		uint32_t esp = this->registers.get(Registers::Reg::ESP);
+
+		if (op == 0b010 || op == 0b110) {
+			// call pushes the return address, push the operand
+			uint32_t pushed = (op == 0b010) ? this->registers.get(Registers::Reg::EIP) : value;
+			if (sizePrefix) {
+				esp -= 2;
+				this->memory->write<uint16_t>(esp, pushed);
+			}
+			else {
+				esp -= 4;
+				this->memory->write<uint32_t>(esp, pushed);
+			}
+			this->registers.set(Registers::Reg::ESP, esp);
+
+			if (op == 0b110) {
+				return true;
+			}
+		}
+
+		// call/jmp r/m
+		this->registers.set(Registers::Reg::EIP, value);
 		return true;
 	};
 
@@ -537,8 +733,8 @@ void CPU::initInstructions() {
 			uint8_t rm = modregrm & 0b111;
 
 			if (mod == 0b11) {
-				std::cout << "Invalid combination of opcode and operands in: " << (int)opcode << std::endl;
-				return false;
+				// lea needs a memory operand
+				return raise(Exception::InvalidOpcode);
 			}
 
 			uint32_t ea = getEffectiveAddress(mod, rm);
@@ -547,8 +743,12 @@ void CPU::initInstructions() {
 			return true;
 		}
 		else {
-			std::cout << "Unknown opcode: " << (int)opcode << std::endl;
-			return false;
+			return raise(Exception::InvalidOpcode);
 		}
 	};
+
+	// groups sharing a slot with instructions above
+	initShiftInstructions();
+	initMulDivInstructions();
+	initAtomicInstructions();
 }
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+// Analysis tool attached to a CPU with setInstrumentation(). The memory
+// calls load() and store() for every access by the guest, unless the tool
+// only wants branches. The CPU calls branch() for every instruction that
+// didn't continue with the next one and for every conditional jump.
+// Detached, none of it runs: stores keep their fast path, loads test one
+// pointer and the CPU runs its uninstrumented loop.
+//
+// Instruction fetches aren't loads. Fused instructions run one at a time
+// while a tool is attached, so every access belongs to getEip().
+class Instrumentation {
+public:
+	// memoryAccesses false for a tool without load() and store(),
+	// the memory then runs as fast as without a tool
+	Instrumentation(bool memoryAccesses = true) :
+		memoryAccesses(memoryAccesses) {
+	}
+
+	virtual ~Instrumentation() = default;
+
+	// Before size bytes at address are read.
+	virtual void load(uint32_t address, uint32_t size) {
+	}
+
+	// Before size bytes at address are written, by the guest or by a syscall.
+	virtual void store(uint32_t address, uint32_t size) {
+	}
+
+	// After the instruction at from continued at to, also when a conditional
+	// jump wasn't taken.
+	virtual void branch(uint32_t from, uint32_t to) {
+	}
+
+	// Address of the running instruction.
+	uint32_t getEip() {
+		return this->eip;
+	}
+
+	bool hasMemoryAccesses() {
+		return this->memoryAccesses;
+	}
+
+private:
+	friend class CPU;
+
+	bool memoryAccesses;
+	uint32_t eip = 0;
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#define VXM86_IO_URING
+#endif
+
+#ifdef VXM86_IO_URING
+
+// Submission and completion queues of one io_uring instance, set up with
+// the raw system calls so no library is needed. Any thread may queue
+// requests; submit() hands all queued ones to the kernel with one system
+// call. Completions are taken by a single thread, woken through an eventfd
+// that can be watched with epoll.
+class IoUring {
+public:
+	// Throws if the kernel has no io_uring or doesn't allow it.
+	IoUring(uint32_t entries) {
+		io_uring_params params = {};
+		this->ring = (int)syscall(__NR_io_uring_setup, entries, &params);
+		if (this->ring < 0) {
+			throw std::runtime_error(std::string("io_uring unavailable: ") + strerror(errno));
+		}
+		if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) {
+			close(this->ring);
+			throw std::runtime_error("io_uring too old");
+		}
+
+		this->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+		this->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		// both rings share one mapping on kernels with IORING_FEAT_SINGLE_MMAP
+		this->singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (this->singleMap) {
+			this->sqRingSize = this->cqRingSize = std::max(this->sqRingSize, this->cqRingSize);
+		}
+
+		this->sqRing = map(this->sqRingSize, IORING_OFF_SQ_RING);
+		this->cqRing = this->singleMap ? this->sqRing : map(this->cqRingSize, IORING_OFF_CQ_RING);
+		this->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+		this->sqes = (io_uring_sqe*)map(this->sqesSize, IORING_OFF_SQES);
+
+		this->sqHead = (uint32_t*)(this->sqRing + params.sq_off.head);
+		this->sqTail = (uint32_t*)(this->sqRing + params.sq_off.tail);
+		this->sqMask = *(uint32_t*)(this->sqRing + params.sq_off.ring_mask);
+		this->sqArray = (uint32_t*)(this->sqRing + params.sq_off.array);
+		this->sqEntries = params.sq_entries;
+		this->cqHead = (uint32_t*)(this->cqRing + params.cq_off.head);
+		this->cqTail = (uint32_t*)(this->cqRing + params.cq_off.tail);
+		this->cqMask = *(uint32_t*)(this->cqRing + params.cq_off.ring_mask);
+		this->cqes = (io_uring_cqe*)(this->cqRing + params.cq_off.cqes);
+
+		this->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (this->eventFd < 0 || syscall(__NR_io_uring_register, this->ring, IORING_REGISTER_EVENTFD, &this->eventFd, 1) != 0) {
+			unmap();
+			throw std::runtime_error("Failed to register io_uring eventfd");
+		}
+	}
+
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	~IoUring() {
+		unmap();
+	}
+
+	// Queue a read or write of size bytes at offset, -1 for the file position.
+	// userData comes back with the completion. False if the queue is full.
+	bool push(bool output, int fd, void* buffer, uint32_t size, int64_t offset, uint64_t userData) {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		uint32_t tail = *this->sqTail;
+		if (tail - load(this->sqHead) == this->sqEntries) {
+			return false;
+		}
+
+		uint32_t index = tail & this->sqMask;
+		io_uring_sqe& sqe = this->sqes[index];
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = output ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe.fd = fd;
+		sqe.addr = (uint64_t)(uintptr_t)buffer;
+		sqe.len = size;
+		sqe.off = (uint64_t)offset;
+		sqe.user_data = userData;
+		this->sqArray[index] = index;
+		store(this->sqTail, tail + 1);
+		this->queued++;
+		return true;
+	}
+
+	size_t getQueued() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->queued;
+	}
+
+	// Hand the queued requests to the kernel.
+	void submit() {
+		std::lock_guard<std::mutex> lock(this->mutex);
+		while (this->queued != 0) {
+			int submitted = (int)syscall(__NR_io_uring_enter, this->ring, this->queued, 0, 0, nullptr, 0);
+			if (submitted < 0) {
+				if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+					continue;
+				}
+				throw std::runtime_error(std::string("io_uring submit failed: ") + strerror(errno));
+			}
+			this->queued -= submitted;
+		}
+	}
+
+	// File to watch for completions.
+	int getEventFd() {
+		return this->eventFd;
+	}
+
+	// Call f(userData, result) for every completion, result is a negated errno on failure.
+	// Only one thread may reap.
+	template<typename F>
+	void reap(F f) {
+		uint64_t count;
+		ssize_t cleared = ::read(this->eventFd, &count, sizeof(count));
+		(void)cleared;
+
+		uint32_t head = *this->cqHead;
+		uint32_t tail = load(this->cqTail);
+		while (head != tail) {
+			const io_uring_cqe& cqe = this->cqes[head & this->cqMask];
+			f(cqe.user_data, cqe.res);
+			head++;
+			// free the slot before the next completion is read
+			store(this->cqHead, head);
+			tail = load(this->cqTail);
+		}
+	}
+
+private:
+	int ring = -1;
+	int eventFd = -1;
+	bool singleMap = false;
+	size_t sqRingSize = 0;
+	size_t cqRingSize = 0;
+	size_t sqesSize = 0;
+	uint8_t* sqRing = nullptr;
+	uint8_t* cqRing = nullptr;
+	io_uring_sqe* sqes = nullptr;
+
+	uint32_t* sqHead = nullptr;
+	uint32_t* sqTail = nullptr;
+	uint32_t sqMask = 0;
+	uint32_t* sqArray = nullptr;
+	uint32_t sqEntries = 0;
+	uint32_t* cqHead = nullptr;
+	uint32_t* cqTail = nullptr;
+	uint32_t cqMask = 0;
+	io_uring_cqe* cqes = nullptr;
+
+	std::mutex mutex;
+	// pushed but not submitted yet
+	uint32_t queued = 0;
+
+	// the kernel reads and writes the ring indices concurrently
+	static uint32_t load(uint32_t* value) {
+		return std::atomic_ref<uint32_t>(*value).load(std::memory_order_acquire);
+	}
+
+	static void store(uint32_t* value, uint32_t newValue) {
+		std::atomic_ref<uint32_t>(*value).store(newValue, std::memory_order_release);
+	}
+
+	uint8_t* map(size_t size, uint64_t offset) {
+		void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ring, offset);
+		if (address == MAP_FAILED) {
+			unmap();
+			throw std::runtime_error("Failed to map io_uring");
+		}
+		return (uint8_t*)address;
+	}
+
+	void unmap() {
+		if (this->sqes != nullptr) {
+			munmap(this->sqes, this->sqesSize);
+		}
+		if (this->cqRing != nullptr && !this->singleMap) {
+			munmap(this->cqRing, this->cqRingSize);
+		}
+		if (this->sqRing != nullptr) {
+			munmap(this->sqRing, this->sqRingSize);
+		}
+		if (this->eventFd >= 0) {
+			close(this->eventFd);
+		}
+		close(this->ring);
+	}
+};
+
+#endif
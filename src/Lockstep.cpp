@@ -0,0 +1,1065 @@
+#include "Lockstep.hpp"
+#include "ELFLoader.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+// The lane loops run over all lanes, also the inactive ones, and keep their
+// values with a select instead of skipping them, so they become vector
+// blends. Only memory accesses go lane by lane, every lane has its own
+// memory.
+
+namespace {
+	// 16 lanes of 32 bits fill an AVX-512 register
+	constexpr size_t laneBlock = 16;
+
+	constexpr uint8_t noIndex = 8;
+	constexpr uint8_t espIndex = 4;
+
+	// operations of the reg field of group 1, as CPU::AluOp
+	constexpr uint8_t aluAdd = 0;
+	constexpr uint8_t aluOr = 1;
+	constexpr uint8_t aluAdc = 2;
+	constexpr uint8_t aluSbb = 3;
+	constexpr uint8_t aluAnd = 4;
+	constexpr uint8_t aluSub = 5;
+	constexpr uint8_t aluXor = 6;
+	constexpr uint8_t aluCmp = 7;
+	// not group 1 operations: test, and without writing the result,
+	// and inc and dec of AluStore
+	constexpr uint8_t aluTest = 8;
+	constexpr uint8_t aluInc = 9;
+	constexpr uint8_t aluDec = 10;
+
+	// operations of the reg field of group 2, as CPU::ShiftOp
+	constexpr uint8_t shiftShl = 4;
+	constexpr uint8_t shiftShr = 5;
+	constexpr uint8_t shiftSal = 6;
+	constexpr uint8_t shiftSar = 7;
+
+	const Registers::Reg generalRegisters[8] = {
+		Registers::Reg::EAX, Registers::Reg::ECX, Registers::Reg::EDX, Registers::Reg::EBX,
+		Registers::Reg::ESP, Registers::Reg::EBP, Registers::Reg::ESI, Registers::Reg::EDI
+	};
+
+	uint32_t read32(const uint8_t* bytes) {
+		uint32_t value;
+		memcpy(&value, bytes, sizeof(value));
+		return value;
+	}
+
+	template<uint8_t operation>
+	uint32_t compute(uint32_t value1, uint32_t value2, uint32_t carry) {
+		if constexpr (operation == aluAdd || operation == aluAdc) {
+			return value1 + value2 + carry;
+		}
+		else if constexpr (operation == aluSub || operation == aluCmp || operation == aluSbb) {
+			return value1 - value2 - carry;
+		}
+		else if constexpr (operation == aluOr) {
+			return value1 | value2;
+		}
+		else if constexpr (operation == aluXor) {
+			return value1 ^ value2;
+		}
+		else {
+			return value1 & value2;
+		}
+	}
+
+	// CF of the lazy flags of a lane, as Registers::getCarry() for 32 bit operands;
+	// with a carry in the sum equals value1 also if value2 was all ones
+	inline uint32_t carryOf(uint32_t op, uint32_t value1, uint32_t value2, uint32_t result, uint32_t aux, uint32_t eflags) {
+		uint32_t add = 0u - (op == (uint32_t)Registers::FlagOp::Add ? 1 : 0);
+		uint32_t sub = 0u - (op == (uint32_t)Registers::FlagOp::Sub ? 1 : 0);
+		uint32_t incDec = 0u - (op == (uint32_t)Registers::FlagOp::Inc || op == (uint32_t)Registers::FlagOp::Dec ? 1 : 0);
+		uint32_t given = 0u - (op == (uint32_t)Registers::FlagOp::Result ? 1 : 0);
+		uint32_t none = 0u - (op == (uint32_t)Registers::FlagOp::None ? 1 : 0);
+		uint32_t carryIn = aux & 1;
+		return (((result < value1 ? 1 : 0) | ((result == value1 ? 1 : 0) & carryIn)) & add) |
+			(((value1 < value2 ? 1 : 0) | ((value1 == value2 ? 1 : 0) & carryIn)) & sub) | (aux & incDec) |
+			(((aux & given) | (eflags & none)) & (uint32_t)Registers::Flag::CF);
+	}
+
+	// 1 if the low byte has an even number of bits set, folded with shifts as
+	// vectors have no popcount
+	inline uint32_t parityOf(uint32_t result) {
+		uint32_t parity = result ^ (result >> 4);
+		parity ^= parity >> 2;
+		return (parity ^ (parity >> 1) ^ 1) & 1;
+	}
+
+	// EFLAGS of a lane, as Registers::materializeFlags() builds them
+	inline uint32_t flagsOf(uint32_t op, uint32_t value1, uint32_t value2, uint32_t result, uint32_t aux, uint32_t eflags) {
+		bool add = op == (uint32_t)Registers::FlagOp::Add;
+		bool sub = op == (uint32_t)Registers::FlagOp::Sub;
+		bool inc = op == (uint32_t)Registers::FlagOp::Inc;
+		bool dec = op == (uint32_t)Registers::FlagOp::Dec;
+
+		bool given = op == (uint32_t)Registers::FlagOp::Result;
+
+		uint32_t overflow = add ? ((value1 ^ result) & (value2 ^ result)) >> 31 :
+			sub ? ((value1 ^ value2) & (value1 ^ result)) >> 31 :
+			inc ? (result == 0x8000'0000 ? 1 : 0) : dec ? (value1 == 0x8000'0000 ? 1 : 0) :
+			given ? (aux >> 11) & 1 : 0;
+		uint32_t adjust = (add || sub) ? ((value1 ^ value2 ^ result) >> 4) & 1 :
+			inc ? ((result & 0xf) == 0 ? 1 : 0) : dec ? ((result & 0xf) == 0xf ? 1 : 0) :
+			given ? (aux >> 4) & 1 : 0;
+		uint32_t flags = carryOf(op, value1, value2, result, aux, eflags) * (uint32_t)Registers::Flag::CF |
+			parityOf(result) * (uint32_t)Registers::Flag::PF |
+			adjust * (uint32_t)Registers::Flag::AF |
+			(result == 0 ? (uint32_t)Registers::Flag::ZF : 0) |
+			(result >> 31) * (uint32_t)Registers::Flag::SF |
+			overflow * (uint32_t)Registers::Flag::OF;
+		return (op == (uint32_t)Registers::FlagOp::None) ? eflags : (eflags & ~Registers::arithmeticFlags) | flags;
+	}
+
+	// a where mask is all ones, b where it is zero, as arithmetic the vectorizer
+	// doesn't turn into a branch
+	inline uint32_t select(uint32_t mask, uint32_t a, uint32_t b) {
+		return (a & mask) | (b & ~mask);
+	}
+
+	// taken = condition(flags) != negate, as masks
+	template<typename F>
+	void laneCondition(size_t width, const uint32_t* __restrict flags, uint32_t* __restrict taken, bool negate, F condition) {
+		uint32_t invert = negate ? 1 : 0;
+		for (size_t l = 0; l < width; l++) {
+			taken[l] = 0u - (condition(flags[l]) ^ invert);
+		}
+	}
+
+	// Kernels over all lanes, with every array as its own restrict parameter
+	// so the loop is vectorized without checking them for overlaps.
+
+	// op destination, source or operand for the active lanes, recording the lazy flags
+	// with the carry in as aux like the CPU, 0 but for adc and sbb
+	template<uint8_t operation, bool immediate>
+	void aluLanes(size_t width, const uint32_t* __restrict active, uint32_t* __restrict destination, const uint32_t* __restrict source, uint32_t operand,
+		const uint32_t* __restrict eflags, uint32_t* __restrict flagOps, uint32_t* __restrict flagValue1, uint32_t* __restrict flagValue2,
+		uint32_t* __restrict flagResult, uint32_t* __restrict flagAux);
+
+	// inc or dec destination for the active lanes, CF goes to aux as in the CPU
+	template<bool inc>
+	void incLanes(size_t width, const uint32_t* __restrict active, uint32_t* __restrict destination, const uint32_t* __restrict eflags,
+		uint32_t* __restrict flagOps, uint32_t* __restrict flagValue1, uint32_t* __restrict flagValue2, uint32_t* __restrict flagResult, uint32_t* __restrict flagAux) {
+		uint32_t flagOp = (uint32_t)(inc ? Registers::FlagOp::Inc : Registers::FlagOp::Dec);
+		for (size_t l = 0; l < width; l++) {
+			uint32_t value = destination[l];
+			uint32_t result = inc ? value + 1 : value - 1;
+			uint32_t carry = carryOf(flagOps[l], flagValue1[l], flagValue2[l], flagResult[l], flagAux[l], eflags[l]);
+			uint32_t on = active[l];
+			flagOps[l] = select(on, flagOp, flagOps[l]);
+			flagValue1[l] = select(on, value, flagValue1[l]);
+			flagValue2[l] = select(on, 1, flagValue2[l]);
+			flagResult[l] = select(on, result, flagResult[l]);
+			flagAux[l] = select(on, carry, flagAux[l]);
+			destination[l] = select(on, result, value);
+		}
+	}
+
+	// shl, shr or sar destination by count (1 - 31) for the active lanes, CF and OF go to aux as in the CPU
+	template<uint8_t operation>
+	void shiftLanes(size_t width, const uint32_t* __restrict active, uint32_t* __restrict destination, uint32_t count,
+		uint32_t* __restrict flagOps, uint32_t* __restrict flagValue1, uint32_t* __restrict flagValue2, uint32_t* __restrict flagResult, uint32_t* __restrict flagAux) {
+		uint32_t flagOp = (uint32_t)Registers::FlagOp::Result;
+		for (size_t l = 0; l < width; l++) {
+			uint32_t value = destination[l];
+			uint32_t result;
+			uint32_t carry;
+			uint32_t overflow;
+			if constexpr (operation == shiftShl) {
+				result = value << count;
+				carry = (value >> (32 - count)) & 1;
+				overflow = (result >> 31) ^ carry;
+			}
+			else if constexpr (operation == shiftShr) {
+				result = value >> count;
+				carry = (value >> (count - 1)) & 1;
+				overflow = value >> 31;
+			}
+			else {
+				result = (uint32_t)((int32_t)value >> count);
+				carry = ((uint32_t)((int32_t)value >> (count - 1))) & 1;
+				overflow = 0;
+			}
+			uint32_t on = active[l];
+			flagOps[l] = select(on, flagOp, flagOps[l]);
+			flagValue1[l] = select(on, value, flagValue1[l]);
+			flagValue2[l] = select(on, count, flagValue2[l]);
+			flagResult[l] = select(on, result, flagResult[l]);
+			flagAux[l] = select(on, carry * (uint32_t)Registers::Flag::CF | overflow * (uint32_t)Registers::Flag::OF, flagAux[l]);
+			destination[l] = select(on, result, value);
+		}
+	}
+
+	template<uint8_t operation>
+	constexpr Registers::FlagOp flagOpOf() {
+		if constexpr (operation == aluAdd || operation == aluAdc) {
+			return Registers::FlagOp::Add;
+		}
+		else if constexpr (operation == aluSub || operation == aluCmp || operation == aluSbb) {
+			return Registers::FlagOp::Sub;
+		}
+		else {
+			return Registers::FlagOp::Logic;
+		}
+	}
+
+	template<uint8_t operation, bool immediate>
+	void aluLanes(size_t width, const uint32_t* __restrict active, uint32_t* __restrict destination, const uint32_t* __restrict source, uint32_t operand,
+		const uint32_t* __restrict eflags, uint32_t* __restrict flagOps, uint32_t* __restrict flagValue1, uint32_t* __restrict flagValue2,
+		uint32_t* __restrict flagResult, uint32_t* __restrict flagAux) {
+		uint32_t flagOp = (uint32_t)flagOpOf<operation>();
+		for (size_t l = 0; l < width; l++) {
+			uint32_t value1 = destination[l];
+			uint32_t value2 = immediate ? operand : source[l];
+			uint32_t carry = 0;
+			if constexpr (operation == aluAdc || operation == aluSbb) {
+				carry = carryOf(flagOps[l], flagValue1[l], flagValue2[l], flagResult[l], flagAux[l], eflags[l]);
+			}
+			uint32_t result = compute<operation>(value1, value2, carry);
+			uint32_t on = active[l];
+			if constexpr (operation != aluCmp && operation != aluTest) {
+				destination[l] = select(on, result, value1);
+			}
+			flagOps[l] = select(on, flagOp, flagOps[l]);
+			flagValue1[l] = select(on, value1, flagValue1[l]);
+			flagValue2[l] = select(on, value2, flagValue2[l]);
+			flagResult[l] = select(on, result, flagResult[l]);
+			flagAux[l] = select(on, carry, flagAux[l]);
+		}
+	}
+
+	// op on the low bytes of destination and source or operand for the active
+	// lanes. The lazy flags are 32 bit, so byte operations build EFLAGS at once.
+	template<uint8_t operation, bool immediate>
+	void aluByteLanes(size_t width, const uint32_t* __restrict active, uint32_t* __restrict destination, const uint32_t* __restrict source, uint32_t operand,
+		uint32_t* __restrict eflags, uint32_t* __restrict flagOps, const uint32_t* __restrict flagValue1, const uint32_t* __restrict flagValue2,
+		const uint32_t* __restrict flagResult, const uint32_t* __restrict flagAux) {
+		constexpr bool add = operation == aluAdd || operation == aluAdc;
+		constexpr bool sub = operation == aluSub || operation == aluSbb || operation == aluCmp;
+		for (size_t l = 0; l < width; l++) {
+			uint32_t value1 = destination[l] & 0xFF;
+			uint32_t value2 = (immediate ? operand : source[l]) & 0xFF;
+			uint32_t carry = 0;
+			if constexpr (operation == aluAdc || operation == aluSbb) {
+				carry = carryOf(flagOps[l], flagValue1[l], flagValue2[l], flagResult[l], flagAux[l], eflags[l]);
+			}
+			// a carry or borrow out of the byte shows in bit 8
+			uint32_t wide = compute<operation>(value1, value2, carry);
+			uint32_t result = wide & 0xFF;
+
+			uint32_t flags = (result == 0 ? (uint32_t)Registers::Flag::ZF : 0) |
+				(result >> 7) * (uint32_t)Registers::Flag::SF |
+				parityOf(result) * (uint32_t)Registers::Flag::PF;
+			if constexpr (add || sub) {
+				uint32_t overflow = add ? ((value1 ^ result) & (value2 ^ result)) >> 7 : ((value1 ^ value2) & (value1 ^ result)) >> 7;
+				flags |= ((wide >> 8) & 1) * (uint32_t)Registers::Flag::CF |
+					(overflow & 1) * (uint32_t)Registers::Flag::OF |
+					(((value1 ^ value2 ^ result) >> 4) & 1) * (uint32_t)Registers::Flag::AF;
+			}
+
+			uint32_t on = active[l];
+			if constexpr (operation != aluCmp && operation != aluTest) {
+				destination[l] = select(on, (destination[l] & ~0xFFu) | result, destination[l]);
+			}
+			eflags[l] = select(on, (eflags[l] & ~Registers::arithmeticFlags) | flags, eflags[l]);
+			flagOps[l] = select(on, (uint32_t)Registers::FlagOp::None, flagOps[l]);
+		}
+	}
+
+	// edx:eax = eax * source for the active lanes, CF and OF go to aux as in the CPU
+	void mulLanes(size_t width, const uint32_t* __restrict active, uint32_t* __restrict eax, uint32_t* __restrict edx, const uint32_t* __restrict source,
+		uint32_t* __restrict flagOps, uint32_t* __restrict flagValue1, uint32_t* __restrict flagValue2, uint32_t* __restrict flagResult, uint32_t* __restrict flagAux) {
+		uint32_t flagOp = (uint32_t)Registers::FlagOp::Result;
+		uint32_t overflowFlags = (uint32_t)Registers::Flag::CF | (uint32_t)Registers::Flag::OF;
+		for (size_t l = 0; l < width; l++) {
+			uint32_t value1 = eax[l];
+			uint32_t value2 = source[l];
+			uint64_t product = (uint64_t)value1 * value2;
+			uint32_t low = (uint32_t)product;
+			uint32_t high = (uint32_t)(product >> 32);
+			uint32_t on = active[l];
+			eax[l] = select(on, low, value1);
+			edx[l] = select(on, high, edx[l]);
+			flagOps[l] = select(on, flagOp, flagOps[l]);
+			flagValue1[l] = select(on, value1, flagValue1[l]);
+			flagValue2[l] = select(on, value2, flagValue2[l]);
+			flagResult[l] = select(on, low, flagResult[l]);
+			flagAux[l] = select(on, high != 0 ? overflowFlags : 0, flagAux[l]);
+		}
+	}
+}
+
+Lockstep::Lockstep(const std::string& path, std::vector<std::vector<uint8_t>> inputs, Memory::Placement placement) {
+	ELFLoader loader(path);
+
+	// the lanes don't move once the CPUs point to their inputs
+	this->lanes.resize(inputs.size());
+	this->width = (inputs.size() + laneBlock - 1) / laneBlock * laneBlock;
+	for (std::vector<uint32_t>& lanes : this->registers) {
+		lanes.assign(this->width, 0);
+	}
+	for (std::vector<uint32_t>* lanes : { &this->eip, &this->eflags, &this->flagOp, &this->flagValue1, &this->flagValue2, &this->flagResult,
+		&this->flagAux, &this->running, &this->active, &this->addresses, &this->values, &this->taken, &this->verify }) {
+		lanes->assign(this->width, 0);
+	}
+
+	for (size_t i = 0; i < this->lanes.size(); i++) {
+		Lane& lane = this->lanes[i];
+		lane.input = std::move(inputs[i]);
+		lane.memory = std::make_unique<Memory>(memorySize, placement);
+		lane.cpu = std::make_unique<CPU>(lane.memory.get());
+		lane.cpu->setIP(loader.load(*lane.memory));
+		lane.cpu->getRegisters().set(Registers::Reg::ESP, 0x0f'ff'ff'00);
+		lane.cpu->setInput(lane.input);
+		// decoded pages are protected in every lane, a lane writing one may now differ
+		lane.memory->addCodeWriteListener(this, [this, i](size_t) {
+			setVerify(i);
+		});
+
+		load(i);
+		this->running[i] = ~0u;
+	}
+}
+
+void Lockstep::run() {
+	const size_t width = this->width;
+	uint32_t* __restrict eip = this->eip.data();
+	uint32_t* __restrict running = this->running.data();
+	uint32_t* __restrict active = this->active.data();
+	while (true) {
+		// the lowest EIP runs next, lanes ahead of it wait there
+		uint32_t next = std::numeric_limits<uint32_t>::max();
+		uint32_t runningCount = 0;
+		for (size_t l = 0; l < width; l++) {
+			next = std::min(next, eip[l] | ~running[l]);
+			runningCount += running[l] & 1;
+		}
+		if (runningCount == 0) {
+			break;
+		}
+
+		uint32_t count = 0;
+		for (size_t l = 0; l < width; l++) {
+			active[l] = running[l] & (0u - (eip[l] == next ? 1 : 0));
+			count += active[l] & 1;
+		}
+		this->issued++;
+		this->laneInstructions += count;
+
+		this->scalarLanes.clear();
+		const Op& op = decode(next);
+		if (op.kind == Kind::Scalar) {
+			for (size_t l = 0; l < this->lanes.size(); l++) {
+				if (active[l]) {
+					this->scalarLanes.push_back(l);
+				}
+			}
+		}
+		else {
+			// a lane whose code changed runs the instruction its bytes hold
+			for (size_t l = 0; l < this->lanes.size() && this->verifying > 0; l++) {
+				if (active[l] && this->verify[l] &&
+					!(this->lanes[l].memory->contains(next, op.length) && memcmp(this->lanes[l].memory->view(next, op.length), op.bytes.data(), op.length) == 0)) {
+					active[l] = 0;
+					this->scalarLanes.push_back(l);
+				}
+			}
+			execute(op, next);
+		}
+		for (size_t lane : this->scalarLanes) {
+			runScalar(lane);
+		}
+	}
+}
+
+const Lockstep::Result& Lockstep::getResult(size_t lane) {
+	return this->lanes[lane].result;
+}
+
+uint64_t Lockstep::getIssued() {
+	return this->issued;
+}
+
+uint64_t Lockstep::getLaneInstructions() {
+	return this->laneInstructions;
+}
+
+uint64_t Lockstep::getScalarInstructions() {
+	return this->scalarInstructions;
+}
+
+const Lockstep::Op& Lockstep::decode(uint32_t address) {
+	auto found = this->ops.find(address);
+	if (found != this->ops.end()) {
+		return found->second;
+	}
+
+	// the bytes of a lane whose code didn't change, if one runs it
+	size_t lane = this->lanes.size();
+	for (size_t l = 0; l < this->lanes.size(); l++) {
+		if (this->active[l] && (lane == this->lanes.size() || (this->verify[lane] && !this->verify[l]))) {
+			lane = l;
+		}
+	}
+
+	Op& op = this->ops[address];
+	Memory* memory = this->lanes[lane].memory.get();
+	size_t available = memory->contains(address, 1) ? std::min<size_t>(op.bytes.size(), memory->getSize() - address) : 0;
+	if (available == 0) {
+		// the lanes fault on their own
+		return op;
+	}
+	memcpy(op.bytes.data(), memory->view(address, available), available);
+
+	const uint8_t* bytes = op.bytes.data();
+	uint8_t opcode = bytes[0];
+	uint8_t length = 1;
+
+	// the memory operand of the ModR/M byte at bytes[1], false for a register
+	auto decodeMemory = [&]() {
+		uint8_t mod = bytes[1] >> 6;
+		uint8_t rm = bytes[1] & 0b111;
+		length = 2;
+		if (mod == 0b11) {
+			return false;
+		}
+
+		op.hasBase = true;
+		if (rm == 0b100) {
+			uint8_t sib = bytes[length++];
+			op.scale = sib >> 6;
+			op.index = ((sib >> 3) & 0b111) == espIndex ? noIndex : (sib >> 3) & 0b111;
+			rm = sib & 0b111;
+		}
+		op.rm = rm;
+		if (mod == 0b00 && rm == 0b101) {
+			op.hasBase = false;
+			op.value = read32(bytes + length);
+			length += 4;
+		}
+		else if (mod == 0b01) {
+			op.value = (uint32_t)(int32_t)(int8_t)bytes[length];
+			length += 1;
+		}
+		else if (mod == 0b10) {
+			op.value = read32(bytes + length);
+			length += 4;
+		}
+		return true;
+	};
+
+	uint8_t reg = (bytes[1] >> 3) & 0b111;
+	if ((opcode & 0b1100'0101) == 0b0000'0001) {
+		// op r/m32, r32 and op r32, r/m32
+		op.operation = opcode >> 3;
+		bool toRm = (opcode & 0b10) == 0;
+		if (decodeMemory()) {
+			op.kind = toRm ? Kind::AluStore : Kind::AluLoad;
+			op.reg = reg;
+		}
+		else {
+			op.kind = Kind::Alu;
+			op.reg = toRm ? bytes[1] & 0b111 : reg;
+			op.rm = toRm ? reg : bytes[1] & 0b111;
+		}
+	}
+	else if ((opcode & 0b1100'0111) == 0b0000'0101) {
+		// op eax, imm32
+		op.kind = Kind::AluImm;
+		op.operation = opcode >> 3;
+		op.reg = 0;
+		op.value = read32(bytes + 1);
+		length = 5;
+	}
+	else if (opcode == 0x81 || opcode == 0x83) {
+		op.operation = reg;
+		if (decodeMemory()) {
+			// the immediate follows the displacement
+			op.kind = Kind::AluStore;
+			op.hasImmediate = true;
+			op.immediate = (opcode == 0x81) ? read32(bytes + length) : (uint32_t)(int32_t)(int8_t)bytes[length];
+			length += (opcode == 0x81) ? 4 : 1;
+		}
+		else {
+			op.kind = Kind::AluImm;
+			op.reg = bytes[1] & 0b111;
+			op.value = (opcode == 0x81) ? read32(bytes + 2) : (uint32_t)(int32_t)(int8_t)bytes[2];
+			length = (opcode == 0x81) ? 6 : 3;
+		}
+	}
+	else if (opcode == 0x85) {
+		op.operation = aluTest;
+		if (decodeMemory()) {
+			op.kind = Kind::AluLoad;
+			op.reg = reg;
+		}
+		else {
+			op.kind = Kind::Alu;
+			op.reg = bytes[1] & 0b111;
+			op.rm = reg;
+		}
+	}
+	else if (opcode == 0xFF && reg <= 1) {
+		// inc and dec r/m32
+		if (decodeMemory()) {
+			op.kind = Kind::AluStore;
+			op.operation = (reg == 0) ? aluInc : aluDec;
+		}
+		else {
+			op.kind = (reg == 0) ? Kind::Inc : Kind::Dec;
+			op.reg = bytes[1] & 0b111;
+		}
+	}
+	else if (opcode == 0xF7 && reg == 4) {
+		// mul r/m32
+		op.kind = Kind::Mul;
+		op.hasMemory = decodeMemory();
+		if (!op.hasMemory) {
+			op.rm = bytes[1] & 0b111;
+		}
+	}
+	else if ((opcode & 0b1100'0101) == 0b0000'0000 || opcode == 0x84) {
+		// op r/m8, r8, op r8, r/m8 and test r/m8, r8
+		op.operation = (opcode == 0x84) ? aluTest : opcode >> 3;
+		bool toRm = (opcode & 0b10) == 0;
+		bool hasMemory = decodeMemory();
+		op.hasMemory = hasMemory;
+		op.reg = (toRm && !hasMemory) ? bytes[1] & 0b111 : reg;
+		op.rm = hasMemory ? op.rm : toRm ? reg : bytes[1] & 0b111;
+		// stores to memory and ah, ch, dh and bh run on the CPUs
+		if ((!hasMemory || !toRm || op.operation == aluTest) && op.reg < espIndex && (hasMemory || op.rm < espIndex)) {
+			op.kind = Kind::AluByte;
+		}
+	}
+	else if ((opcode & 0b1100'0111) == 0b0000'0100) {
+		// op al, imm8
+		op.kind = Kind::AluByte;
+		op.operation = opcode >> 3;
+		op.reg = 0;
+		op.hasImmediate = true;
+		op.immediate = bytes[1];
+		length = 2;
+	}
+	else if (opcode == 0x80) {
+		if (!decodeMemory() && (bytes[1] & 0b111) < espIndex) {
+			op.kind = Kind::AluByte;
+			op.operation = reg;
+			op.reg = bytes[1] & 0b111;
+			op.hasImmediate = true;
+			op.immediate = bytes[2];
+			length = 3;
+		}
+	}
+	else if ((opcode & 0xF0) == 0x40) {
+		op.kind = (opcode & 0b1000) ? Kind::Dec : Kind::Inc;
+		op.reg = opcode & 0b111;
+	}
+	else if ((opcode & 0xF8) == 0x50 && (opcode & 0b111) != espIndex) {
+		op.kind = Kind::Push;
+		op.reg = opcode & 0b111;
+	}
+	else if ((opcode & 0xF8) == 0x58 && (opcode & 0b111) != espIndex) {
+		op.kind = Kind::Pop;
+		op.reg = opcode & 0b111;
+	}
+	else if ((opcode & 0xF0) == 0x70) {
+		op.kind = Kind::Jcc;
+		op.operation = opcode & 0x0F;
+		length = 2;
+		op.value = address + length + (int32_t)(int8_t)bytes[1];
+	}
+	else if ((opcode == 0xC1 || opcode == 0xD1) && reg >= shiftShl) {
+		if (!decodeMemory()) {
+			op.operation = (reg == shiftSal) ? shiftShl : reg;
+			op.reg = bytes[1] & 0b111;
+			op.value = ((opcode == 0xC1) ? bytes[2] : 1) & 0x1F;
+			length = (opcode == 0xC1) ? 3 : 2;
+			// a count of 0 leaves the flags alone
+			op.kind = (op.value != 0) ? Kind::Shift : Kind::Scalar;
+		}
+	}
+	else if ((opcode == 0x88 || opcode == 0x8A) && reg < espIndex) {
+		// al, cl, dl and bl to and from memory
+		if (decodeMemory()) {
+			op.kind = (opcode == 0x88) ? Kind::StoreByte : Kind::LoadByte;
+			op.reg = reg;
+		}
+	}
+	else if (opcode == 0x89 || opcode == 0x8B || opcode == 0x8D) {
+		bool hasMemory = decodeMemory();
+		bool toRm = opcode == 0x89;
+		if (opcode == 0x8D) {
+			// lea needs a memory operand
+			op.kind = hasMemory ? Kind::Lea : Kind::Scalar;
+			op.reg = reg;
+		}
+		else if (hasMemory) {
+			op.kind = toRm ? Kind::Store : Kind::Load;
+			op.reg = reg;
+		}
+		else {
+			op.kind = Kind::Mov;
+			op.reg = toRm ? bytes[1] & 0b111 : reg;
+			op.rm = toRm ? reg : bytes[1] & 0b111;
+		}
+	}
+	else if (opcode == 0x90) {
+		op.kind = Kind::Nop;
+	}
+	else if ((opcode & 0xF8) == 0xB8) {
+		op.kind = Kind::MovImm;
+		op.reg = opcode & 0b111;
+		op.value = read32(bytes + 1);
+		length = 5;
+	}
+	else if (opcode == 0xC3) {
+		op.kind = Kind::Ret;
+	}
+	else if (opcode == 0xE8 || opcode == 0xE9) {
+		op.kind = (opcode == 0xE8) ? Kind::Call : Kind::Jmp;
+		length = 5;
+		op.value = address + length + read32(bytes + 1);
+	}
+	else if (opcode == 0xEB) {
+		op.kind = Kind::Jmp;
+		length = 2;
+		op.value = address + length + (int32_t)(int8_t)bytes[1];
+	}
+
+	op.length = length;
+	if (op.kind == Kind::Scalar || length > available) {
+		op.kind = Kind::Scalar;
+		return op;
+	}
+
+	// the lanes whose bytes already differ are compared every time,
+	// a lane changing them later is caught by the protection
+	for (size_t l = 0; l < this->lanes.size(); l++) {
+		Memory* other = this->lanes[l].memory.get();
+		if (!other->contains(address, length) || memcmp(other->view(address, length), bytes, length) != 0) {
+			setVerify(l);
+		}
+		for (size_t page = address / Memory::pageSize; page <= (address + length - 1) / Memory::pageSize; page++) {
+			other->protectCode(page);
+		}
+	}
+	return op;
+}
+
+void Lockstep::execute(const Op& op, uint32_t address) {
+	const size_t width = this->width;
+	const uint32_t* __restrict active = this->active.data();
+	uint32_t* __restrict addresses = this->addresses.data();
+	uint32_t* __restrict values = this->values.data();
+	uint32_t* destination = this->registers[op.reg].data();
+	uint32_t* esp = this->registers[espIndex].data();
+	uint32_t next = address + op.length;
+	// immediate or target
+	uint32_t value = op.value;
+
+	switch (op.kind) {
+		case Kind::MovImm:
+			for (size_t l = 0; l < width; l++) {
+				destination[l] = select(active[l], value, destination[l]);
+			}
+			break;
+		case Kind::Mov: {
+			const uint32_t* source = this->registers[op.rm].data();
+			for (size_t l = 0; l < width; l++) {
+				destination[l] = select(active[l], source[l], destination[l]);
+			}
+			break;
+		}
+		case Kind::Lea:
+			computeAddresses(op);
+			for (size_t l = 0; l < width; l++) {
+				destination[l] = select(active[l], addresses[l], destination[l]);
+			}
+			break;
+		case Kind::Load:
+			computeAddresses(op);
+			checkAccess(addresses, 4);
+			loadValues();
+			for (size_t l = 0; l < width; l++) {
+				destination[l] = select(active[l], values[l], destination[l]);
+			}
+			break;
+		case Kind::Store:
+			computeAddresses(op);
+			checkAccess(addresses, 4);
+			std::copy(destination, destination + width, values);
+			storeValues();
+			break;
+		case Kind::LoadByte:
+			computeAddresses(op);
+			checkAccess(addresses, 1);
+			for (size_t l = 0; l < this->lanes.size(); l++) {
+				if (active[l]) {
+					destination[l] = (destination[l] & ~0xFFu) | this->lanes[l].memory->read<uint8_t>(addresses[l]);
+				}
+			}
+			break;
+		case Kind::StoreByte:
+			computeAddresses(op);
+			checkAccess(addresses, 1);
+			for (size_t l = 0; l < this->lanes.size(); l++) {
+				if (active[l]) {
+					this->lanes[l].memory->write<uint8_t>(addresses[l], (uint8_t)destination[l]);
+				}
+			}
+			break;
+		case Kind::Alu:
+			if (op.rm == op.reg) {
+				// op eax, eax reads the value it replaces
+				std::copy(destination, destination + width, values);
+				alu(op, destination, values, 0);
+			}
+			else {
+				alu(op, destination, this->registers[op.rm].data(), 0);
+			}
+			break;
+		case Kind::AluImm:
+			alu(op, destination, nullptr, value);
+			break;
+		case Kind::AluLoad:
+			computeAddresses(op);
+			checkAccess(addresses, 4);
+			loadValues();
+			alu(op, destination, values, 0);
+			break;
+		case Kind::AluStore:
+			// the memory operand goes through values
+			computeAddresses(op);
+			checkAccess(addresses, 4);
+			loadValues();
+			alu(op, values, op.hasImmediate ? nullptr : destination, op.immediate);
+			if (op.operation != aluCmp && op.operation != aluTest) {
+				storeValues();
+			}
+			break;
+		case Kind::AluByte:
+			if (op.hasMemory) {
+				computeAddresses(op);
+				checkAccess(addresses, 1);
+				for (size_t l = 0; l < this->lanes.size(); l++) {
+					if (active[l]) {
+						values[l] = this->lanes[l].memory->read<uint8_t>(addresses[l]);
+					}
+				}
+				alu(op, destination, values, 0);
+			}
+			else if (!op.hasImmediate) {
+				// the source may be the destination
+				const uint32_t* source = this->registers[op.rm].data();
+				std::copy(source, source + width, values);
+				alu(op, destination, values, 0);
+			}
+			else {
+				alu(op, destination, nullptr, op.immediate);
+			}
+			break;
+		case Kind::Mul:
+			if (op.hasMemory) {
+				computeAddresses(op);
+				checkAccess(addresses, 4);
+				loadValues();
+			}
+			else {
+				const uint32_t* source = this->registers[op.rm].data();
+				std::copy(source, source + width, values);
+			}
+			mulLanes(width, active, this->registers[0].data(), this->registers[2].data(), values,
+				this->flagOp.data(), this->flagValue1.data(), this->flagValue2.data(), this->flagResult.data(), this->flagAux.data());
+			break;
+		case Kind::Inc:
+		case Kind::Dec: {
+			auto lanes = (op.kind == Kind::Inc) ? incLanes<true> : incLanes<false>;
+			lanes(width, active, destination, this->eflags.data(),
+				this->flagOp.data(), this->flagValue1.data(), this->flagValue2.data(), this->flagResult.data(), this->flagAux.data());
+			break;
+		}
+		case Kind::Shift: {
+			auto lanes = (op.operation == shiftShl) ? shiftLanes<shiftShl> : (op.operation == shiftShr) ? shiftLanes<shiftShr> : shiftLanes<shiftSar>;
+			lanes(width, active, destination, value,
+				this->flagOp.data(), this->flagValue1.data(), this->flagValue2.data(), this->flagResult.data(), this->flagAux.data());
+			break;
+		}
+		case Kind::Push:
+		case Kind::Call: {
+			// call pushes the return address
+			const uint32_t* pushed = (op.kind == Kind::Push) ? destination : nullptr;
+			for (size_t l = 0; l < width; l++) {
+				addresses[l] = esp[l] - 4;
+				values[l] = (pushed != nullptr) ? pushed[l] : next;
+			}
+			checkAccess(addresses, 4);
+			storeValues();
+			for (size_t l = 0; l < width; l++) {
+				esp[l] = select(active[l], addresses[l], esp[l]);
+			}
+			break;
+		}
+		case Kind::Pop:
+		case Kind::Ret: {
+			// ret pops into values, EIP is set below
+			std::copy(esp, esp + width, addresses);
+			checkAccess(addresses, 4);
+			loadValues();
+			for (size_t l = 0; l < width; l++) {
+				esp[l] = select(active[l], esp[l] + 4, esp[l]);
+			}
+			if (op.kind == Kind::Pop) {
+				for (size_t l = 0; l < width; l++) {
+					destination[l] = select(active[l], values[l], destination[l]);
+				}
+			}
+			break;
+		}
+		case Kind::Jcc:
+			testCondition(op.operation);
+			break;
+		default:
+			break;
+	}
+
+	// the active lanes were all at one EIP, now they may go different ways
+	uint32_t* __restrict eip = this->eip.data();
+	const uint32_t* __restrict taken = this->taken.data();
+	switch (op.kind) {
+		case Kind::Call:
+		case Kind::Jmp:
+			next = value;
+			break;
+		case Kind::Jcc:
+			for (size_t l = 0; l < width; l++) {
+				eip[l] = select(active[l], select(taken[l], value, next), eip[l]);
+			}
+			return;
+		case Kind::Ret:
+			for (size_t l = 0; l < width; l++) {
+				eip[l] = select(active[l], values[l], eip[l]);
+			}
+			return;
+		default:
+			break;
+	}
+	for (size_t l = 0; l < width; l++) {
+		eip[l] = select(active[l], next, eip[l]);
+	}
+}
+
+void Lockstep::alu(const Op& op, uint32_t* destination, const uint32_t* source, uint32_t immediate) {
+	bool hasImmediate = source == nullptr;
+	bool byte = op.kind == Kind::AluByte;
+	switch (op.operation) {
+		case aluAdd: hasImmediate ? alu<aluAdd, true>(destination, source, immediate, byte) : alu<aluAdd, false>(destination, source, immediate, byte); break;
+		case aluOr: hasImmediate ? alu<aluOr, true>(destination, source, immediate, byte) : alu<aluOr, false>(destination, source, immediate, byte); break;
+		case aluAdc: hasImmediate ? alu<aluAdc, true>(destination, source, immediate, byte) : alu<aluAdc, false>(destination, source, immediate, byte); break;
+		case aluSbb: hasImmediate ? alu<aluSbb, true>(destination, source, immediate, byte) : alu<aluSbb, false>(destination, source, immediate, byte); break;
+		case aluAnd: hasImmediate ? alu<aluAnd, true>(destination, source, immediate, byte) : alu<aluAnd, false>(destination, source, immediate, byte); break;
+		case aluSub: hasImmediate ? alu<aluSub, true>(destination, source, immediate, byte) : alu<aluSub, false>(destination, source, immediate, byte); break;
+		case aluXor: hasImmediate ? alu<aluXor, true>(destination, source, immediate, byte) : alu<aluXor, false>(destination, source, immediate, byte); break;
+		case aluCmp: hasImmediate ? alu<aluCmp, true>(destination, source, immediate, byte) : alu<aluCmp, false>(destination, source, immediate, byte); break;
+		case aluTest: alu<aluTest, false>(destination, source, immediate, byte); break;
+		default: {
+			auto lanes = (op.operation == aluInc) ? incLanes<true> : incLanes<false>;
+			lanes(this->width, this->active.data(), destination, this->eflags.data(),
+				this->flagOp.data(), this->flagValue1.data(), this->flagValue2.data(), this->flagResult.data(), this->flagAux.data());
+			break;
+		}
+	}
+}
+
+template<uint8_t operation, bool immediate>
+void Lockstep::alu(uint32_t* destination, const uint32_t* source, uint32_t operand, bool byte) {
+	if (byte) {
+		aluByteLanes<operation, immediate>(this->width, this->active.data(), destination, source, operand, this->eflags.data(),
+			this->flagOp.data(), this->flagValue1.data(), this->flagValue2.data(), this->flagResult.data(), this->flagAux.data());
+	}
+	else {
+		aluLanes<operation, immediate>(this->width, this->active.data(), destination, source, operand, this->eflags.data(),
+			this->flagOp.data(), this->flagValue1.data(), this->flagValue2.data(), this->flagResult.data(), this->flagAux.data());
+	}
+}
+
+void Lockstep::computeAddresses(const Op& op) {
+	const uint32_t* __restrict base = this->registers[op.rm].data();
+	const uint32_t* __restrict index = this->registers[(op.index == noIndex) ? 0 : op.index].data();
+	uint32_t* __restrict addresses = this->addresses.data();
+	uint32_t baseMask = op.hasBase ? ~0u : 0;
+	uint32_t indexMask = (op.index == noIndex) ? 0 : ~0u;
+	uint32_t scale = op.scale;
+	uint32_t displacement = op.value;
+	for (size_t l = 0; l < this->width; l++) {
+		addresses[l] = (base[l] & baseMask) + ((index[l] & indexMask) << scale) + displacement;
+	}
+}
+
+void Lockstep::checkAccess(const uint32_t* addresses, uint32_t size) {
+	// a lane accessing memory it doesn't have runs the instruction on its CPU and faults there
+	for (size_t l = 0; l < this->lanes.size(); l++) {
+		if (this->active[l] && !this->lanes[l].memory->contains(addresses[l], size)) {
+			this->active[l] = 0;
+			this->scalarLanes.push_back(l);
+		}
+	}
+}
+
+void Lockstep::loadValues() {
+	const uint32_t* __restrict addresses = this->addresses.data();
+	uint32_t* __restrict values = this->values.data();
+	for (size_t l = 0; l < this->lanes.size(); l++) {
+		if (this->active[l]) {
+			values[l] = this->lanes[l].memory->read<uint32_t>(addresses[l]);
+		}
+	}
+}
+
+void Lockstep::storeValues() {
+	const uint32_t* __restrict addresses = this->addresses.data();
+	const uint32_t* __restrict values = this->values.data();
+	for (size_t l = 0; l < this->lanes.size(); l++) {
+		if (this->active[l]) {
+			this->lanes[l].memory->write<uint32_t>(addresses[l], values[l]);
+		}
+	}
+}
+
+void Lockstep::testCondition(uint8_t condition) {
+	const size_t width = this->width;
+	const uint32_t* __restrict flagOps = this->flagOp.data();
+	const uint32_t* __restrict flagValue1 = this->flagValue1.data();
+	const uint32_t* __restrict flagValue2 = this->flagValue2.data();
+	const uint32_t* __restrict flagResult = this->flagResult.data();
+	const uint32_t* __restrict flagAux = this->flagAux.data();
+	const uint32_t* __restrict eflags = this->eflags.data();
+	const uint32_t* __restrict active = this->active.data();
+	uint32_t* __restrict flags = this->values.data();
+
+	// ZF and SF follow from the result of any operation, CF from carryOf()
+	uint8_t test = (condition >> 1) & 0b111;
+	uint32_t other = 0;
+	bool overflow = test == 0b000 || test == 0b110 || test == 0b111;
+	if (overflow) {
+		for (size_t l = 0; l < width; l++) {
+			other |= active[l] & (flagOps[l] != (uint32_t)Registers::FlagOp::Sub && flagOps[l] != (uint32_t)Registers::FlagOp::Logic ? 1 : 0);
+		}
+	}
+	if (test == 0b001 || test == 0b010 || test == 0b011 || test == 0b100) {
+		for (size_t l = 0; l < width; l++) {
+			uint32_t none = 0u - (flagOps[l] == (uint32_t)Registers::FlagOp::None ? 1 : 0);
+			uint32_t result = flagResult[l];
+			uint32_t computed = (result == 0 ? (uint32_t)Registers::Flag::ZF : 0) | (result >> 31) * (uint32_t)Registers::Flag::SF;
+			flags[l] = select(none, eflags[l], computed) |
+				carryOf(flagOps[l], flagValue1[l], flagValue2[l], result, flagAux[l], eflags[l]) * (uint32_t)Registers::Flag::CF;
+		}
+	}
+	else if (overflow && other == 0) {
+		// after cmp, sub and test OF follows from the operands too
+		for (size_t l = 0; l < width; l++) {
+			uint32_t sub = 0u - (flagOps[l] == (uint32_t)Registers::FlagOp::Sub ? 1 : 0);
+			uint32_t value1 = flagValue1[l];
+			uint32_t value2 = flagValue2[l];
+			uint32_t result = flagResult[l];
+			flags[l] = (result == 0 ? (uint32_t)Registers::Flag::ZF : 0) |
+				(result >> 31) * (uint32_t)Registers::Flag::SF |
+				(sub & (((value1 ^ value2) & (value1 ^ result)) >> 31) * (uint32_t)Registers::Flag::OF);
+		}
+	}
+	else {
+		for (size_t l = 0; l < width; l++) {
+			flags[l] = flagsOf(flagOps[l], flagValue1[l], flagValue2[l], flagResult[l], flagAux[l], eflags[l]);
+		}
+	}
+
+	// OF, CF, ZF, SF and PF as bits 11, 0, 6, 7 and 2
+	uint32_t* __restrict taken = this->taken.data();
+	bool negate = (condition & 1) > 0;
+	switch (test) {
+		case 0b000:
+			laneCondition(width, flags, taken, negate, [](uint32_t f) { return (f >> 11) & 1; });
+			break;
+		case 0b001:
+			laneCondition(width, flags, taken, negate, [](uint32_t f) { return f & 1; });
+			break;
+		case 0b010:
+			laneCondition(width, flags, taken, negate, [](uint32_t f) { return (f >> 6) & 1; });
+			break;
+		case 0b011:
+			laneCondition(width, flags, taken, negate, [](uint32_t f) { return (f | (f >> 6)) & 1; });
+			break;
+		case 0b100:
+			laneCondition(width, flags, taken, negate, [](uint32_t f) { return (f >> 7) & 1; });
+			break;
+		case 0b101:
+			laneCondition(width, flags, taken, negate, [](uint32_t f) { return (f >> 2) & 1; });
+			break;
+		case 0b110:
+			laneCondition(width, flags, taken, negate, [](uint32_t f) { return ((f >> 7) ^ (f >> 11)) & 1; });
+			break;
+		default:
+			laneCondition(width, flags, taken, negate, [](uint32_t f) { return (((f >> 7) ^ (f >> 11)) | (f >> 6)) & 1; });
+			break;
+	}
+}
+
+void Lockstep::setVerify(size_t lane) {
+	if (!this->verify[lane]) {
+		this->verify[lane] = 1;
+		this->verifying++;
+	}
+}
+
+void Lockstep::runScalar(size_t lane) {
+	store(lane);
+	CPU* cpu = this->lanes[lane].cpu.get();
+	CPU::State state = cpu->run(1);
+	load(lane);
+	this->scalarInstructions++;
+
+	if (state == CPU::State::Stopped) {
+		Result& result = this->lanes[lane].result;
+		const CPU::Fault* fault = cpu->getFault();
+		result.faulted = fault != nullptr;
+		if (fault != nullptr) {
+			result.fault = *fault;
+		}
+		else {
+			result.exitCode = this->registers[3][lane];
+		}
+		this->running[lane] = 0;
+	}
+}
+
+void Lockstep::store(size_t lane) {
+	// lane to CPU, the lazy flags go along
+	Registers& registers = this->lanes[lane].cpu->getRegisters();
+	for (size_t r = 0; r < std::size(generalRegisters); r++) {
+		registers.set(generalRegisters[r], this->registers[r][lane]);
+	}
+	registers.set(Registers::Reg::EIP, this->eip[lane]);
+	registers.set(Registers::Reg::EFLAGS, this->eflags[lane]);
+	if ((Registers::FlagOp)this->flagOp[lane] != Registers::FlagOp::None) {
+		registers.setLazyFlags((Registers::FlagOp)this->flagOp[lane], 4, this->flagValue1[lane], this->flagValue2[lane], this->flagResult[lane], this->flagAux[lane]);
+	}
+}
+
+void Lockstep::load(size_t lane) {
+	// CPU to lane, the lazy flags of a 32 bit operation go along, else EFLAGS is built
+	Registers& registers = this->lanes[lane].cpu->getRegisters();
+	for (size_t r = 0; r < std::size(generalRegisters); r++) {
+		this->registers[r][lane] = registers.get(generalRegisters[r]);
+	}
+	this->eip[lane] = registers.get(Registers::Reg::EIP);
+	Registers::FlagOp op;
+	if (registers.getLazyFlags(op, this->flagValue1[lane], this->flagValue2[lane], this->flagResult[lane], this->flagAux[lane], this->eflags[lane])) {
+		this->flagOp[lane] = (uint32_t)op;
+	}
+	else {
+		this->eflags[lane] = registers.get(Registers::Reg::EFLAGS);
+		this->flagOp[lane] = (uint32_t)Registers::FlagOp::None;
+	}
+}
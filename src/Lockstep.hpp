@@ -0,0 +1,192 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include "CPU.hpp"
+
+// Runs many guests of the same ELF file on different stdin inputs in
+// lockstep. The registers of all guests are kept as structure of arrays,
+// one array per register with a lane per guest, and every instruction is
+// decoded once and then executed for all lanes at its address together:
+// 32 bit moves, lea, the group 1 operations and test on registers and
+// memory, the same on al, cl, dl and bl but for stores to memory,
+// shl/shr/sar, inc/dec, mul, push/pop, call/ret and jumps run as
+// loops over the lanes the compiler vectorizes, anything else runs on the
+// CPU of each lane with its registers copied in and out.
+//
+// Lanes whose conditional jumps went different ways are masked: the lanes at
+// the lowest EIP always run next, so the others wait at the higher address
+// until the rest gets there and they continue together.
+//
+// The code has to be the same in every lane, a lane whose code differs is
+// compared with the decoded bytes before each of its instructions there.
+class Lockstep {
+public:
+	// why a lane stopped
+	struct Result {
+		// ebx of sys_exit, if the guest didn't fault
+		uint32_t exitCode = 0;
+		bool faulted = false;
+		CPU::Fault fault;
+	};
+
+	Lockstep(const std::string& path, std::vector<std::vector<uint8_t>> inputs, Memory::Placement placement);
+	Lockstep(const Lockstep&) = delete;
+	Lockstep& operator=(const Lockstep&) = delete;
+
+	// Run until every lane stopped.
+	void run();
+
+	const Result& getResult(size_t lane);
+	// instructions issued, each for one or more lanes
+	uint64_t getIssued();
+	// instructions executed summed over the lanes
+	uint64_t getLaneInstructions();
+	// the part of getLaneInstructions() that ran on the CPUs of the lanes
+	uint64_t getScalarInstructions();
+
+private:
+	enum class Kind : uint8_t {
+		// run on the CPU of each lane
+		Scalar,
+		// mov r32, imm32
+		MovImm,
+		// mov r32, r32
+		Mov,
+		// mov r32, [m32]
+		Load,
+		// mov [m32], r32
+		Store,
+		// mov r8, [m8] and mov [m8], r8 of al, cl, dl and bl
+		LoadByte,
+		StoreByte,
+		// lea r32, m
+		Lea,
+		// op r32, r32
+		Alu,
+		// op r32, imm
+		AluImm,
+		// op r32, [m32] and test [m32], r32
+		AluLoad,
+		// op [m32], r32, op [m32], imm and inc/dec [m32]
+		AluStore,
+		// op r8, imm8, op r8, r/m8, op r8, r8 and test r/m8, r8 of al, cl, dl and bl
+		AluByte,
+		// mul r/m32
+		Mul,
+		// shl/shr/sar r32, 1 or imm8
+		Shift,
+		Inc,
+		Dec,
+		Push,
+		Pop,
+		Call,
+		Ret,
+		Jmp,
+		Jcc,
+		Nop
+	};
+
+	// instruction decoded for all lanes
+	struct Op {
+		Kind kind = Kind::Scalar;
+		uint8_t length = 0;
+		// CPU::AluOp of Alu, AluImm, AluLoad and AluStore, or test, inc or dec;
+		// CPU::ShiftOp of Shift, condition of Jcc
+		uint8_t operation = 0;
+		// AluStore and AluByte with immediate instead of a register
+		bool hasImmediate = false;
+		// memory operand of Mul and AluByte, a register if not set
+		bool hasMemory = false;
+		// destination register
+		uint8_t reg = 0;
+		// source register, base of a memory operand
+		uint8_t rm = 0;
+		// index register of a memory operand, 8 for none
+		uint8_t index = 8;
+		uint8_t scale = 0;
+		bool hasBase = false;
+		// immediate, displacement or jump target
+		uint32_t value = 0;
+		// immediate of AluStore and AluByte
+		uint32_t immediate = 0;
+		std::array<uint8_t, 16> bytes = {};
+	};
+
+	struct Lane {
+		std::vector<uint8_t> input;
+		std::unique_ptr<Memory> memory;
+		std::unique_ptr<CPU> cpu;
+		Result result;
+	};
+
+	static constexpr size_t memorySize = 0x0f'ff'ff'ff;
+
+	std::vector<Lane> lanes;
+	// lanes rounded up to whole vectors, the lanes past the end never run
+	size_t width = 0;
+
+	// eax - edi, eip and eflags of every lane
+	std::array<std::vector<uint32_t>, 8> registers;
+	std::vector<uint32_t> eip;
+	std::vector<uint32_t> eflags;
+	// lazy flags as in Registers, always 32 bit and without carry in
+	std::vector<uint32_t> flagOp;
+	std::vector<uint32_t> flagValue1;
+	std::vector<uint32_t> flagValue2;
+	std::vector<uint32_t> flagResult;
+	std::vector<uint32_t> flagAux;
+
+	// lane masks are all ones or zero and 32 bit like the registers, so the
+	// loops using both vectorize without converting them
+	// set until the lane stopped
+	std::vector<uint32_t> running;
+	// lanes running the current instruction
+	std::vector<uint32_t> active;
+	// address of the current memory access
+	std::vector<uint32_t> addresses;
+	// value loaded from memory or popped by ret, EFLAGS of jcc
+	std::vector<uint32_t> values;
+	// lanes whose conditional jump is taken
+	std::vector<uint32_t> taken;
+	// 1 once the lane's code may differ from the decoded bytes
+	std::vector<uint32_t> verify;
+	// lanes with verify set
+	size_t verifying = 0;
+	// lanes of the current instruction that run it on their CPU
+	std::vector<size_t> scalarLanes;
+
+	std::unordered_map<uint32_t, Op> ops;
+
+	uint64_t issued = 0;
+	uint64_t laneInstructions = 0;
+	uint64_t scalarInstructions = 0;
+
+	// Decode the instruction at address from an active lane, once.
+	const Op& decode(uint32_t address);
+	// Run op at address for the active lanes.
+	void execute(const Op& op, uint32_t address);
+	// Run the instruction at the lane's EIP on its CPU.
+	void runScalar(size_t lane);
+	void computeAddresses(const Op& op);
+	// Move the active lanes that can't access size bytes at their address to scalarLanes.
+	void checkAccess(const uint32_t* addresses, uint32_t size);
+	// Read the 32 bits at addresses of the active lanes into values.
+	void loadValues();
+	// Write values to addresses for the active lanes.
+	void storeValues();
+	// Run the operation of op on destination with source, or the immediate
+	// if source is nullptr; on their low bytes for AluByte.
+	void alu(const Op& op, uint32_t* destination, const uint32_t* source, uint32_t immediate);
+	template<uint8_t operation, bool immediate>
+	void alu(uint32_t* destination, const uint32_t* source, uint32_t operand, bool byte);
+	void testCondition(uint8_t condition);
+	void setVerify(size_t lane);
+	// Copy the registers of the lane to its CPU.
+	void store(size_t lane);
+	// Copy the registers of the lane's CPU to the lane.
+	void load(size_t lane);
+};
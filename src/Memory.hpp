@@ -5,77 +5,673 @@
 #include <stdexcept>
 #include <iostream>
 #include <iomanip>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <csetjmp>
+#include "Metrics.hpp"
+#include "Instrumentation.hpp"
+#include "Device.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define VXM86_MMAP
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 class Memory {
 public:
+	static constexpr size_t pageSize = 0x1000;
+
+	// Called with the page index on the first write to a write-protected code page.
+	using CodeWriteListener = std::function<void(size_t page)>;
+
+	static constexpr size_t hugePageSize = 0x20'0000;
+
+	enum class HugePages : uint8_t {
+		// host pages
+		None,
+		// 2 MB pages when the kernel has them free
+		Transparent,
+		// 2 MB pages reserved in hugetlbfs, Transparent if there are none
+		Explicit
+	};
+
+	static constexpr int anyNode = -1;
+	// the NUMA node of the thread creating the memory
+	static constexpr int localNode = -2;
+
+	// How guest memory is placed on the host, only a hint:
+	// memory is still allocated when the host can't follow it.
+	struct Placement {
+		HugePages hugePages = HugePages::None;
+		int numaNode = anyNode;
+	};
+
+	// Where an access outside guest memory jumps to instead of throwing,
+	// set by the CPU while it runs so a guest fault costs no C++ exception.
+	// One per host thread, CPUs on different threads can share the memory.
+	struct FaultTrap {
+		std::jmp_buf jump;
+		size_t address = 0;
+		bool write = false;
+	};
+
 	Memory(size_t size) :
+		Memory(size, Placement()) {
+	}
+
+	Memory(size_t size, Placement placement) :
 		size(size),
-		data(new uint8_t[size]) {
+		data(allocate(size, placement)),
+		pageCount((size + pageSize - 1) / pageSize),
+		dirtyWordCount((pageCount + 63) / 64),
+		dirtyPages(new std::atomic<uint64_t>[dirtyWordCount]()),
+		codePages(new std::atomic<uint64_t>[dirtyWordCount]()),
+		sharedPages(new std::atomic<uint64_t>[dirtyWordCount]()),
+		devicePages(new std::atomic<uint64_t>[dirtyWordCount]()),
+		fastWrite(new std::atomic<uint8_t>[pageCount]()),
+		codeGenerations(new std::atomic<uint32_t>[pageCount]()) {
 	}
 
+	Memory(const Memory&) = delete;
+	Memory& operator=(const Memory&) = delete;
+
 	template<typename T>
 	void write(size_t address, T value) {
-		if (address + sizeof(T) > this->size) {
-			throw std::runtime_error("Out of bounds");
+		size_t last = address + sizeof(T) - 1;
+		if (last >= this->size) {
+			outOfBounds(address, true);
+		}
+
+		// only the first write to a clean or write-protected page and writes to devices leave the fast path
+		uint8_t first = this->fastWrite[address / pageSize].load(std::memory_order_relaxed);
+		uint8_t second = this->fastWrite[last / pageSize].load(std::memory_order_relaxed);
+		if ((first & second & ramPage) == 0) {
+			if ((first & second) != devicePage) {
+				Metrics::local().add(Metric::TlbMisses);
+				trackWrite(address, sizeof(T));
+			}
+			*((T*)(this->data + address)) = value;
+			storeDevices(address, sizeof(T));
+			return;
 		}
 
 		*((T*)(this->data + address)) = value;
+	}
+
+	void write(size_t address, const uint8_t* data, size_t size) {
+		if (!contains(address, size)) {
+			outOfBounds(address, true);
+		}
+
+		trackWrite(address, size);
+		memcpy(this->data + address, data, size);
+		storeDevices(address, size);
+	}
 
-		if (address < modifiedFrom) {
-			modifiedFrom = address;
+	// Copy size bytes inside guest memory, overlapping ranges are handled like memmove.
+	void move(size_t to, size_t from, size_t size) {
+		if (!contains(to, size) || !contains(from, size)) {
+			outOfBounds(contains(to, size) ? from : to, !contains(to, size));
 		}
-		if (address + sizeof(T) > modifiedTo) {
-			modifiedTo = address + sizeof(T);
+		if (this->instrumentation != nullptr) {
+			this->instrumentation->load((uint32_t)from, (uint32_t)size);
 		}
+
+		trackWrite(to, size);
+		memmove(this->data + to, this->data + from, size);
+		storeDevices(to, size);
 	}
 
-	void write(size_t address, const uint8_t* data, size_t size) {
-		if (address + size > this->size) {
-			throw std::runtime_error("Out of bounds");
+	// Fill count consecutive elements starting at address with value.
+	template<typename T>
+	void fill(size_t address, T value, size_t count) {
+		if (count > this->size / sizeof(T) || !contains(address, count * sizeof(T))) {
+			outOfBounds(address, true);
 		}
 
-		memcpy(this->data + address, data, size);
+		trackWrite(address, count * sizeof(T));
 
-		if (address < modifiedFrom) {
-			modifiedFrom = address;
+		if (sizeof(T) == 1) {
+			memset(this->data + address, (uint8_t)value, count);
 		}
-		if (address + size > modifiedTo) {
-			modifiedTo = address + size;
+		else {
+			T* to = (T*)(this->data + address);
+			for (size_t i = 0; i < count; i++) {
+				to[i] = value;
+			}
 		}
+		storeDevices(address, count * sizeof(T));
+	}
+
+	// Atomically replace the T at address with f(T), for LOCK prefixed
+	// instructions and xchg, returning the old value. f is called again
+	// with the new value if another thread wrote it in between.
+	template<typename T, typename F>
+	T update(size_t address, F f) {
+		size_t last = address + sizeof(T) - 1;
+		if (last >= this->size) {
+			outOfBounds(address, true);
+		}
+		if (this->instrumentation != nullptr) {
+			this->instrumentation->load((uint32_t)address, sizeof(T));
+		}
+		if ((this->fastWrite[address / pageSize].load(std::memory_order_relaxed) &
+			this->fastWrite[last / pageSize].load(std::memory_order_relaxed)) == 0) {
+			Metrics::local().add(Metric::TlbMisses);
+			trackWrite(address, sizeof(T));
+		}
+
+		T* value = (T*)(this->data + address);
+		T previous;
+		if (address % sizeof(T) != 0) {
+			// a split lock, atomic only against other misaligned updates
+			std::lock_guard lock(splitLock);
+			previous = *value;
+			*value = f(previous);
+		}
+		else {
+			std::atomic_ref<T> word(*value);
+			previous = word.load(std::memory_order_relaxed);
+			while (!word.compare_exchange_weak(previous, f(previous), std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			}
+		}
+		storeDevices(address, sizeof(T));
+		return previous;
 	}
 
 	template<typename T>
 	T read(size_t address) {
 		if (address + sizeof(T) > this->size) {
-			throw std::runtime_error("Out of bounds");
+			outOfBounds(address, false);
+		}
+		if (this->instrumentation != nullptr) {
+			this->instrumentation->load((uint32_t)address, sizeof(T));
 		}
 
 		return *((T*)(this->data + address));
 	}
 
 	void read(size_t address, uint8_t* data, size_t size) {
-		if (address + size > this->size) {
-			throw std::runtime_error("Out of bounds");
+		if (!contains(address, size)) {
+			outOfBounds(address, false);
+		}
+		if (this->instrumentation != nullptr) {
+			this->instrumentation->load((uint32_t)address, (uint32_t)size);
 		}
 
 		memcpy(data, this->data + address, size);
 	}
 
+	// Read of guest code, not seen by instrumentation.
+	template<typename T>
+	T fetch(size_t address) {
+		if (address + sizeof(T) > this->size) {
+			outOfBounds(address, false);
+		}
+
+		return *((T*)(this->data + address));
+	}
+
+	// Read-only host pointer to size bytes of guest memory starting at address.
+	const uint8_t* view(size_t address, size_t size) {
+		if (!contains(address, size)) {
+			outOfBounds(address, false);
+		}
+
+		return this->data + address;
+	}
+
+	// Writable host pointer to size bytes of guest memory starting at address,
+	// for the host to fill directly. The range is tracked as written, devices
+	// don't see what the host writes there.
+	uint8_t* writable(size_t address, size_t size) {
+		if (!contains(address, size)) {
+			outOfBounds(address, true);
+		}
+
+		trackWrite(address, size);
+		return this->data + address;
+	}
+
+	size_t getSize() {
+		return this->size;
+	}
+
+	bool contains(size_t address, size_t size) {
+		return address <= this->size && size <= this->size - address;
+	}
+
+	// Arms a trap for the calling thread until the scope is left, by an
+	// exception too, then puts the previous one back. Without one an access
+	// outside guest memory throws std::runtime_error.
+	class FaultTrapScope {
+	public:
+		FaultTrapScope(FaultTrap* faultTrap) :
+			previous(Memory::faultTrap) {
+			Memory::faultTrap = faultTrap;
+		}
+
+		FaultTrapScope(const FaultTrapScope&) = delete;
+		FaultTrapScope& operator=(const FaultTrapScope&) = delete;
+
+		~FaultTrapScope() {
+			Memory::faultTrap = previous;
+		}
+
+	private:
+		FaultTrap* previous;
+	};
+
+	// Tool seeing every load and store, nullptr for none. While one is
+	// attached every store takes the slow path of write(), which reports it.
+	void setInstrumentation(Instrumentation* instrumentation) {
+		this->instrumentation = instrumentation;
+		if (instrumentation != nullptr) {
+			for (size_t page = 0; page < this->pageCount; page++) {
+				this->fastWrite[page].store(slowPage, std::memory_order_relaxed);
+			}
+		}
+	}
+
 	void clear() {
-		memset(this->data, 0, this->size);
+		clear(0, this->size);
 	}
 
 	void clear(size_t from, size_t _size) {
+		if (!contains(from, _size)) {
+			outOfBounds(from, true);
+		}
+
+		trackWrite(from, _size);
 		memset(this->data + from, 0, _size);
+		storeDevices(from, _size);
 	}
 
 	void print(size_t rowSize = 16, uint32_t eip = -1) {
+		// print each run of consecutive dirty pages
+		size_t runFrom = 0;
+		size_t runTo = 0;
+		forEachDirtyPage([&](size_t page) {
+			size_t from = page * pageSize;
+			if (from != runTo) {
+				if (runTo > runFrom) {
+					printRange(runFrom, runTo, rowSize, eip);
+				}
+				runFrom = from;
+			}
+			runTo = std::min(from + pageSize, this->size);
+		});
+
+		if (runTo > runFrom) {
+			printRange(runFrom, runTo, rowSize, eip);
+		}
+	}
+
+	bool isPageDirty(size_t page) {
+		return (this->dirtyPages[page / 64].load(std::memory_order_relaxed) & (1ull << (page % 64))) > 0;
+	}
+
+	// Call f(page) for every dirty page in ascending order.
+	template<typename F>
+	void forEachDirtyPage(F f) {
+		for (size_t i = 0; i < this->dirtyWordCount; i++) {
+			uint64_t word = this->dirtyPages[i].load(std::memory_order_relaxed);
+			while (word != 0) {
+				f(i * 64 + std::countr_zero(word));
+				word &= word - 1;
+			}
+		}
+	}
+
+	// Mark all pages clean and return the ones that were dirty, in ascending order.
+	std::vector<size_t> takeDirtyPages() {
+		std::vector<size_t> pages;
+		for (size_t i = 0; i < this->dirtyWordCount; i++) {
+			if (this->dirtyPages[i].load(std::memory_order_relaxed) == 0) {
+				continue;
+			}
+
+			uint64_t word = this->dirtyPages[i].exchange(0, std::memory_order_relaxed);
+			while (word != 0) {
+				size_t page = i * 64 + std::countr_zero(word);
+				// the next write has to mark the page dirty again
+				this->fastWrite[page].store(slowPage, std::memory_order_relaxed);
+				pages.push_back(page);
+				word &= word - 1;
+			}
+		}
+		return pages;
+	}
+
+	// Put back the content of a page without marking it dirty, nullptr for
+	// zeros. Code decoded from it is dropped like after a write.
+	void restorePage(size_t page, const uint8_t* data) {
+		size_t from = page * pageSize;
+		size_t size = std::min(pageSize, this->size - from);
+		if ((this->codePages[page / 64].fetch_and(~(1ull << (page % 64)), std::memory_order_relaxed) & (1ull << (page % 64))) > 0) {
+			notifyCodeWrite(page);
+		}
+
+		if (data != nullptr) {
+			memcpy(this->data + from, data, size);
+		}
+		else {
+			memset(this->data + from, 0, size);
+		}
+	}
+
+	// Write-protect a page holding decoded code. The first write to it
+	// advances the generation of the page, calls the code write listeners and
+	// removes the protection again.
+	void protectCode(size_t page) {
+		this->codePages[page / 64].fetch_or(1ull << (page % 64), std::memory_order_seq_cst);
+		this->fastWrite[page].store(slowPage, std::memory_order_seq_cst);
+	}
+
+	// Count of writes to the page while it was write-protected. A decode cache
+	// on any thread compares it with the count its code was decoded at.
+	uint32_t getCodeGeneration(size_t page) {
+		return this->codeGenerations[page].load(std::memory_order_acquire);
+	}
+
+	// Sum of all generations, cheap enough to poll before every instruction.
+	uint64_t getCodeWrites() {
+		return this->codeWrites.load(std::memory_order_acquire);
+	}
+
+	// Map page read-only to pageSize bytes of fd at offset, shared with every
+	// other Memory mapping the same file. The first write gives the page a
+	// private copy. Returns false if the host can't map it, the page has to
+	// be written instead.
+	bool share(size_t page, int fd, size_t offset) {
+#ifdef VXM86_MMAP
+		// a hugetlb page can't be replaced by a single smaller one
+		if (this->mappedSize == 0 || this->hugetlb || (size_t)sysconf(_SC_PAGESIZE) != pageSize || (page + 1) * pageSize > this->size) {
+			return false;
+		}
+
+		void* address = mmap(this->data + page * pageSize, pageSize, PROT_READ, MAP_SHARED | MAP_FIXED, fd, offset);
+		if (address == MAP_FAILED) {
+			return false;
+		}
+
+		// like a write, a shared page differs from zeroed memory
+		uint64_t bit = 1ull << (page % 64);
+		this->dirtyPages[page / 64].fetch_or(bit, std::memory_order_relaxed);
+		this->sharedPages[page / 64].fetch_or(bit, std::memory_order_relaxed);
+		this->fastWrite[page].store(slowPage, std::memory_order_relaxed);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Route stores of the guest to size bytes from address to device, both
+	// page aligned. Devices are attached before the guest runs and stay
+	// attached while it does.
+	void attach(Device* device, size_t address, size_t size) {
+		if (address % pageSize != 0 || size % pageSize != 0 || size == 0 || !contains(address, size)) {
+			throw std::runtime_error("Device range not page aligned or outside memory");
+		}
+		for (const AttachedDevice& attached : this->devices) {
+			if (address < attached.address + attached.size && attached.address < address + size) {
+				throw std::runtime_error("Device range already claimed");
+			}
+		}
+
+		this->devices.push_back({ device, address, size });
+		for (size_t page = address / pageSize; page < (address + size) / pageSize; page++) {
+			this->devicePages[page / 64].fetch_or(1ull << (page % 64), std::memory_order_relaxed);
+			this->fastWrite[page].store(slowPage, std::memory_order_relaxed);
+		}
+	}
+
+	// Let every device finish what it buffered.
+	void flushDevices() {
+		for (const AttachedDevice& attached : this->devices) {
+			attached.device->flush();
+		}
+	}
+
+	void addCodeWriteListener(void* owner, CodeWriteListener listener) {
+		std::lock_guard lock(this->listenerMutex);
+		this->codeWriteListeners.push_back({ owner, listener });
+	}
+
+	void removeCodeWriteListener(void* owner) {
+		std::lock_guard lock(this->listenerMutex);
+		std::erase_if(this->codeWriteListeners, [owner](auto& listener) { return listener.first == owner; });
+	}
+
+	~Memory() {
+#ifdef VXM86_MMAP
+		if (this->mappedSize != 0) {
+			munmap(this->data, this->mappedSize);
+			return;
+		}
+#endif
+		delete[] data;
+	}
+private:
+	[[noreturn]] void outOfBounds(size_t address, bool write) {
+		if (faultTrap != nullptr) {
+			faultTrap->address = address;
+			faultTrap->write = write;
+			std::longjmp(faultTrap->jump, 1);
+		}
+		throw std::runtime_error("Out of bounds");
+	}
+
+	uint8_t* allocate(size_t size, Placement placement) {
+#ifdef VXM86_MMAP
+		uint8_t* address = nullptr;
+#ifdef MAP_HUGETLB
+		if (placement.hugePages == HugePages::Explicit) {
+			size_t rounded = (size + hugePageSize - 1) & ~(hugePageSize - 1);
+			// reserved up front, without it an empty pool is only noticed by SIGBUS on a write
+			void* huge = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (huge != MAP_FAILED) {
+				address = (uint8_t*)huge;
+				this->mappedSize = rounded;
+				this->hugetlb = true;
+			}
+		}
+#endif
+		if (address == nullptr && placement.hugePages != HugePages::None) {
+			address = mapAligned(size, hugePageSize);
+#ifdef MADV_HUGEPAGE
+			if (address != nullptr) {
+				madvise(address, this->mappedSize, MADV_HUGEPAGE);
+			}
+#endif
+		}
+		if (address == nullptr) {
+			// mapped memory lets single pages be replaced by shared ones
+			void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (mapped != MAP_FAILED) {
+				address = (uint8_t*)mapped;
+				this->mappedSize = size;
+			}
+		}
+		if (address != nullptr) {
+			// no page is touched yet, all of them are allocated on the node
+			bind(address, this->mappedSize, placement.numaNode);
+			return address;
+		}
+#endif
+		return new uint8_t[size]();
+	}
+
+#ifdef VXM86_MMAP
+	// Mapping of size rounded up to alignment, starting on an aligned address
+	// so the kernel can back it with huge pages from the first byte.
+	uint8_t* mapAligned(size_t size, size_t alignment) {
+		size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+		void* mapped = mmap(nullptr, rounded + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mapped == MAP_FAILED) {
+			return nullptr;
+		}
+
+		uintptr_t start = (uintptr_t)mapped;
+		uintptr_t aligned = (start + alignment - 1) & ~(uintptr_t)(alignment - 1);
+		if (aligned > start) {
+			munmap(mapped, aligned - start);
+		}
+		if (aligned + rounded < start + rounded + alignment) {
+			munmap((void*)(aligned + rounded), start + alignment - aligned);
+		}
+		this->mappedSize = rounded;
+		return (uint8_t*)aligned;
+	}
+#endif
+
+	// Prefer allocating the pages of the range on a NUMA node. Preferred rather
+	// than bound, so a full node spills to the others instead of failing.
+	static void bind(void* address, size_t size, int node) {
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+		if (node == localNode) {
+			unsigned cpu = 0;
+			unsigned local = 0;
+			if (syscall(SYS_getcpu, &cpu, &local, nullptr) != 0) {
+				return;
+			}
+			node = (int)local;
+		}
+		if (node < 0) {
+			return;
+		}
+
+		// MPOL_PREFERRED from <numaif.h>, which needs libnuma
+		constexpr int preferred = 1;
+		constexpr size_t bits = sizeof(unsigned long) * 8;
+		std::vector<unsigned long> nodes(node / bits + 1);
+		nodes[node / bits] = 1ul << (node % bits);
+		// a node that doesn't exist leaves the default policy
+		syscall(SYS_mbind, address, size, preferred, nodes.data(), nodes.size() * bits + 1, 0);
+#endif
+	}
+
+	// Replace a shared read-only page with a private writable copy. On Linux
+	// the copy is made aside and moved over the page in one step, so other
+	// threads reading it never see it missing or half copied.
+	void unshare(size_t page) {
+#if defined(VXM86_MMAP) && defined(__linux__)
+		uint8_t* address = this->data + page * pageSize;
+		void* copy = mmap(nullptr, pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (copy == MAP_FAILED) {
+			throw std::runtime_error("Failed to copy shared page");
+		}
+		memcpy(copy, address, pageSize);
+		if (mremap(copy, pageSize, pageSize, MREMAP_MAYMOVE | MREMAP_FIXED, address) == MAP_FAILED) {
+			munmap(copy, pageSize);
+			throw std::runtime_error("Failed to copy shared page");
+		}
+#elif defined(VXM86_MMAP)
+		uint8_t copy[pageSize];
+		uint8_t* address = this->data + page * pageSize;
+		memcpy(copy, address, pageSize);
+		if (mmap(address, pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+			throw std::runtime_error("Failed to copy shared page");
+		}
+		memcpy(address, copy, pageSize);
+#endif
+	}
+
+	void trackWrite(size_t address, size_t size) {
+		if (size == 0) {
+			return;
+		}
+		if (this->instrumentation != nullptr) {
+			this->instrumentation->store((uint32_t)address, (uint32_t)size);
+		}
+
+		size_t last = (address + size - 1) / pageSize;
+		for (size_t page = address / pageSize; page <= last; page++) {
+			if (this->fastWrite[page].load(std::memory_order_relaxed) != slowPage) {
+				continue;
+			}
+
+			std::atomic<uint64_t>& dirtyWord = this->dirtyPages[page / 64];
+			uint64_t bit = 1ull << (page % 64);
+			if ((dirtyWord.load(std::memory_order_relaxed) & bit) == 0) {
+				dirtyWord.fetch_or(bit, std::memory_order_relaxed);
+			}
+
+			// the first thread to write a shared page copies it, the others
+			// wait for the copy before they write to it too
+			if ((this->sharedPages[page / 64].load(std::memory_order_acquire) & bit) > 0) {
+				std::lock_guard lock(this->unshareMutex);
+				if ((this->sharedPages[page / 64].load(std::memory_order_relaxed) & bit) > 0) {
+					unshare(page);
+					this->sharedPages[page / 64].fetch_and(~bit, std::memory_order_release);
+					Metrics::local().add(Metric::PageFaults);
+				}
+			}
+
+			if ((this->codePages[page / 64].fetch_and(~bit, std::memory_order_relaxed) & bit) > 0) {
+				Metrics::local().add(Metric::PageFaults);
+				notifyCodeWrite(page);
+			}
+
+			// instrumented stores stay on the slow path, stores to devices skip
+			// the bookkeeping but still go to the device
+			bool device = (this->devicePages[page / 64].load(std::memory_order_relaxed) & bit) > 0;
+			uint8_t state = (this->instrumentation != nullptr) ? slowPage : device ? devicePage : ramPage;
+			this->fastWrite[page].store(state, std::memory_order_relaxed);
+		}
+	}
+
+	// Tell the devices in the range about a store to it.
+	void storeDevices(size_t address, size_t size) {
+		for (const AttachedDevice& attached : this->devices) {
+			if (address < attached.address + attached.size && attached.address < address + size) {
+				size_t from = std::max(address, attached.address);
+				size_t to = std::min(address + size, attached.address + attached.size);
+				attached.device->store((uint32_t)(from - attached.address), (uint32_t)(to - from));
+			}
+		}
+	}
+
+	void notifyCodeWrite(size_t page) {
+		// the generation first, a cache seeing the new sum sees it too
+		this->codeGenerations[page].fetch_add(1, std::memory_order_release);
+		this->codeWrites.fetch_add(1, std::memory_order_release);
+
+		// CPUs of other threads may add or remove their listeners meanwhile
+		std::lock_guard lock(this->listenerMutex);
+		for (auto& listener : this->codeWriteListeners) {
+			listener.second(page);
+		}
+	}
+
+	// states of fastWrite
+	static constexpr uint8_t slowPage = 0;
+	static constexpr uint8_t ramPage = 1;
+	static constexpr uint8_t devicePage = 2;
+
+	struct AttachedDevice {
+		Device* device;
+		size_t address;
+		size_t size;
+	};
+
+	void printRange(size_t from, size_t to, size_t rowSize, uint32_t eip) {
 		std::cout << std::fixed << std::hex << std::setfill('0');
-		size_t modifiedToCeil = this->modifiedTo + rowSize - (this->modifiedTo % rowSize);
+		size_t toCeil = std::min(to + rowSize - 1 - (to + rowSize - 1) % rowSize, this->size);
 		int emptyLine = 0;
 
 		std::string ascii = "";
-		for (size_t i = (modifiedFrom / rowSize) * rowSize; i < modifiedToCeil; i += rowSize) {
+		for (size_t i = (from / rowSize) * rowSize; i < toCeil; i += rowSize) {
 			if (emptyLine == 0) {
 				std::cout << std::setw(8) << i << ": ";
 				std::cout << std::setw(2);
@@ -88,7 +684,7 @@ public:
 				ascii = "";
 			}
 
-			for (size_t j = 0; j < rowSize && i + j < modifiedToCeil; j++) {
+			for (size_t j = 0; j < rowSize && i + j < toCeil; j++) {
 				if (i + j == eip && emptyLine == 0) {
 					std::cout << "\033[1;31m";
 					ascii += "\033[1;31m";
@@ -132,20 +728,36 @@ public:
 		}
 	}
 
-	void setModifiedRangeFrom(size_t modifiedFrom) {
-		this->modifiedFrom = modifiedFrom;
-	}
-
-	void setModifiedRangeTo(size_t modifiedTo) {
-		this->modifiedTo = modifiedTo;
-	}
-
-	~Memory() {
-		delete[] data;
-	}
-private:
 	size_t size;
+	// length of the mmap region, 0 if allocated with new
+	size_t mappedSize = 0;
+	// backed by hugetlb pages
+	bool hugetlb = false;
+	static inline thread_local FaultTrap* faultTrap = nullptr;
+	static inline std::mutex splitLock;
+	Instrumentation* instrumentation = nullptr;
 	uint8_t* data;
-	size_t modifiedFrom = 0xff'ff'ff'ff;
-	size_t modifiedTo = 0;
+	size_t pageCount;
+	// one bit per page, set by every write
+	size_t dirtyWordCount;
+	std::unique_ptr<std::atomic<uint64_t>[]> dirtyPages;
+	// one bit per write-protected page holding decoded code
+	std::unique_ptr<std::atomic<uint64_t>[]> codePages;
+	// one bit per page mapped read-only from a shared image
+	std::unique_ptr<std::atomic<uint64_t>[]> sharedPages;
+	// one bit per page claimed by a device
+	std::unique_ptr<std::atomic<uint64_t>[]> devicePages;
+	// software TLB for stores: ramPage if the page is dirty, not
+	// write-protected and no device's, so a store needs no bookkeeping;
+	// devicePage if it needs none but goes to a device
+	std::unique_ptr<std::atomic<uint8_t>[]> fastWrite;
+	// per page, advanced by every write to it while it was write-protected
+	std::unique_ptr<std::atomic<uint32_t>[]> codeGenerations;
+	std::atomic<uint64_t> codeWrites = 0;
+	// in the order they were attached, only ever a few
+	std::vector<AttachedDevice> devices;
+	std::vector<std::pair<void*, CodeWriteListener>> codeWriteListeners;
+	std::mutex listenerMutex;
+	// held while a shared page is copied
+	std::mutex unshareMutex;
 };
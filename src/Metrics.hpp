@@ -0,0 +1,214 @@
+#pragma once
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+
+enum class Metric : uint8_t {
+	// guest instructions executed, fused ones included
+	Instructions,
+	// second instructions of fused pairs
+	Fused,
+	// decode cache misses, the instruction went through the decoder
+	Decoded,
+	// misses served from a saved decode cache instead of the decoder
+	DecodeCacheFileHits,
+	// stores leaving the fast path, the page was clean or write-protected
+	TlbMisses,
+	// writes to shared image pages or pages holding decoded code
+	PageFaults,
+	// bytes passed to the guest by sys_read
+	IoBytesRead,
+	// bytes written by the guest with sys_write
+	IoBytesWritten,
+	Count
+};
+
+// Counters of one thread. Only the owning thread writes them, with a plain
+// load and store instead of a locked add, other threads only read them when
+// the totals are collected.
+class ThreadMetrics {
+public:
+	static constexpr size_t metricCount = (size_t)Metric::Count;
+	// syscall numbers past the last one share its counter
+	static constexpr size_t syscallCount = 512;
+
+	void add(Metric metric, uint64_t count = 1) {
+		increment(this->counters[(size_t)metric], count);
+	}
+
+	void addSyscall(uint32_t number) {
+		increment(this->syscalls[std::min<size_t>(number, syscallCount - 1)], 1);
+	}
+
+	uint64_t get(Metric metric) const {
+		return this->counters[(size_t)metric].load(std::memory_order_relaxed);
+	}
+
+	uint64_t getSyscalls(size_t number) const {
+		return this->syscalls[number].load(std::memory_order_relaxed);
+	}
+
+private:
+	std::array<std::atomic<uint64_t>, metricCount> counters = {};
+	std::array<std::atomic<uint64_t>, syscallCount> syscalls = {};
+
+	static void increment(std::atomic<uint64_t>& counter, uint64_t count) {
+		counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+	}
+};
+
+// Registry of the counters of every thread running guests.
+// The totals are summed only when a snapshot is taken; the counts of a
+// finished thread are kept in the totals.
+class Metrics {
+public:
+	struct Snapshot {
+		std::array<uint64_t, ThreadMetrics::metricCount> counters = {};
+		std::array<uint64_t, ThreadMetrics::syscallCount> syscalls = {};
+		size_t threads = 0;
+
+		uint64_t get(Metric metric) const {
+			return this->counters[(size_t)metric];
+		}
+
+		// lookups answered by the decode cache, fused instructions included
+		double decodeCacheHitRatio() const {
+			uint64_t lookups = get(Metric::Instructions) - get(Metric::Fused);
+			return (lookups == 0) ? 0.0 : 1.0 - (double)get(Metric::Decoded) / lookups;
+		}
+	};
+
+	// Counters of the calling thread.
+	static ThreadMetrics& local() {
+		thread_local Registration registration;
+		return *registration.metrics;
+	}
+
+	static Snapshot snapshot() {
+		Registry& registry = getRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+
+		Snapshot snapshot = registry.finished;
+		for (const std::unique_ptr<ThreadMetrics>& metrics : registry.threads) {
+			addTo(snapshot, *metrics);
+		}
+		snapshot.threads = registry.threads.size();
+		return snapshot;
+	}
+
+	// Prometheus text exposition format.
+	static std::string prometheus(const Snapshot& snapshot) {
+		std::ostringstream out;
+		for (size_t i = 0; i < ThreadMetrics::metricCount; i++) {
+			out << "# HELP vxm86_" << descriptions[i].name << " " << descriptions[i].help << "\n";
+			out << "# TYPE vxm86_" << descriptions[i].name << " counter\n";
+			out << "vxm86_" << descriptions[i].name << " " << snapshot.counters[i] << "\n";
+		}
+
+		out << "# HELP vxm86_syscalls_total Guest syscalls by number.\n";
+		out << "# TYPE vxm86_syscalls_total counter\n";
+		for (size_t i = 0; i < ThreadMetrics::syscallCount; i++) {
+			if (snapshot.syscalls[i] != 0) {
+				out << "vxm86_syscalls_total{number=\"" << i << "\"} " << snapshot.syscalls[i] << "\n";
+			}
+		}
+
+		out << "# HELP vxm86_decode_cache_hit_ratio Share of instruction lookups answered by the decode cache.\n";
+		out << "# TYPE vxm86_decode_cache_hit_ratio gauge\n";
+		out << "vxm86_decode_cache_hit_ratio " << snapshot.decodeCacheHitRatio() << "\n";
+		out << "# HELP vxm86_threads Threads that ran guests and are still alive.\n";
+		out << "# TYPE vxm86_threads gauge\n";
+		out << "vxm86_threads " << snapshot.threads << "\n";
+		return out.str();
+	}
+
+	static std::string json(const Snapshot& snapshot) {
+		std::ostringstream out;
+		out << "{";
+		for (size_t i = 0; i < ThreadMetrics::metricCount; i++) {
+			out << "\"" << descriptions[i].name << "\":" << snapshot.counters[i] << ",";
+		}
+
+		out << "\"syscalls_total\":{";
+		bool first = true;
+		for (size_t i = 0; i < ThreadMetrics::syscallCount; i++) {
+			if (snapshot.syscalls[i] != 0) {
+				out << (first ? "" : ",") << "\"" << i << "\":" << snapshot.syscalls[i];
+				first = false;
+			}
+		}
+		out << "},";
+
+		out << "\"decode_cache_hit_ratio\":" << snapshot.decodeCacheHitRatio() << ",";
+		out << "\"threads\":" << snapshot.threads << "}\n";
+		return out.str();
+	}
+
+private:
+	struct Description {
+		const char* name;
+		const char* help;
+	};
+
+	static constexpr std::array<Description, ThreadMetrics::metricCount> descriptions = { {
+		{ "instructions_total", "Guest instructions executed." },
+		{ "fused_instructions_total", "Guest instructions executed as the second half of a fused pair." },
+		{ "decoded_instructions_total", "Instructions decoded on a decode cache miss." },
+		{ "decode_cache_file_hits_total", "Decode cache misses served from a saved decode cache." },
+		{ "tlb_misses_total", "Guest stores that missed the fast write path." },
+		{ "page_faults_total", "Writes to shared image pages or pages holding decoded code." },
+		{ "io_read_bytes_total", "Bytes passed to guests by sys_read." },
+		{ "io_written_bytes_total", "Bytes written by guests with sys_write." }
+	} };
+
+	struct Registry {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ThreadMetrics>> threads;
+		// counts of threads that exited
+		Snapshot finished;
+	};
+
+	// Adds the counters of a thread on its first use and moves them to the
+	// finished totals when it exits.
+	struct Registration {
+		ThreadMetrics* metrics;
+
+		Registration() {
+			Registry& registry = getRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.threads.push_back(std::make_unique<ThreadMetrics>());
+			metrics = registry.threads.back().get();
+		}
+
+		~Registration() {
+			Registry& registry = getRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			addTo(registry.finished, *metrics);
+			std::erase_if(registry.threads, [this](const std::unique_ptr<ThreadMetrics>& thread) {
+				return thread.get() == metrics;
+			});
+		}
+	};
+
+	static Registry& getRegistry() {
+		// never destroyed, threads may still exit after static destructors ran
+		static Registry* registry = new Registry();
+		return *registry;
+	}
+
+	static void addTo(Snapshot& snapshot, const ThreadMetrics& metrics) {
+		for (size_t i = 0; i < ThreadMetrics::metricCount; i++) {
+			snapshot.counters[i] += metrics.get((Metric)i);
+		}
+		for (size_t i = 0; i < ThreadMetrics::syscallCount; i++) {
+			snapshot.syscalls[i] += metrics.getSyscalls(i);
+		}
+	}
+};
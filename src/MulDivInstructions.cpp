@@ -0,0 +1,154 @@
+#include "CPU.hpp"
+#include <type_traits>
+
+// test/not/neg/mul/imul/div/idiv r/m (group 3).
+// The accumulator pair is AH:AL, DX:AX or EDX:EAX depending on the operand
+// size, products and dividends are handled as one 64 bit value.
+
+template<CPU::Group3Op op, typename T>
+bool CPU::group3(uint8_t modrm) {
+	using Signed = std::make_signed_t<T>;
+	constexpr bool w = sizeof(T) > 1;
+	constexpr bool bit16 = sizeof(T) == 2;
+	constexpr uint32_t bits = sizeof(T) * 8;
+
+	// the imm of test follows the displacement
+	RmOperand operand = decodeRm(modrm);
+	T value = readRm<T>(operand);
+
+	if constexpr (op == Group3Op::Test || op == Group3Op::Test1) {
+		// [1111 011 w] [mod 000 r/m] [imm]
+		T imm = readImmediate(w, bit16);
+		this->registers.setLazyFlags(Registers::FlagOp::Logic, sizeof(T), value, imm, (T)(value & imm));
+		return true;
+	}
+	else if constexpr (op == Group3Op::Not) {
+		// flags are not affected
+		writeRm<T>(operand, (T)~value);
+		return true;
+	}
+	else if constexpr (op == Group3Op::Neg) {
+		// flags of 0 - value
+		T result = (T)(0 - value);
+		this->registers.setLazyFlags(Registers::FlagOp::Sub, sizeof(T), 0, value, result);
+		writeRm<T>(operand, result);
+		return true;
+	}
+	else {
+		// AX, DX:AX or EDX:EAX
+		auto setWide = [&](uint32_t low, uint32_t high) {
+			if constexpr (bits == 8) {
+				this->registers.set(Registers::Reg::AL, low);
+				this->registers.set(Registers::Reg::AH, high);
+			}
+			else {
+				this->registers.set(Registers::Reg::EAX, true, bit16, low);
+				this->registers.set(Registers::Reg::EDX, true, bit16, high);
+			}
+		};
+
+		if constexpr (op == Group3Op::Mul || op == Group3Op::Imul) {
+			// accumulator * r/m, CF and OF set if the upper half is significant
+			T accumulator = this->registers.get(Registers::Reg::EAX, w, bit16);
+
+			uint64_t product;
+			bool overflow;
+			if constexpr (op == Group3Op::Mul) {
+				product = (uint64_t)accumulator * value;
+				overflow = (product >> bits) != 0;
+			}
+			else {
+				int64_t signedProduct = (int64_t)(Signed)accumulator * (Signed)value;
+				product = (uint64_t)signedProduct;
+				overflow = signedProduct != (Signed)signedProduct;
+			}
+
+			setWide((T)product, (T)(product >> bits));
+
+			constexpr uint32_t flags = (uint32_t)Registers::Flag::CF | (uint32_t)Registers::Flag::OF;
+			this->registers.setLazyFlags(Registers::FlagOp::Result, sizeof(T), accumulator, value, (T)product, overflow ? flags : 0);
+			return true;
+		}
+		else {
+			// accumulator / r/m, flags are undefined and left unchanged
+			if (value == 0) {
+				return raise(Exception::DivideError);
+			}
+
+			uint64_t dividend;
+			if constexpr (bits == 8) {
+				dividend = this->registers.get(Registers::Reg::AX);
+			}
+			else {
+				dividend = ((uint64_t)this->registers.get(Registers::Reg::EDX, true, bit16) << bits) |
+					this->registers.get(Registers::Reg::EAX, true, bit16);
+			}
+
+			if constexpr (op == Group3Op::Div) {
+				uint64_t quotient = dividend / value;
+				if (quotient > std::numeric_limits<T>::max()) {
+					return raise(Exception::DivideError);
+				}
+
+				setWide((T)quotient, (T)(dividend % value));
+			}
+			else {
+				// sign extend the 2 * bits wide dividend
+				int64_t signedDividend = (int64_t)(dividend << (64 - 2 * bits)) >> (64 - 2 * bits);
+				int64_t divisor = (Signed)value;
+				if (divisor == -1 && signedDividend == std::numeric_limits<int64_t>::min()) {
+					return raise(Exception::DivideError);
+				}
+
+				int64_t quotient = signedDividend / divisor;
+				if (quotient != (Signed)quotient) {
+					return raise(Exception::DivideError);
+				}
+
+				setWide((T)quotient, (T)(signedDividend % divisor));
+			}
+			return true;
+		}
+	}
+}
+
+template<typename T>
+std::array<CPU::Group3Handler, 8> CPU::group3Handlers() {
+	return {
+		&CPU::group3<Group3Op::Test, T>,
+		&CPU::group3<Group3Op::Test1, T>,
+		&CPU::group3<Group3Op::Not, T>,
+		&CPU::group3<Group3Op::Neg, T>,
+		&CPU::group3<Group3Op::Mul, T>,
+		&CPU::group3<Group3Op::Imul, T>,
+		&CPU::group3<Group3Op::Div, T>,
+		&CPU::group3<Group3Op::Idiv, T>
+	};
+}
+
+void CPU::initMulDivInstructions() {
+	// [size prefix][w][op]
+	static const std::array<Group3Handler, 8> group3Table[2][2] = {
+		{ group3Handlers<uint8_t>(), group3Handlers<uint32_t>() },
+		{ group3Handlers<uint8_t>(), group3Handlers<uint16_t>() }
+	};
+
+	// hlt shares the slot
+	auto hlt = instructions[0xF4 >> 2];
+	instructions[0xF4 >> 2] = [&, hlt](uint8_t opcode, bool sizePrefix) -> bool {
+		if (opcode == 0xF4) {
+			return hlt(opcode, sizePrefix);
+		}
+		else if (opcode == 0xF5) {
+			return raise(Exception::InvalidOpcode);
+		}
+
+		// op r/m
+		// [1111 011 w] [mod op r/m]
+		bool w = (opcode & 0b0000'0001) > 0;
+		uint8_t modrm = readImmediate(false, false);
+		uint8_t op = (modrm & 0b0011'1000) >> 3;
+
+		return (this->*group3Table[sizePrefix][w][op])(modrm);
+	};
+}
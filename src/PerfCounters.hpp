@@ -0,0 +1,347 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Guest instructions counted by the CPU, split by the way they were run.
+struct ExecutionCounts {
+	// every executed instruction, fused ones included
+	uint64_t instructions = 0;
+	// decode cache misses, the instruction went through the decoder first
+	uint64_t decoded = 0;
+	// second instructions of fused pairs
+	uint64_t fused = 0;
+};
+
+// Host hardware counters read with perf_event_open while the guest runs.
+// All events are opened as one group so their values cover the same time.
+// Events the host doesn't have are left out; without perf events at all,
+// as in most containers, only the guest counts are reported.
+//
+// With block sampling every n-th basic block is measured on its own and the
+// hottest blocks are listed in the report. Reading the counters is a system
+// call, its own cost is measured once and subtracted from every sample.
+class PerfCounters {
+public:
+	enum class Event : uint8_t {
+		Cycles,
+		Instructions,
+		Branches,
+		BranchMisses,
+		L1dMisses,
+		LlcMisses,
+		TaskClock,
+		Count
+	};
+
+	// part of the emulator the counters are attributed to
+	enum class Engine : uint8_t {
+		// instruction handlers, fused pairs and the dispatch loop
+		Interpreter,
+		// decoding on a decode cache miss
+		Decoder,
+		Count
+	};
+
+	static constexpr size_t eventCount = (size_t)Event::Count;
+	static constexpr size_t engineCount = (size_t)Engine::Count;
+
+	using Counts = std::array<uint64_t, eventCount>;
+
+	// blockPeriod 0 measures only the whole run
+	PerfCounters(uint32_t blockPeriod = 0) :
+		blockPeriod(blockPeriod) {
+		open();
+		if (this->leader >= 0) {
+			calibrate();
+		}
+	}
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	~PerfCounters() {
+#ifdef __linux__
+		for (int fd : this->fds) {
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+#endif
+	}
+
+	bool isAvailable() {
+		return this->leader >= 0;
+	}
+
+	bool isSampling() {
+		return this->leader >= 0 && this->blockPeriod != 0;
+	}
+
+	void start() {
+#ifdef __linux__
+		if (this->leader >= 0) {
+			this->nextEip = 0;
+			this->measuring = false;
+			this->runStart = read();
+			ioctl(this->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+#endif
+	}
+
+	void stop() {
+#ifdef __linux__
+		if (this->leader >= 0) {
+			ioctl(this->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+			Counts end = read();
+			for (size_t i = 0; i < eventCount; i++) {
+				this->total[i] += end[i] - this->runStart[i];
+			}
+		}
+#endif
+	}
+
+	// Count what runs until leave(engine) for engine instead of the interpreter.
+	void enter() {
+		this->sectionStart = read();
+	}
+
+	void leave(Engine engine) {
+		add(this->engines[(size_t)engine], this->sectionStart, read());
+	}
+
+	// Called before running the instruction at eip when sampling.
+	// next is the address following it if no branch is taken.
+	void step(uint32_t eip, uint32_t next) {
+		if (eip != this->nextEip) {
+			blockStart(eip);
+		}
+		this->nextEip = next;
+	}
+
+	void print(const ExecutionCounts& counts) {
+		std::cout << std::dec << "Guest instructions: " << counts.instructions << std::endl;
+		std::cout << "  decoded: " << counts.decoded << std::endl;
+		std::cout << "  fused: " << counts.fused << std::endl;
+
+		if (this->leader < 0) {
+			std::cout << "Host counters unavailable: " << this->error << std::endl;
+			return;
+		}
+		if (!this->missing.empty()) {
+			std::cout << "Host counters missing: " << this->missing << std::endl;
+		}
+
+		Counts interpreter = this->total;
+		for (size_t engine = 1; engine < engineCount; engine++) {
+			for (size_t i = 0; i < eventCount; i++) {
+				interpreter[i] -= std::min(interpreter[i], this->engines[engine][i]);
+			}
+		}
+
+		printCounts("Host counters", this->total, counts.instructions, "guest instruction");
+		printCounts("  interpreter", interpreter, counts.instructions, "guest instruction");
+		printCounts("  decoder", this->engines[(size_t)Engine::Decoder], counts.decoded, "decoded instruction");
+
+		if (this->blocks.empty()) {
+			return;
+		}
+
+		// task-clock counts nanoseconds when there are no cycles
+		size_t first = has(Event::Cycles) ? (size_t)Event::Cycles : (size_t)Event::TaskClock;
+
+		std::vector<std::pair<uint32_t, Block>> hottest(this->blocks.begin(), this->blocks.end());
+		std::sort(hottest.begin(), hottest.end(), [first](const auto& a, const auto& b) {
+			return a.second.counts[first] > b.second.counts[first];
+		});
+		hottest.resize(std::min<size_t>(hottest.size(), 10));
+
+		std::cout << "Hottest sampled blocks (average per run):" << std::endl;
+		for (auto& [eip, block] : hottest) {
+			std::cout << "  " << std::hex << std::setw(8) << std::setfill('0') << eip << std::dec << std::setfill(' ')
+				<< " samples " << block.samples;
+			for (size_t i = 0; i < eventCount; i++) {
+				if (this->positions[i] >= 0) {
+					std::cout << " " << names[i] << " " << block.counts[i] / block.samples;
+				}
+			}
+			std::cout << std::endl;
+		}
+	}
+
+private:
+	struct Block {
+		uint64_t samples = 0;
+		Counts counts = {};
+	};
+
+	static constexpr std::array<const char*, eventCount> names = {
+		"cycles", "instructions", "branches", "branch-misses", "L1d-misses", "LLC-misses", "task-clock"
+	};
+
+	uint32_t blockPeriod;
+	int leader = -1;
+	std::array<int, eventCount> fds = { -1, -1, -1, -1, -1, -1, -1 };
+	// position of each open event in the values read from the group
+	std::array<int, eventCount> positions = { -1, -1, -1, -1, -1, -1, -1 };
+	size_t openCount = 0;
+	std::string error;
+	std::string missing;
+
+	Counts runStart = {};
+	Counts total = {};
+	Counts sectionStart = {};
+	std::array<Counts, engineCount> engines = {};
+	// cost of one read, subtracted from every measured section
+	Counts readCost = {};
+
+	uint64_t blockCount = 0;
+	uint32_t nextEip = 0;
+	bool measuring = false;
+	uint32_t measuredEip = 0;
+	Counts blockStartCounts = {};
+	std::unordered_map<uint32_t, Block> blocks;
+
+	bool has(Event event) {
+		return this->positions[(size_t)event] >= 0;
+	}
+
+	void open() {
+#ifdef __linux__
+		struct Config {
+			uint32_t type;
+			uint64_t config;
+		};
+		constexpr std::array<Config, eventCount> configs = { {
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+			{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+			{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+			{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK }
+		} };
+
+		for (size_t i = 0; i < eventCount; i++) {
+			perf_event_attr attr = {};
+			attr.size = sizeof(attr);
+			attr.type = configs[i].type;
+			attr.config = configs[i].config;
+			attr.read_format = PERF_FORMAT_GROUP;
+			// the leader starts disabled and enables the whole group
+			attr.disabled = (this->leader < 0);
+			// the guest runs in user space, kernel counting is often not allowed
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+
+			int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, this->leader, 0);
+			if (fd < 0) {
+				if (this->leader < 0 && this->error.empty()) {
+					this->error = strerror(errno);
+				}
+				this->missing += (this->missing.empty() ? "" : ", ") + std::string(names[i]);
+				continue;
+			}
+
+			if (this->leader < 0) {
+				this->leader = fd;
+			}
+			this->fds[i] = fd;
+			this->positions[i] = (int)this->openCount++;
+		}
+#else
+		this->error = "perf_event_open is not supported on this host";
+#endif
+	}
+
+	Counts read() {
+		Counts counts = {};
+#ifdef __linux__
+		// [u64 nr] [u64 value] * nr
+		std::array<uint64_t, eventCount + 1> values;
+		if (this->leader < 0 || ::read(this->leader, values.data(), sizeof(values)) < (ssize_t)sizeof(uint64_t)) {
+			return counts;
+		}
+		for (size_t i = 0; i < eventCount; i++) {
+			if (this->positions[i] >= 0 && (uint64_t)this->positions[i] < values[0]) {
+				counts[i] = values[this->positions[i] + 1];
+			}
+		}
+#endif
+		return counts;
+	}
+
+	void calibrate() {
+#ifdef __linux__
+		ioctl(this->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		this->readCost.fill(UINT64_MAX);
+		for (int i = 0; i < 16; i++) {
+			Counts from = read();
+			Counts to = read();
+			for (size_t j = 0; j < eventCount; j++) {
+				this->readCost[j] = std::min(this->readCost[j], to[j] - from[j]);
+			}
+		}
+		ioctl(this->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+#endif
+	}
+
+	void add(Counts& counts, const Counts& from, const Counts& to) {
+		for (size_t i = 0; i < eventCount; i++) {
+			uint64_t delta = to[i] - from[i];
+			counts[i] += delta - std::min(delta, this->readCost[i]);
+		}
+	}
+
+	void blockStart(uint32_t eip) {
+		if (this->measuring) {
+			Block& block = this->blocks[this->measuredEip];
+			block.samples++;
+			add(block.counts, this->blockStartCounts, read());
+			this->measuring = false;
+		}
+
+		if (++this->blockCount % this->blockPeriod == 0) {
+			this->measuring = true;
+			this->measuredEip = eip;
+			this->blockStartCounts = read();
+		}
+	}
+
+	void printCounts(const char* title, const Counts& counts, uint64_t instructions, const char* unit) {
+		std::cout << title << ":" << std::endl << std::setfill(' ');
+		for (size_t i = 0; i < eventCount; i++) {
+			if (this->positions[i] < 0) {
+				continue;
+			}
+
+			std::cout << "    " << std::left << std::setw(14) << names[i] << std::right << std::setw(16) << counts[i];
+			if (instructions != 0) {
+				std::cout << std::fixed << std::setprecision(3) << std::setw(12)
+					<< (double)counts[i] / instructions << " per " << unit;
+			}
+			if ((Event)i == Event::Instructions && has(Event::Cycles) && counts[(size_t)Event::Cycles] != 0) {
+				std::cout << ", IPC " << (double)counts[i] / counts[(size_t)Event::Cycles];
+			}
+			if ((Event)i == Event::BranchMisses && has(Event::Branches) && counts[(size_t)Event::Branches] != 0) {
+				std::cout << ", " << 100.0 * counts[i] / counts[(size_t)Event::Branches] << "% of branches";
+			}
+			std::cout << std::defaultfloat << std::endl;
+		}
+	}
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <iostream>
+#include <unordered_set>
+#include "Instrumentation.hpp"
+#include "ShadowMemory.hpp"
+#include "Memory.hpp"
+
+// Reports loads of guest bytes nothing has written yet: not loaded from the
+// ELF file or a checkpoint, not stored by the guest and not read into by a
+// syscall. Each instruction is reported once.
+class ReadCheck : public Instrumentation {
+public:
+	// Memory written before, like the loaded ELF file, counts page by page.
+	ReadCheck(Memory& memory) :
+		written(memory.getSize()) {
+		memory.forEachDirtyPage([this](size_t page) {
+			this->written.set(page * Memory::pageSize, Memory::pageSize, true);
+		});
+	}
+
+	void load(uint32_t address, uint32_t size) override {
+		if (!this->written.all(address, size) && this->reported.insert(getEip()).second) {
+			std::cout << std::hex << "Read of uninitialized memory at " << getEip() << ": " << std::dec << size
+				<< " bytes at " << std::hex << address << std::dec << std::endl;
+		}
+	}
+
+	void store(uint32_t address, uint32_t size) override {
+		this->written.set(address, size, true);
+	}
+
+	// instructions that read uninitialized memory
+	size_t getReportCount() {
+		return this->reported.size();
+	}
+
+private:
+	ShadowMemory written;
+	std::unordered_set<uint32_t> reported;
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <bit>
+
 class Registers {
 public:
 	enum class Reg : uint8_t {
@@ -41,13 +43,62 @@ public:
 		AF = 0b0000'0001'0000,
 		ZF = 0b0000'0100'0000,
 		SF = 0b0000'1000'0000,
+		DF = 0b0100'0000'0000,
 		OF = 0b1000'0000'0000
 	};
 
+	// Operation whose arithmetic flags are computed only when they are read.
+	enum class FlagOp : uint8_t {
+		// EFLAGS is up to date
+		None,
+		// value1 + value2 + aux (carry in)
+		Add,
+		// value1 - value2 - aux (borrow in)
+		Sub,
+		// CF, OF and AF cleared
+		Logic,
+		// value1 + 1, aux = CF before the operation
+		Inc,
+		// value1 - 1, aux = CF before the operation
+		Dec,
+		// CF, OF and AF given in aux
+		Result
+	};
+
+	static constexpr uint32_t arithmeticFlags = (uint32_t)Flag::CF | (uint32_t)Flag::PF | (uint32_t)Flag::AF |
+		(uint32_t)Flag::ZF | (uint32_t)Flag::SF | (uint32_t)Flag::OF;
+
 	Registers() {
 		this->reset();
 	}
 
+	// Record an operation instead of computing CF, PF, AF, ZF, SF and OF.
+	// SF, ZF and PF always follow from result, values are size bytes wide.
+	void setLazyFlags(FlagOp op, uint32_t size, uint32_t value1, uint32_t value2, uint32_t result, uint32_t aux = 0) {
+		this->lazy.op = op;
+		this->lazy.size = size;
+		this->lazy.value1 = value1;
+		this->lazy.value2 = value2;
+		this->lazy.result = result;
+		this->lazy.aux = aux;
+	}
+
+	// The pending operation as given to setLazyFlags(), if it is 32 bit, and
+	// EFLAGS with the arithmetic flags from before it. False if EFLAGS is up
+	// to date or the operation is narrower, get(Reg::EFLAGS) has them then.
+	bool getLazyFlags(FlagOp& op, uint32_t& value1, uint32_t& value2, uint32_t& result, uint32_t& aux, uint32_t& eflags) {
+		if (this->lazy.op == FlagOp::None || this->lazy.size != 4) {
+			return false;
+		}
+		op = this->lazy.op;
+		value1 = this->lazy.value1;
+		value2 = this->lazy.value2;
+		result = this->lazy.result;
+		aux = this->lazy.aux;
+		eflags = this->registers[9];
+		return true;
+	}
+
 	void setFlag(Flag flag, bool value) {
 		uint32_t flags = get(Reg::EFLAGS);
 		if (value) {
@@ -59,11 +110,72 @@ public:
 		set(Reg::EFLAGS, flags);
 	}
 
+	// Replace the flags selected by mask with the same bits of values.
+	void setFlags(uint32_t mask, uint32_t values) {
+		uint32_t flags = get(Reg::EFLAGS);
+		set(Reg::EFLAGS, (flags & ~mask) | (values & mask));
+	}
+
 	bool getFlag(Flag flag) {
+		if (((uint32_t)flag & arithmeticFlags) == 0) {
+			// not affected by lazy flags
+			return (this->registers[9] & (uint32_t)flag) > 0;
+		}
+
+		if (flag == Flag::CF) {
+			// adc, sbb, inc and dec only need the carry
+			return getCarry();
+		}
+
 		uint32_t flags = get(Reg::EFLAGS);
 		return (flags & (uint32_t)flag) > 0;
 	}
 
+	// Condition cccn of jcc: O, B, Z, BE, S, P, L, LE, negated if n is set.
+	bool testCondition(uint8_t condition) {
+		bool negate = (condition & 1) > 0;
+		uint8_t test = (condition >> 1) & 0b111;
+
+		if ((this->lazy.op == FlagOp::Sub && this->lazy.aux == 0) || this->lazy.op == FlagOp::Logic) {
+			// cmp, sub and test are decided from the operands without building EFLAGS
+			bool logic = this->lazy.op == FlagOp::Logic;
+			uint32_t shift = 32 - this->lazy.size * 8;
+			bool below = !logic && this->lazy.value1 < this->lazy.value2;
+			bool zero = this->lazy.result == 0;
+			bool sign = (int32_t)(this->lazy.result << shift) < 0;
+			bool less = logic ? sign : (int32_t)(this->lazy.value1 << shift) < (int32_t)(this->lazy.value2 << shift);
+
+			switch (test) {
+				case 0b001: return below != negate;
+				case 0b010: return zero != negate;
+				case 0b011: return (below || zero) != negate;
+				case 0b100: return sign != negate;
+				case 0b110: return less != negate;
+				case 0b111: return (less || zero) != negate;
+				default: break;
+			}
+		}
+
+		uint32_t flags = get(Reg::EFLAGS);
+		bool carry = (flags & (uint32_t)Flag::CF) > 0;
+		bool zero = (flags & (uint32_t)Flag::ZF) > 0;
+		bool sign = (flags & (uint32_t)Flag::SF) > 0;
+		bool overflow = (flags & (uint32_t)Flag::OF) > 0;
+
+		bool result;
+		switch (test) {
+			case 0b000: result = overflow; break;
+			case 0b001: result = carry; break;
+			case 0b010: result = zero; break;
+			case 0b011: result = carry || zero; break;
+			case 0b100: result = sign; break;
+			case 0b101: result = (flags & (uint32_t)Flag::PF) > 0; break;
+			case 0b110: result = sign != overflow; break;
+			default: result = (sign != overflow) || zero; break;
+		}
+		return result != negate;
+	}
+
 	void set(Reg reg, bool w, bool bit16, uint32_t value) {
 		unsigned int index_i = (uint8_t)reg & 0b111;
 		if (w) {
@@ -92,6 +204,9 @@ public:
 			this->set(reg, (index_i & 0b10000) > 0, (index_i & 0b01000) > 0, value);
 		}
 		else {
+			if (reg == Reg::EFLAGS) {
+				this->lazy.op = FlagOp::None;
+			}
 			this->registers[(index_i & 0b111) + 8] = value;
 		}
 	}
@@ -124,11 +239,18 @@ public:
 			return this->get(reg, (index_i & 0b10000) > 0, (index_i & 0b01000) > 0);
 		}
 		else {
+			if (reg == Reg::EFLAGS && this->lazy.op != FlagOp::None) {
+				materializeFlags();
+			}
 			return this->registers[(index_i & 0b111) + 8];
 		}
 	}
 
 	void print() {
+		if (this->lazy.op != FlagOp::None) {
+			materializeFlags();
+		}
+
 		std::cout << "EAX      " << "ECX      " << "EDX      " << "EBX      " << "ESP      " << "EBP      " << "ESI      " << "EDI      " << "EIP      " << "EFLAGS   " << std::endl;
 		std::cout << std::fixed << std::hex << std::setfill('0');
 		for (size_t i = 0; i < regCount; i++) {
@@ -139,9 +261,83 @@ public:
 
 	void reset() {
 		memset(this->registers, 0, sizeof(this->registers));
+		this->lazy.op = FlagOp::None;
 	}
 
 private:
 	const static size_t regCount = 8 + 2;
 	uint32_t registers[regCount];
+
+	struct {
+		FlagOp op = FlagOp::None;
+		uint32_t size = 4;
+		uint32_t value1 = 0;
+		uint32_t value2 = 0;
+		uint32_t result = 0;
+		uint32_t aux = 0;
+	} lazy;
+
+	// largest value of the lazy operand size, only valid with a lazy operation
+	uint64_t maxValue() {
+		return (1ull << (this->lazy.size * 8)) - 1;
+	}
+
+	bool getCarry() {
+		switch (this->lazy.op) {
+			case FlagOp::None:
+				return (this->registers[9] & (uint32_t)Flag::CF) > 0;
+			case FlagOp::Add:
+				return (uint64_t)this->lazy.value1 + this->lazy.value2 + this->lazy.aux > maxValue();
+			case FlagOp::Sub:
+				return (uint64_t)this->lazy.value1 < (uint64_t)this->lazy.value2 + this->lazy.aux;
+			case FlagOp::Logic:
+				return false;
+			default:
+				return (this->lazy.aux & (uint32_t)Flag::CF) > 0;
+		}
+	}
+
+	void materializeFlags() {
+		uint32_t sign = 1u << (this->lazy.size * 8 - 1);
+		uint32_t value1 = this->lazy.value1;
+		uint32_t value2 = this->lazy.value2;
+		uint32_t result = this->lazy.result;
+		uint32_t aux = this->lazy.aux;
+
+		uint32_t flags = 0;
+		switch (this->lazy.op) {
+			case FlagOp::Add:
+				flags |= ((uint64_t)value1 + value2 + aux > maxValue()) ? (uint32_t)Flag::CF : 0;
+				flags |= ((value1 ^ result) & (value2 ^ result) & sign) ? (uint32_t)Flag::OF : 0;
+				flags |= ((value1 ^ value2 ^ result) & 0x10) ? (uint32_t)Flag::AF : 0;
+				break;
+			case FlagOp::Sub:
+				flags |= ((uint64_t)value1 < (uint64_t)value2 + aux) ? (uint32_t)Flag::CF : 0;
+				flags |= ((value1 ^ value2) & (value1 ^ result) & sign) ? (uint32_t)Flag::OF : 0;
+				flags |= ((value1 ^ value2 ^ result) & 0x10) ? (uint32_t)Flag::AF : 0;
+				break;
+			case FlagOp::Inc:
+				flags |= aux ? (uint32_t)Flag::CF : 0;
+				flags |= (result == sign) ? (uint32_t)Flag::OF : 0;
+				flags |= ((result & 0xf) == 0) ? (uint32_t)Flag::AF : 0;
+				break;
+			case FlagOp::Dec:
+				flags |= aux ? (uint32_t)Flag::CF : 0;
+				flags |= (value1 == sign) ? (uint32_t)Flag::OF : 0;
+				flags |= ((result & 0xf) == 0xf) ? (uint32_t)Flag::AF : 0;
+				break;
+			case FlagOp::Result:
+				flags |= aux & ((uint32_t)Flag::CF | (uint32_t)Flag::OF | (uint32_t)Flag::AF);
+				break;
+			default:
+				break;
+		}
+
+		flags |= (result == 0) ? (uint32_t)Flag::ZF : 0;
+		flags |= (result & sign) ? (uint32_t)Flag::SF : 0;
+		flags |= (std::popcount(result & 0xff) % 2 == 0) ? (uint32_t)Flag::PF : 0;
+
+		this->registers[9] = (this->registers[9] & ~arithmeticFlags) | flags;
+		this->lazy.op = FlagOp::None;
+	}
 };
@@ -0,0 +1,395 @@
+#pragma once
+
+#include <coroutine>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include "IoUring.hpp"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#define VXM86_SCHEDULER
+#endif
+
+#ifdef VXM86_SCHEDULER
+
+// Runs guests as coroutines on a few worker threads.
+// A guest waiting for a host file suspends and its file is handed to an
+// epoll event loop, the worker continues with the next runnable guest.
+// The event loop queues the guest again when the file is ready, any
+// worker may resume it. Guests that never wait have to co_await yield()
+// now and then to let the others run.
+//
+// With io_uring, reads and writes awaited with io() from all coroutines
+// are queued on one ring and submitted together when a worker runs out of
+// runnable coroutines, after submitBatch of them, or once every worker
+// resumed a coroutine since the first was queued, so guests that keep
+// running can't hold them back. Completions arrive through the same event
+// loop.
+class Scheduler {
+public:
+	// Coroutine started by spawn(), its frame is freed when it returns.
+	class Task {
+	public:
+		struct promise_type {
+			Scheduler* scheduler = nullptr;
+
+			Task get_return_object() {
+				return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+
+			// started by spawn()
+			std::suspend_always initial_suspend() noexcept {
+				return {};
+			}
+
+			auto final_suspend() noexcept {
+				struct Finish {
+					bool await_ready() noexcept {
+						return false;
+					}
+					void await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+						Scheduler* scheduler = handle.promise().scheduler;
+						handle.destroy();
+						scheduler->finish();
+					}
+					void await_resume() noexcept {
+					}
+				};
+				return Finish();
+			}
+
+			void return_void() {
+			}
+
+			// the guest stops, the others keep running
+			void unhandled_exception() {
+				try {
+					throw;
+				}
+				catch (const std::exception& e) {
+					std::cout << e.what() << std::endl;
+				}
+			}
+		};
+
+		Task(Task&& other) noexcept :
+			handle(other.handle) {
+			other.handle = nullptr;
+		}
+
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+		~Task() {
+			// never spawned
+			if (handle) {
+				handle.destroy();
+			}
+		}
+
+	private:
+		friend class Scheduler;
+
+		std::coroutine_handle<promise_type> handle;
+
+		explicit Task(std::coroutine_handle<promise_type> handle) :
+			handle(handle) {
+		}
+	};
+
+	// ioUring only if the host allows it, see hasIoUring()
+	Scheduler(size_t workerCount, bool ioUring = false) :
+		workerCount(std::max<size_t>(workerCount, 1)) {
+		this->epoll = epoll_create1(EPOLL_CLOEXEC);
+		this->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (this->epoll < 0 || this->wakeup < 0) {
+			throw std::runtime_error("Failed to create event loop");
+		}
+
+		// the wakeup file is the only one registered without a coroutine
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.ptr = nullptr;
+		epoll_ctl(this->epoll, EPOLL_CTL_ADD, this->wakeup, &event);
+
+#ifdef VXM86_IO_URING
+		if (ioUring) {
+			try {
+				this->ring = std::make_unique<IoUring>(ringEntries);
+				event.data.ptr = this->ring.get();
+				epoll_ctl(this->epoll, EPOLL_CTL_ADD, this->ring->getEventFd(), &event);
+			}
+			catch (const std::exception& e) {
+				std::cout << e.what() << ", using synchronous I/O" << std::endl;
+			}
+		}
+#endif
+	}
+
+	Scheduler(const Scheduler&) = delete;
+	Scheduler& operator=(const Scheduler&) = delete;
+
+	~Scheduler() {
+		close(this->wakeup);
+		close(this->epoll);
+	}
+
+	// Queue a new coroutine, callable from inside other coroutines.
+	void spawn(Task task) {
+		std::coroutine_handle<Task::promise_type> handle = task.handle;
+		task.handle = nullptr;
+		handle.promise().scheduler = this;
+		this->live.fetch_add(1, std::memory_order_relaxed);
+		ready(handle);
+	}
+
+	// Run the coroutines until all of them returned.
+	void run() {
+		std::thread eventLoop([this]() { this->eventLoop(); });
+
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < this->workerCount; i++) {
+			workers.emplace_back([this]() { this->worker(); });
+		}
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+
+		this->stopping.store(true, std::memory_order_relaxed);
+		uint64_t one = 1;
+		ssize_t written = ::write(this->wakeup, &one, sizeof(one));
+		(void)written;
+		eventLoop.join();
+	}
+
+	// Suspend until fd is readable, or writable if output is set.
+	auto wait(int fd, bool output) {
+		struct Wait {
+			Scheduler* scheduler;
+			int fd;
+			bool output;
+
+			bool await_ready() {
+				return false;
+			}
+			void await_suspend(std::coroutine_handle<> handle) {
+				scheduler->watch(fd, output, handle);
+			}
+			void await_resume() {
+			}
+		};
+		return Wait{ this, fd, output };
+	}
+
+	bool hasIoUring() {
+#ifdef VXM86_IO_URING
+		return this->ring != nullptr;
+#else
+		return false;
+#endif
+	}
+
+	// Read or write awaited with io().
+	struct IoAwaiter {
+		Scheduler* scheduler;
+		bool output;
+		int fd;
+		void* buffer;
+		uint32_t size;
+		int64_t offset;
+		std::coroutine_handle<> handle = nullptr;
+		int32_t result = 0;
+
+		bool await_ready() {
+			return false;
+		}
+		bool await_suspend(std::coroutine_handle<> handle) {
+			this->handle = handle;
+			return scheduler->queueIo(this);
+		}
+		int32_t await_resume() {
+			return result;
+		}
+	};
+
+	// Suspend until buffer is read from or written to fd at offset,
+	// -1 for the file position. Returns the result of read/write or a
+	// negated errno. Without io_uring the transfer is done right away.
+	IoAwaiter io(bool output, int fd, void* buffer, uint32_t size, int64_t offset) {
+		return IoAwaiter{ this, output, fd, buffer, size, offset };
+	}
+
+	// Let the other runnable coroutines go first.
+	auto yield() {
+		struct Yield {
+			Scheduler* scheduler;
+
+			bool await_ready() {
+				return false;
+			}
+			void await_suspend(std::coroutine_handle<> handle) {
+				scheduler->ready(handle);
+			}
+			void await_resume() {
+			}
+		};
+		return Yield{ this };
+	}
+
+private:
+	static constexpr uint32_t ringEntries = 4096;
+	// queued requests submitted even while coroutines are runnable
+	static constexpr size_t submitBatch = 64;
+
+	size_t workerCount;
+	int epoll = -1;
+	// written to stop the event loop
+	int wakeup = -1;
+	std::atomic<bool> stopping = false;
+	// spawned coroutines that didn't return yet
+	std::atomic<size_t> live = 0;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<std::coroutine_handle<>> queue;
+#ifdef VXM86_IO_URING
+	std::unique_ptr<IoUring> ring;
+	// resumes since requests were queued but not submitted
+	std::atomic<size_t> resumesQueued = 0;
+#endif
+
+	void ready(std::coroutine_handle<> handle) {
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->queue.push_back(handle);
+		}
+		this->condition.notify_one();
+	}
+
+	void finish() {
+		if (this->live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			// the last one, let the workers see it
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->condition.notify_all();
+		}
+	}
+
+	void watch(int fd, bool output, std::coroutine_handle<> handle) {
+		// one shot, a file is watched only while its guest is suspended
+		epoll_event event = {};
+		event.events = (output ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT | EPOLLRDHUP;
+		event.data.ptr = handle.address();
+		if (epoll_ctl(this->epoll, EPOLL_CTL_MOD, fd, &event) != 0 &&
+			(errno != ENOENT || epoll_ctl(this->epoll, EPOLL_CTL_ADD, fd, &event) != 0)) {
+			// not pollable, like a regular file, so it never blocks
+			ready(handle);
+		}
+	}
+
+	// Queue the request of an io() awaiter, false if it finished without waiting.
+	bool queueIo(IoAwaiter* io) {
+#ifdef VXM86_IO_URING
+		if (this->ring != nullptr) {
+			uint64_t userData = (uint64_t)(uintptr_t)io;
+			if (this->ring->push(io->output, io->fd, io->buffer, io->size, io->offset, userData)) {
+				return true;
+			}
+			// full, make room and try once more
+			this->ring->submit();
+			if (this->ring->push(io->output, io->fd, io->buffer, io->size, io->offset, userData)) {
+				return true;
+			}
+		}
+#endif
+		ssize_t count;
+		if (io->offset < 0) {
+			count = io->output ? ::write(io->fd, io->buffer, io->size) : ::read(io->fd, io->buffer, io->size);
+		}
+		else {
+			count = io->output ? ::pwrite(io->fd, io->buffer, io->size, io->offset) : ::pread(io->fd, io->buffer, io->size, io->offset);
+		}
+		io->result = (count < 0) ? -errno : (int32_t)count;
+		return false;
+	}
+
+	// Submit the queued requests once no coroutine is left to run, so the
+	// requests of all of them go in one system call, but at the latest
+	// after a round of resumes over the workers.
+	void submitIo() {
+#ifdef VXM86_IO_URING
+		if (this->ring == nullptr) {
+			return;
+		}
+		size_t queued = this->ring->getQueued();
+		if (queued == 0) {
+			return;
+		}
+
+		bool idle;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			idle = this->queue.empty();
+		}
+		size_t resumes = this->resumesQueued.fetch_add(1, std::memory_order_relaxed) + 1;
+		if (idle || queued >= submitBatch || resumes >= this->workerCount) {
+			this->resumesQueued.store(0, std::memory_order_relaxed);
+			this->ring->submit();
+		}
+#endif
+	}
+
+	void worker() {
+		while (true) {
+			std::coroutine_handle<> handle;
+			{
+				std::unique_lock<std::mutex> lock(this->mutex);
+				this->condition.wait(lock, [this]() {
+					return !this->queue.empty() || this->live.load(std::memory_order_acquire) == 0;
+				});
+				if (this->queue.empty()) {
+					return;
+				}
+				handle = this->queue.front();
+				this->queue.pop_front();
+			}
+			handle.resume();
+			submitIo();
+		}
+	}
+
+	void eventLoop() {
+		epoll_event events[64];
+		while (!this->stopping.load(std::memory_order_relaxed)) {
+			int count = epoll_wait(this->epoll, events, 64, -1);
+			for (int i = 0; i < count; i++) {
+#ifdef VXM86_IO_URING
+				if (events[i].data.ptr == this->ring.get() && this->ring != nullptr) {
+					this->ring->reap([this](uint64_t userData, int32_t result) {
+						IoAwaiter* io = (IoAwaiter*)(uintptr_t)userData;
+						io->result = result;
+						ready(io->handle);
+					});
+					continue;
+				}
+#endif
+				if (events[i].data.ptr != nullptr) {
+					ready(std::coroutine_handle<>::from_address(events[i].data.ptr));
+				}
+			}
+		}
+	}
+};
+
+#endif
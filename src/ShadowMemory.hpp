@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+// One bit for every byte of guest memory, for instrumentation tools.
+// Bits are kept in chunks that are only allocated once one of them differs
+// from the initial value, the table of chunks works like a page table, so
+// memory the guest never touches costs a null pointer per chunk.
+class ShadowMemory {
+public:
+	// guest bytes covered by one chunk
+	static constexpr size_t chunkSize = 0x1'0000;
+
+	ShadowMemory(size_t size, bool initial = false) :
+		size(size),
+		initial(initial),
+		chunks((size + chunkSize - 1) / chunkSize) {
+	}
+
+	bool get(size_t address) {
+		if (address >= this->size) {
+			return this->initial;
+		}
+
+		const uint64_t* chunk = this->chunks[address / chunkSize].get();
+		if (chunk == nullptr) {
+			return this->initial;
+		}
+		size_t bit = address % chunkSize;
+		return ((chunk[bit / 64] >> (bit % 64)) & 1) != 0;
+	}
+
+	// Set the bits of [address, address + size) to value.
+	void set(size_t address, size_t size, bool value) {
+		forEachWord(address, size, [&](std::unique_ptr<uint64_t[]>& chunk, size_t word, uint64_t mask) {
+			if (chunk == nullptr) {
+				if (value == this->initial) {
+					return true;
+				}
+				chunk.reset(new uint64_t[chunkSize / 64]);
+				memset(chunk.get(), this->initial ? 0xFF : 0, chunkSize / 8);
+			}
+
+			chunk[word] = value ? (chunk[word] | mask) : (chunk[word] & ~mask);
+			return true;
+		});
+	}
+
+	// True if every bit of [address, address + size) is set.
+	bool all(size_t address, size_t size) {
+		return forEachWord(address, size, [&](std::unique_ptr<uint64_t[]>& chunk, size_t word, uint64_t mask) {
+			return (chunk == nullptr) ? this->initial : (chunk[word] & mask) == mask;
+		});
+	}
+
+	// True if a bit of [address, address + size) is set.
+	bool any(size_t address, size_t size) {
+		return !forEachWord(address, size, [&](std::unique_ptr<uint64_t[]>& chunk, size_t word, uint64_t mask) {
+			return (chunk == nullptr) ? !this->initial : (chunk[word] & mask) == 0;
+		});
+	}
+
+private:
+	size_t size;
+	// value of the bits in chunks that aren't allocated
+	bool initial;
+	std::vector<std::unique_ptr<uint64_t[]>> chunks;
+
+	// Call f(chunk, word, mask) with the bits of [address, address + size)
+	// in every 64 bit word, until f returns false. Bits past the end of
+	// guest memory are left out.
+	template<typename F>
+	bool forEachWord(size_t address, size_t size, F f) {
+		size_t end = std::min(address + size, this->size);
+		while (address < end) {
+			std::unique_ptr<uint64_t[]>& chunk = this->chunks[address / chunkSize];
+			size_t bit = address % chunkSize;
+			size_t count = std::min<size_t>(64 - bit % 64, end - address);
+			uint64_t mask = ((count == 64) ? ~0ull : ((1ull << count) - 1)) << (bit % 64);
+			if (!f(chunk, bit / 64, mask)) {
+				return false;
+			}
+			address += count;
+		}
+		return true;
+	}
+};
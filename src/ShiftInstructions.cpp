@@ -0,0 +1,161 @@
+#include "CPU.hpp"
+#include <bit>
+
+// rol/ror/rcl/rcr/shl/shr/sal/sar by 1, CL or imm8.
+// Like the ALU, every operation, operand size and count source is its own
+// template instantiation and the reg field only indexes a table.
+
+template<CPU::ShiftOp op, typename T, CPU::ShiftCount count>
+void CPU::shift(uint8_t modrm) {
+	constexpr uint32_t bits = sizeof(T) * 8;
+	constexpr T sign = (T)1 << (bits - 1);
+	constexpr uint32_t CF = (uint32_t)Registers::Flag::CF;
+	constexpr uint32_t OF = (uint32_t)Registers::Flag::OF;
+
+	// the count imm8 follows the displacement
+	RmOperand operand = decodeRm(modrm);
+
+	uint32_t n;
+	if constexpr (count == ShiftCount::One) {
+		n = 1;
+	}
+	else if constexpr (count == ShiftCount::CL) {
+		n = this->registers.get(Registers::Reg::CL);
+	}
+	else {
+		n = readImmediate(false, false);
+	}
+
+	n &= 0x1F;
+	if (n == 0) {
+		// flags are not affected
+		return;
+	}
+
+	T value = readRm<T>(operand);
+	T result;
+
+	if constexpr (op == ShiftOp::Rol || op == ShiftOp::Ror) {
+		// only CF and OF are affected
+		bool carry;
+		if constexpr (op == ShiftOp::Rol) {
+			result = std::rotl(value, (int)(n % bits));
+			carry = (result & 1) != 0;
+		}
+		else {
+			result = std::rotr(value, (int)(n % bits));
+			carry = (result & sign) != 0;
+		}
+
+		bool overflow = (op == ShiftOp::Rol) ? (((result & sign) != 0) != carry) : (((result ^ (result << 1)) & sign) != 0);
+		this->registers.setFlags(CF | OF, (carry ? CF : 0) | (overflow ? OF : 0));
+	}
+	else if constexpr (op == ShiftOp::Rcl || op == ShiftOp::Rcr) {
+		// rotate the bits + 1 wide value CF:value
+		n %= bits + 1;
+		if (n == 0) {
+			return;
+		}
+
+		constexpr uint64_t mask = (2ull << bits) - 1;
+		uint64_t wide = ((this->registers.getFlag(Registers::Flag::CF) ? 1ull : 0ull) << bits) | value;
+		if constexpr (op == ShiftOp::Rcl) {
+			wide = ((wide << n) | (wide >> (bits + 1 - n))) & mask;
+		}
+		else {
+			wide = ((wide >> n) | (wide << (bits + 1 - n))) & mask;
+		}
+
+		result = (T)wide;
+		bool carry = (wide >> bits) != 0;
+		bool overflow = (op == ShiftOp::Rcl) ? (((result & sign) != 0) != carry) : (((result ^ (result << 1)) & sign) != 0);
+		this->registers.setFlags(CF | OF, (carry ? CF : 0) | (overflow ? OF : 0));
+	}
+	else {
+		bool carry;
+		bool overflow;
+		if constexpr (op == ShiftOp::Shl || op == ShiftOp::Sal) {
+			uint64_t wide = (uint64_t)value << n;
+			result = (T)wide;
+			carry = ((wide >> bits) & 1) != 0;
+			overflow = ((result & sign) != 0) != carry;
+		}
+		else if constexpr (op == ShiftOp::Shr) {
+			result = (T)((uint32_t)value >> n);
+			carry = (((uint32_t)value >> (n - 1)) & 1) != 0;
+			overflow = (value & sign) != 0;
+		}
+		else {
+			int32_t signedValue = (std::make_signed_t<T>)value;
+			result = (T)(signedValue >> n);
+			carry = ((signedValue >> (n - 1)) & 1) != 0;
+			overflow = false;
+		}
+
+		this->registers.setLazyFlags(Registers::FlagOp::Result, sizeof(T), value, n, result, (carry ? CF : 0) | (overflow ? OF : 0));
+	}
+
+	writeRm<T>(operand, result);
+}
+
+template<typename T, CPU::ShiftCount count>
+std::array<CPU::AluHandler, 8> CPU::shiftHandlers() {
+	return {
+		&CPU::shift<ShiftOp::Rol, T, count>,
+		&CPU::shift<ShiftOp::Ror, T, count>,
+		&CPU::shift<ShiftOp::Rcl, T, count>,
+		&CPU::shift<ShiftOp::Rcr, T, count>,
+		&CPU::shift<ShiftOp::Shl, T, count>,
+		&CPU::shift<ShiftOp::Shr, T, count>,
+		&CPU::shift<ShiftOp::Sal, T, count>,
+		&CPU::shift<ShiftOp::Sar, T, count>
+	};
+}
+
+void CPU::initShiftInstructions() {
+	// [size prefix][w][op]
+	static const std::array<AluHandler, 8> byOne[2][2] = {
+		{ shiftHandlers<uint8_t, ShiftCount::One>(), shiftHandlers<uint32_t, ShiftCount::One>() },
+		{ shiftHandlers<uint8_t, ShiftCount::One>(), shiftHandlers<uint16_t, ShiftCount::One>() }
+	};
+	static const std::array<AluHandler, 8> byCL[2][2] = {
+		{ shiftHandlers<uint8_t, ShiftCount::CL>(), shiftHandlers<uint32_t, ShiftCount::CL>() },
+		{ shiftHandlers<uint8_t, ShiftCount::CL>(), shiftHandlers<uint16_t, ShiftCount::CL>() }
+	};
+	static const std::array<AluHandler, 8> byImm8[2][2] = {
+		{ shiftHandlers<uint8_t, ShiftCount::Imm8>(), shiftHandlers<uint32_t, ShiftCount::Imm8>() },
+		{ shiftHandlers<uint8_t, ShiftCount::Imm8>(), shiftHandlers<uint16_t, ShiftCount::Imm8>() }
+	};
+
+	instructions[0b1101'0000 >> 2] = [&](uint8_t opcode, bool sizePrefix) -> bool {
+		// op r/m, 1
+		// [1101 000 w] [mod op r/m]
+
+		// op r/m, CL
+		// [1101 001 w] [mod op r/m]
+		bool w = (opcode & 0b0000'0001) > 0;
+		bool cl = (opcode & 0b0000'0010) > 0;
+		uint8_t modrm = readImmediate(false, false);
+		uint8_t op = (modrm & 0b0011'1000) >> 3;
+
+		(this->*(cl ? byCL : byOne)[sizePrefix][w][op])(modrm);
+		return true;
+	};
+
+	// ret shares the slot
+	auto ret = instructions[0b1100'0000 >> 2];
+	instructions[0b1100'0000 >> 2] = [&, ret](uint8_t opcode, bool sizePrefix) -> bool {
+		if ((opcode & 0b0000'0010) > 0) {
+			return ret(opcode, sizePrefix);
+		}
+
+		// op r/m, imm8
+		// [1100 000 w] [mod op r/m] [imm8]
+		bool w = (opcode & 0b0000'0001) > 0;
+		uint8_t modrm = readImmediate(false, false);
+		uint8_t op = (modrm & 0b0011'1000) >> 3;
+
+		(this->*byImm8[sizePrefix][w][op])(modrm);
+		return true;
+	};
+}
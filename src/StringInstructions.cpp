@@ -0,0 +1,275 @@
+#include "CPU.hpp"
+#include <algorithm>
+
+// String instructions (movs, cmps, stos, lods, scas).
+// With a rep prefix the whole repetition is executed at once on host memory
+// (memmove, memset, memcmp, memchr) whenever it gives the same result as
+// executing it element by element. Otherwise, and when the range leaves the
+// guest memory, elements are processed one at a time so that ESI/EDI/ECX are
+// correct at the element which faults.
+
+namespace {
+	uint32_t elementSize(bool w, bool bit16) {
+		return (w ? (bit16 ? 2 : 4) : 1);
+	}
+
+	// true if [from, from + bytes) and [to, to + bytes) either do not overlap
+	// or copying element by element in the given direction behaves like memmove
+	bool moveIsMemmove(uint32_t to, uint32_t from, uint64_t bytes, bool backward) {
+		uint64_t distance = (to > from) ? (to - from) : (from - to);
+		if (distance >= bytes) {
+			return true;
+		}
+		return backward ? (to >= from) : (to <= from);
+	}
+}
+
+void CPU::movs(bool w, bool bit16) {
+	// movs
+	// [1010 010 w]
+	uint32_t size = elementSize(w, bit16);
+	uint32_t count = (this->repPrefix != 0) ? this->registers.get(Registers::Reg::ECX) : 1;
+	bool backward = this->registers.getFlag(Registers::Flag::DF);
+	int32_t step = backward ? -(int32_t)size : size;
+
+	uint32_t esi = this->registers.get(Registers::Reg::ESI);
+	uint32_t edi = this->registers.get(Registers::Reg::EDI);
+
+	// backward the ranges end at the first elements and must not start below 0
+	uint64_t bytes = (uint64_t)count * size;
+	bool fits = count > 0 && (!backward || (esi >= bytes - size && edi >= bytes - size));
+	uint64_t from = backward ? esi - (bytes - size) : esi;
+	uint64_t to = backward ? edi - (bytes - size) : edi;
+
+	if (fits && this->memory->contains(from, bytes) && this->memory->contains(to, bytes) && moveIsMemmove(to, from, bytes, backward)) {
+		this->memory->move(to, from, bytes);
+		esi += count * step;
+		edi += count * step;
+		count = 0;
+	}
+
+	while (count > 0) {
+		memoryWrite(w, bit16, edi, memoryRead(w, bit16, esi));
+		esi += step;
+		edi += step;
+		count--;
+
+		if (this->repPrefix != 0) {
+			this->registers.set(Registers::Reg::ECX, count);
+		}
+		this->registers.set(Registers::Reg::ESI, esi);
+		this->registers.set(Registers::Reg::EDI, edi);
+	}
+
+	if (this->repPrefix != 0) {
+		this->registers.set(Registers::Reg::ECX, 0);
+	}
+	this->registers.set(Registers::Reg::ESI, esi);
+	this->registers.set(Registers::Reg::EDI, edi);
+}
+
+void CPU::stos(bool w, bool bit16) {
+	// stos
+	// [1010 101 w]
+	uint32_t size = elementSize(w, bit16);
+	uint32_t count = (this->repPrefix != 0) ? this->registers.get(Registers::Reg::ECX) : 1;
+	bool backward = this->registers.getFlag(Registers::Flag::DF);
+	int32_t step = backward ? -(int32_t)size : size;
+
+	uint32_t edi = this->registers.get(Registers::Reg::EDI);
+	uint32_t value = this->registers.get(Registers::Reg::EAX, w, bit16);
+
+	// backward the range ends at the first element and must not start below 0
+	uint64_t bytes = (uint64_t)count * size;
+	bool fits = count > 0 && (!backward || edi >= bytes - size);
+	uint64_t to = backward ? edi - (bytes - size) : edi;
+
+	if (fits && this->memory->contains(to, bytes)) {
+		// the filled range does not depend on the direction
+		if (size == 1) {
+			this->memory->fill<uint8_t>(to, value, count);
+		}
+		else if (size == 2) {
+			this->memory->fill<uint16_t>(to, value, count);
+		}
+		else {
+			this->memory->fill<uint32_t>(to, value, count);
+		}
+		edi += count * step;
+		count = 0;
+	}
+
+	while (count > 0) {
+		memoryWrite(w, bit16, edi, value);
+		edi += step;
+		count--;
+
+		if (this->repPrefix != 0) {
+			this->registers.set(Registers::Reg::ECX, count);
+		}
+		this->registers.set(Registers::Reg::EDI, edi);
+	}
+
+	if (this->repPrefix != 0) {
+		this->registers.set(Registers::Reg::ECX, 0);
+	}
+	this->registers.set(Registers::Reg::EDI, edi);
+}
+
+void CPU::lods(bool w, bool bit16) {
+	// lods
+	// [1010 110 w]
+	uint32_t size = elementSize(w, bit16);
+	uint32_t count = (this->repPrefix != 0) ? this->registers.get(Registers::Reg::ECX) : 1;
+	bool backward = this->registers.getFlag(Registers::Flag::DF);
+	int32_t step = backward ? -(int32_t)size : size;
+
+	uint32_t esi = this->registers.get(Registers::Reg::ESI);
+
+	// backward the range ends at the first element and must not start below 0
+	uint64_t bytes = (uint64_t)count * size;
+	bool fits = count > 0 && (!backward || esi >= bytes - size);
+	uint64_t from = backward ? esi - (bytes - size) : esi;
+
+	if (fits && this->memory->contains(from, bytes)) {
+		// only the last loaded element is visible
+		esi += (count - 1) * step;
+		this->registers.set(Registers::Reg::EAX, w, bit16, memoryRead(w, bit16, esi));
+		esi += step;
+		count = 0;
+	}
+
+	while (count > 0) {
+		this->registers.set(Registers::Reg::EAX, w, bit16, memoryRead(w, bit16, esi));
+		esi += step;
+		count--;
+
+		if (this->repPrefix != 0) {
+			this->registers.set(Registers::Reg::ECX, count);
+		}
+		this->registers.set(Registers::Reg::ESI, esi);
+	}
+
+	if (this->repPrefix != 0) {
+		this->registers.set(Registers::Reg::ECX, 0);
+	}
+	this->registers.set(Registers::Reg::ESI, esi);
+}
+
+void CPU::cmps(bool w, bool bit16) {
+	// cmps
+	// [1010 011 w]
+	uint32_t size = elementSize(w, bit16);
+	uint32_t count = (this->repPrefix != 0) ? this->registers.get(Registers::Reg::ECX) : 1;
+	bool backward = this->registers.getFlag(Registers::Flag::DF);
+	int32_t step = backward ? -(int32_t)size : size;
+
+	uint32_t esi = this->registers.get(Registers::Reg::ESI);
+	uint32_t edi = this->registers.get(Registers::Reg::EDI);
+	uint64_t memorySize = this->memory->getSize();
+
+	// the fast path reads through view(), a tool sees the loads of the loop below
+	bool finished = false;
+	if (this->repPrefix == 0xF3 && size == 1 && !backward && count > 0 && esi < memorySize && edi < memorySize && this->instrumentation == nullptr) {
+		// repe cmpsb: compare the part inside the guest memory at once
+		uint32_t available = (uint32_t)std::min<uint64_t>(count, memorySize - std::max(esi, edi));
+		const uint8_t* src = this->memory->view(esi, available);
+		const uint8_t* dst = this->memory->view(edi, available);
+
+		uint32_t done = available;
+		if (memcmp(src, dst, available) != 0) {
+			done = (uint32_t)(std::mismatch(src, src + available, dst).first - src) + 1;
+		}
+
+		compareFlags(src[done - 1], dst[done - 1], 1);
+		esi += done;
+		edi += done;
+		count -= done;
+		finished = !this->registers.getFlag(Registers::Flag::ZF);
+		// if the range left the memory, the loop below faults at the next element
+	}
+
+	bool isRepe = (this->repPrefix == 0xF3);
+	while (count > 0 && !finished) {
+		uint32_t value1 = memoryRead(w, bit16, esi);
+		uint32_t value2 = memoryRead(w, bit16, edi);
+		compareFlags(value1, value2, size);
+		esi += step;
+		edi += step;
+		count--;
+
+		if (this->repPrefix != 0) {
+			this->registers.set(Registers::Reg::ECX, count);
+		}
+		this->registers.set(Registers::Reg::ESI, esi);
+		this->registers.set(Registers::Reg::EDI, edi);
+
+		if (this->registers.getFlag(Registers::Flag::ZF) != isRepe) {
+			break;
+		}
+	}
+
+	if (this->repPrefix != 0) {
+		this->registers.set(Registers::Reg::ECX, count);
+	}
+	this->registers.set(Registers::Reg::ESI, esi);
+	this->registers.set(Registers::Reg::EDI, edi);
+}
+
+void CPU::scas(bool w, bool bit16) {
+	// scas
+	// [1010 111 w]
+	uint32_t size = elementSize(w, bit16);
+	uint32_t count = (this->repPrefix != 0) ? this->registers.get(Registers::Reg::ECX) : 1;
+	bool backward = this->registers.getFlag(Registers::Flag::DF);
+	int32_t step = backward ? -(int32_t)size : size;
+
+	uint32_t edi = this->registers.get(Registers::Reg::EDI);
+	uint32_t value = this->registers.get(Registers::Reg::EAX, w, bit16);
+	uint64_t memorySize = this->memory->getSize();
+
+	// the fast path reads through view(), a tool sees the loads of the loop below
+	bool finished = false;
+	if (this->repPrefix != 0 && size == 1 && !backward && count > 0 && edi < memorySize && this->instrumentation == nullptr) {
+		// repne scasb (strlen) / repe scasb: search the part inside the guest memory at once
+		uint32_t available = (uint32_t)std::min<uint64_t>(count, memorySize - edi);
+		const uint8_t* dst = this->memory->view(edi, available);
+
+		const uint8_t* stop;
+		if (this->repPrefix == 0xF2) {
+			stop = (const uint8_t*)memchr(dst, value, available);
+		}
+		else {
+			stop = std::find_if(dst, dst + available, [value](uint8_t byte) { return byte != value; });
+		}
+
+		uint32_t done = (stop != nullptr && stop != dst + available) ? (uint32_t)(stop - dst) + 1 : available;
+
+		compareFlags(value, dst[done - 1], 1);
+		edi += done;
+		count -= done;
+		finished = (this->registers.getFlag(Registers::Flag::ZF) != (this->repPrefix == 0xF3));
+		// if the range left the memory, the loop below faults at the next element
+	}
+
+	bool isRepe = (this->repPrefix == 0xF3);
+	while (count > 0 && !finished) {
+		compareFlags(value, memoryRead(w, bit16, edi), size);
+		edi += step;
+		count--;
+
+		if (this->repPrefix != 0) {
+			this->registers.set(Registers::Reg::ECX, count);
+		}
+		this->registers.set(Registers::Reg::EDI, edi);
+
+		if (this->registers.getFlag(Registers::Flag::ZF) != isRepe) {
+			break;
+		}
+	}
+
+	if (this->repPrefix != 0) {
+		this->registers.set(Registers::Reg::ECX, count);
+	}
+	this->registers.set(Registers::Reg::EDI, edi);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+// Log of the nondeterministic inputs a guest receives through int 0x80.
+// In record mode every input is appended to the file as soon as it is known,
+// so the log survives a crash of the guest or of the emulator.
+// In replay mode the inputs are fed back in the same order instead of
+// touching the host.
+//
+// File format (little endian):
+// [magic "VXM86LOG"] [u32 version]
+// entries: [u32 syscall] [u32 size] [size bytes]
+class SyscallLog {
+public:
+	enum class Mode {
+		Record,
+		Replay
+	};
+
+	SyscallLog(const std::string& path, Mode mode) :
+		mode(mode) {
+		if (mode == Mode::Record) {
+			file.open(path, std::ios::binary | std::ios::trunc);
+			if (!file.is_open()) {
+				throw std::runtime_error("Failed to open syscall log");
+			}
+
+			file.write(magic, sizeof(magic));
+			writeValue(version);
+			file.flush();
+		}
+		else {
+			std::ifstream in(path, std::ios::binary);
+			if (!in.is_open()) {
+				throw std::runtime_error("Failed to open syscall log");
+			}
+
+			in.seekg(0, std::ios::end);
+			size_t size = in.tellg();
+			in.seekg(0, std::ios::beg);
+			data.resize(size);
+			in.read((char*)data.data(), size);
+
+			if (size < sizeof(magic) + sizeof(uint32_t) || memcmp(data.data(), magic, sizeof(magic)) != 0) {
+				throw std::runtime_error("Invalid syscall log");
+			}
+			position = sizeof(magic);
+			if (readValue() != version) {
+				throw std::runtime_error("Unsupported syscall log version");
+			}
+		}
+	}
+
+	Mode getMode() {
+		return this->mode;
+	}
+
+	bool isReplaying() {
+		return this->mode == Mode::Replay;
+	}
+
+	void record(uint32_t syscall, const uint8_t* input, uint32_t size) {
+		writeValue(syscall);
+		writeValue(size);
+		file.write((const char*)input, size);
+		file.flush();
+	}
+
+	// Returns the input recorded for the next syscall, which must be the same syscall.
+	std::vector<uint8_t> replay(uint32_t syscall) {
+		if (position == data.size()) {
+			throw std::runtime_error("Syscall log exhausted");
+		}
+
+		uint32_t recordedSyscall = readValue();
+		uint32_t size = readValue();
+		if (recordedSyscall != syscall) {
+			throw std::runtime_error("Replay diverged from the syscall log");
+		}
+		if (position + size > data.size()) {
+			throw std::runtime_error("Invalid syscall log");
+		}
+
+		std::vector<uint8_t> input(data.begin() + position, data.begin() + position + size);
+		position += size;
+		return input;
+	}
+
+private:
+	static constexpr char magic[8] = { 'V', 'X', 'M', '8', '6', 'L', 'O', 'G' };
+	static constexpr uint32_t version = 2;
+
+	Mode mode;
+	std::ofstream file;
+	std::vector<uint8_t> data;
+	size_t position = 0;
+
+	void writeValue(uint32_t value) {
+		file.write((const char*)&value, sizeof(value));
+	}
+
+	uint32_t readValue() {
+		if (position + sizeof(uint32_t) > data.size()) {
+			throw std::runtime_error("Invalid syscall log");
+		}
+
+		uint32_t value;
+		memcpy(&value, data.data() + position, sizeof(value));
+		position += sizeof(value);
+		return value;
+	}
+};
@@ -0,0 +1,300 @@
+#include "CPU.hpp"
+#include <vector>
+#include <cerrno>
+#include <algorithm>
+
+#ifdef VXM86_MMAP
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+// Guest syscalls on host files: files opened by the guest and the ones set
+// with setHostFiles(), or on the input buffer of setInput(). Reads and
+// writes go straight between the file and guest memory. On a nonblocking
+// host file a syscall that would wait stops run() and is executed again
+// from the start when the file is ready, the guest only gets EAGAIN for
+// files it opened nonblocking itself. With asynchronous I/O the caller of
+// run() does the transfer instead.
+//
+// The results, and the data of reads, go through the syscall log, so a
+// replay gives the guest the same values without opening any file. Reads
+// of the console are logged the same way.
+
+namespace {
+	// negated errno as the guest sees it in eax, the host has the same values on Linux
+	int32_t guestError(int error) {
+		return -error;
+	}
+
+	constexpr size_t maxPathLength = 4096;
+
+	bool isInput(uint32_t syscall) {
+		// sys_read, sys_pread64
+		return syscall == 3 || syscall == 180;
+	}
+}
+
+CPU::~CPU() {
+#ifdef VXM86_MMAP
+	for (File& file : this->files) {
+		if (file.owned) {
+			close(file.fd);
+		}
+	}
+#endif
+}
+
+void CPU::setInput(std::span<const uint8_t> data) {
+	this->input = data;
+	this->inputOffset = 0;
+	for (size_t fd = 0; fd < 3; fd++) {
+		this->files[fd] = { -1, true, false, false, true };
+	}
+}
+
+bool CPU::hasOpenedFiles() {
+	return std::any_of(this->files.begin(), this->files.end(), [](const File& file) { return file.open && file.owned; });
+}
+
+void CPU::restart() {
+	for (size_t fd = 3; fd < this->files.size(); fd++) {
+#ifdef VXM86_MMAP
+		if (this->files[fd].owned) {
+			close(this->files[fd].fd);
+		}
+#endif
+	}
+	this->files.resize(3);
+	this->inputOffset = 0;
+	this->signals = {};
+	this->blockedSignals = 0;
+	this->faulted = false;
+}
+
+void CPU::setAsyncIo(bool asyncIo) {
+	this->asyncIo = asyncIo;
+}
+
+const CPU::IoRequest& CPU::getIoRequest() {
+	return this->ioRequest;
+}
+
+void CPU::completeIo(int32_t result) {
+	finishIo(this->ioSyscall, result, this->ioRequest.buffer);
+}
+
+bool CPU::isConsole(uint32_t fd) {
+	const File* file = findFile(fd);
+	return file != nullptr && file->console;
+}
+
+const CPU::File* CPU::findFile(uint32_t fd) {
+	if (fd >= this->files.size() || !this->files[fd].open) {
+		return nullptr;
+	}
+	return &this->files[fd];
+}
+
+bool CPU::blockOn(int fd, bool output) {
+	this->registers.set(Registers::Reg::EIP, this->instructionEip);
+	this->wait = { fd, output };
+	this->state = State::Blocked;
+	return false;
+}
+
+bool CPU::fileRead(uint32_t syscall, uint32_t fd, uint32_t buffer, uint32_t size, int64_t offset) {
+	if (this->syscallLog != nullptr && this->syscallLog->isReplaying()) {
+		replayResult(syscall, buffer);
+		return true;
+	}
+
+	const File* file = findFile(fd);
+	if (file == nullptr || file->console) {
+		// the console is only read by lines
+		finishIo(syscall, guestError(file == nullptr ? EBADF : ESPIPE), nullptr);
+		return true;
+	}
+	if (!this->memory->contains(buffer, size)) {
+		finishIo(syscall, guestError(EFAULT), nullptr);
+		return true;
+	}
+
+	if (file->buffer) {
+		size_t from = (offset < 0) ? this->inputOffset : (size_t)offset;
+		uint32_t count = (uint32_t)std::min<size_t>(size, this->input.size() - std::min(from, this->input.size()));
+		uint8_t* to = this->memory->writable(buffer, count);
+		memcpy(to, this->input.data() + from, count);
+		if (offset < 0) {
+			this->inputOffset += count;
+		}
+		finishIo(syscall, (int32_t)count, to);
+		return true;
+	}
+
+	uint8_t* to = this->memory->writable(buffer, size);
+	if (this->asyncIo) {
+		this->ioRequest = { false, file->fd, to, size, offset };
+		this->ioSyscall = syscall;
+		this->state = State::Io;
+		return false;
+	}
+
+#ifdef VXM86_MMAP
+	ssize_t count = (offset < 0) ? ::read(file->fd, to, size) : ::pread(file->fd, to, size, offset);
+	if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !file->owned) {
+		return blockOn(file->fd, false);
+	}
+	finishIo(syscall, (count < 0) ? guestError(errno) : (int32_t)count, to);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool CPU::fileWrite(uint32_t syscall, uint32_t fd, uint32_t buffer, uint32_t size, int64_t offset) {
+	if (this->syscallLog != nullptr && this->syscallLog->isReplaying()) {
+		replayResult(syscall, buffer);
+		return true;
+	}
+
+	const File* file = findFile(fd);
+	if (file == nullptr || (file->console && offset >= 0)) {
+		finishIo(syscall, guestError(file == nullptr ? EBADF : ESPIPE), nullptr);
+		return true;
+	}
+	if (!this->memory->contains(buffer, size)) {
+		finishIo(syscall, guestError(EFAULT), nullptr);
+		return true;
+	}
+
+	if (file->buffer) {
+		finishIo(syscall, (int32_t)size, nullptr);
+		return true;
+	}
+
+	const uint8_t* from = this->memory->view(buffer, size);
+	if (this->asyncIo) {
+		this->ioRequest = { true, file->fd, (uint8_t*)from, size, offset };
+		this->ioSyscall = syscall;
+		this->state = State::Io;
+		return false;
+	}
+
+#ifdef VXM86_MMAP
+	ssize_t count = (offset < 0) ? ::write(file->fd, from, size) : ::pwrite(file->fd, from, size, offset);
+	if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !file->owned) {
+		return blockOn(file->fd, true);
+	}
+	finishIo(syscall, (count < 0) ? guestError(errno) : (int32_t)count, nullptr);
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool CPU::fileOpen(uint32_t path, uint32_t flags, uint32_t mode) {
+	// the path is found before anything is allocated, so a bad pointer can't fault halfway
+	size_t available = this->memory->contains(path, 1) ? std::min(maxPathLength + 1, this->memory->getSize() - path) : 0;
+	const char* text = (available > 0) ? (const char*)this->memory->view(path, available) : "";
+	size_t length = strnlen(text, available);
+	if (length == available) {
+		finishIo(5, guestError(length > maxPathLength ? ENAMETOOLONG : EFAULT), nullptr);
+		return true;
+	}
+	std::string name(text, length);
+
+	// the lowest free descriptor, like the kernel
+	uint32_t fd = 0;
+	while (fd < this->files.size() && this->files[fd].open) {
+		fd++;
+	}
+
+	int32_t result;
+	int host = -1;
+	if (this->syscallLog != nullptr && this->syscallLog->isReplaying()) {
+		result = replayResult(5, 0);
+	}
+	else {
+#ifdef VXM86_MMAP
+		// the i386 flags have the values of the host ones
+		host = ::open(name.c_str(), (int)flags | O_CLOEXEC, (mode_t)mode);
+		result = (host < 0) ? guestError(errno) : (int32_t)fd;
+#else
+		result = guestError(ENOSYS);
+#endif
+	}
+
+	if (result >= 0) {
+		if (fd == this->files.size()) {
+			this->files.push_back({});
+		}
+		this->files[fd] = { host, true, false, host >= 0 };
+	}
+	finishIo(5, result, nullptr);
+	return true;
+}
+
+bool CPU::fileClose(uint32_t fd) {
+	const File* file = findFile(fd);
+	int32_t result = 0;
+	if (this->syscallLog != nullptr && this->syscallLog->isReplaying()) {
+		result = replayResult(6, 0);
+	}
+	else if (file == nullptr) {
+		result = guestError(EBADF);
+	}
+#ifdef VXM86_MMAP
+	else if (file->owned && ::close(file->fd) != 0) {
+		result = guestError(errno);
+	}
+#endif
+
+	if (file != nullptr) {
+		this->files[fd] = {};
+	}
+	finishIo(6, result, nullptr);
+	return true;
+}
+
+void CPU::finishIo(uint32_t syscall, int32_t result, const uint8_t* data) {
+	this->registers.set(Registers::Reg::EAX, (uint32_t)result);
+	if (result > 0 && data != nullptr && isInput(syscall)) {
+		this->metrics->add(Metric::IoBytesRead, result);
+	}
+	else if (result > 0 && (syscall == 4 || syscall == 181)) {
+		this->metrics->add(Metric::IoBytesWritten, result);
+	}
+
+	bool input = result > 0 && data != nullptr && isInput(syscall);
+	recordIo(syscall, result, input ? data : nullptr, input ? result : 0);
+}
+
+void CPU::recordIo(uint32_t syscall, int32_t result, const uint8_t* data, size_t size) {
+	if (this->syscallLog == nullptr || this->syscallLog->isReplaying()) {
+		return;
+	}
+
+	// [i32 result] [data written to the guest]
+	std::vector<uint8_t> entry(sizeof(result));
+	memcpy(entry.data(), &result, sizeof(result));
+	entry.insert(entry.end(), data, data + size);
+	this->syscallLog->record(syscall, entry.data(), (uint32_t)entry.size());
+}
+
+int32_t CPU::replayResult(uint32_t syscall, uint32_t buffer) {
+	std::vector<uint8_t> entry = this->syscallLog->replay(syscall);
+	int32_t result;
+	if (entry.size() < sizeof(result)) {
+		throw std::runtime_error("Invalid syscall log");
+	}
+	memcpy(&result, entry.data(), sizeof(result));
+
+	if (entry.size() > sizeof(result)) {
+		if (!this->memory->contains(buffer, entry.size() - sizeof(result))) {
+			throw std::runtime_error("Invalid syscall log");
+		}
+		this->memory->write(buffer, entry.data() + sizeof(result), entry.size() - sizeof(result));
+	}
+	this->registers.set(Registers::Reg::EAX, (uint32_t)result);
+	return result;
+}
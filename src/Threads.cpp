@@ -0,0 +1,135 @@
+#include "GuestThreads.hpp"
+#include <cerrno>
+
+// Guest threads: clone with CLONE_VM starts a CPU on the same memory in
+// GuestThreads, futex waits and wakes on host futexes. Each thread has its
+// own registers and signal handlers, and a copy of the file table of its
+// creator. The copied files are shared without being owned, only the thread
+// that opened a file closes it when it stops. TLS isn't supported, the tls
+// argument of clone is ignored.
+
+namespace {
+	constexpr uint32_t cloneVm = 0x0000'0100;
+	constexpr uint32_t cloneParentSetTid = 0x0010'0000;
+	constexpr uint32_t cloneChildClearTid = 0x0020'0000;
+	constexpr uint32_t cloneChildSetTid = 0x0100'0000;
+
+	constexpr uint32_t futexWait = 0;
+	constexpr uint32_t futexWake = 1;
+	// FUTEX_PRIVATE_FLAG and FUTEX_CLOCK_REALTIME make no difference to threads of one guest
+	constexpr uint32_t futexCommand = 0x7F;
+
+	// negated errno as the guest sees it in eax
+	uint32_t guestError(int error) {
+		return (uint32_t)-error;
+	}
+}
+
+void CPU::setThreads(GuestThreads* threads) {
+	this->threads = threads;
+}
+
+bool CPU::hasStartedThreads() {
+	return this->threads != nullptr && this->threads->hasStarted();
+}
+
+bool CPU::sysClone(uint32_t flags, uint32_t stack, uint32_t parentTid, uint32_t childTid) {
+	if (this->threads == nullptr || (flags & cloneVm) == 0) {
+		// a process with a copy of the memory isn't supported
+		this->registers.set(Registers::Reg::EAX, guestError(ENOSYS));
+		return true;
+	}
+	if (((flags & cloneParentSetTid) != 0 && !this->memory->contains(parentTid, 4)) ||
+		((flags & (cloneChildSetTid | cloneChildClearTid)) != 0 && !this->memory->contains(childTid, 4))) {
+		this->registers.set(Registers::Reg::EAX, guestError(EFAULT));
+		return true;
+	}
+
+	std::unique_ptr<CPU> child = std::make_unique<CPU>(this->memory);
+	uint32_t tid = this->threads->nextThreadId();
+	// the child continues after the syscall with eax 0, on its own stack if it has one
+	child->registers = this->registers;
+	child->registers.set(Registers::Reg::EAX, 0);
+	if (stack != 0) {
+		child->registers.set(Registers::Reg::ESP, stack);
+	}
+	child->files = this->files;
+	for (File& file : child->files) {
+		file.owned = false;
+	}
+	child->input = this->input;
+	child->signals = this->signals;
+	child->blockedSignals = this->blockedSignals;
+	child->faultHandler = this->faultHandler;
+	child->decodeCacheFile = this->decodeCacheFile;
+	child->threads = this->threads;
+	child->threadId = tid;
+	child->clearThreadId = ((flags & cloneChildClearTid) != 0) ? childTid : 0;
+
+	if ((flags & cloneChildSetTid) != 0) {
+		this->memory->write<uint32_t>(childTid, tid);
+	}
+	if ((flags & cloneParentSetTid) != 0) {
+		this->memory->write<uint32_t>(parentTid, tid);
+	}
+
+	this->threads->start(std::move(child));
+	this->registers.set(Registers::Reg::EAX, tid);
+	return true;
+}
+
+bool CPU::sysFutex(uint32_t address, uint32_t operation, uint32_t value, uint32_t timeout) {
+	if (this->threads == nullptr) {
+		this->registers.set(Registers::Reg::EAX, guestError(ENOSYS));
+		return true;
+	}
+	if (!this->memory->contains(address, 4)) {
+		this->registers.set(Registers::Reg::EAX, guestError(EFAULT));
+		return true;
+	}
+	if (address % 4 != 0) {
+		this->registers.set(Registers::Reg::EAX, guestError(EINVAL));
+		return true;
+	}
+
+	// the host futex only reads the word
+	uint32_t* word = (uint32_t*)this->memory->view(address, 4);
+	switch (operation & futexCommand) {
+		case futexWait: {
+			// relative struct timespec with 32 bit fields, 0 to wait without a limit
+			int64_t nanoseconds = -1;
+			if (timeout != 0) {
+				if (!this->memory->contains(timeout, 8)) {
+					this->registers.set(Registers::Reg::EAX, guestError(EFAULT));
+					return true;
+				}
+				int32_t seconds = (int32_t)this->memory->read<uint32_t>(timeout);
+				int32_t fraction = (int32_t)this->memory->read<uint32_t>(timeout + 4);
+				if (seconds < 0 || fraction < 0 || fraction >= 1'000'000'000) {
+					this->registers.set(Registers::Reg::EAX, guestError(EINVAL));
+					return true;
+				}
+				nanoseconds = (int64_t)seconds * 1'000'000'000 + fraction;
+			}
+			this->registers.set(Registers::Reg::EAX, (uint32_t)this->threads->wait(word, value, nanoseconds));
+			return true;
+		}
+		case futexWake:
+			this->registers.set(Registers::Reg::EAX, (uint32_t)this->threads->wake(word, value));
+			return true;
+		default:
+			this->registers.set(Registers::Reg::EAX, guestError(ENOSYS));
+			return true;
+	}
+}
+
+bool CPU::exitThread() {
+	// like the kernel, the thread id is cleared and a thread joining it woken up
+	if (this->clearThreadId != 0 && this->threads != nullptr && this->memory->contains(this->clearThreadId, 4)) {
+		this->memory->update<uint32_t>(this->clearThreadId, [](uint32_t) { return 0u; });
+		if (this->clearThreadId % 4 == 0) {
+			this->threads->wake((uint32_t*)this->memory->view(this->clearThreadId, 4), 1);
+		}
+	}
+	return false;
+}
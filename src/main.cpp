@@ -5,11 +5,40 @@
 #include <vector>
 #include <cstdint>
 #include <stdexcept>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+#include <map>
+#include <sstream>
 
 #include "Memory.hpp"
+#include "ConsoleDevice.hpp"
 #include "Registers.hpp"
 #include "CPU.hpp"
 #include "ELFLoader.hpp"
+#include "SyscallLog.hpp"
+#include "Checkpoint.hpp"
+#include "DecodeCacheFile.hpp"
+#include "PerfCounters.hpp"
+#include "Metrics.hpp"
+#include "Scheduler.hpp"
+#include "ReadCheck.hpp"
+#include "Fuzzer.hpp"
+#include "Lockstep.hpp"
+#include "GuestThreads.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <csignal>
+#include <pthread.h>
+#define VXM86_SIGNALS
+#endif
+
+#ifdef VXM86_SCHEDULER
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
 
 void codeArray() {
 	const uint8_t code[] = {
@@ -38,25 +67,564 @@ void codeArray() {
 	cpu.print();
 }
 
-void elf() {
-	Memory mem(0x0f'ff'ff'ff);
+struct Options {
+	std::string path = "./elf/elf_test";
+	bool debug = true;
+	std::unique_ptr<SyscallLog> syscallLog;
+	// checkpoint to resume from instead of loading the ELF file
+	std::string restorePath;
+	// checkpoint written when the guest stops
+	std::string savePath;
+	// directory of saved decode caches, empty to decode everything again
+	std::string decodeCacheDirectory;
+	Memory::Placement placement;
+	// report host counters on exit
+	bool perf = false;
+	// measure every n-th basic block on its own, 0 for none
+	uint32_t perfSamplePeriod = 0;
+	// metrics written on exit and on SIGUSR1, empty for none, "-" for stdout
+	std::string metricsPath;
+	std::string metricsJsonPath;
+	// TCP port, every connection runs its own guest, 0 to run one on the console
+	uint16_t servePort = 0;
+	// threads running the guests of the connections
+	size_t workers = std::thread::hardware_concurrency();
+	// guest reads and writes of --serve go through io_uring
+	bool ioUring = false;
+	// report reads of memory nothing wrote
+	bool checkReads = false;
+	// corpus of --fuzz, empty to run the guest once
+	std::string fuzzDirectory;
+	// inputs --fuzz runs, 0 for no limit
+	uint64_t fuzzRuns = 0;
+	// directory of inputs run together by --lockstep, empty for none
+	std::string lockstepDirectory;
+	// map a ConsoleDevice at ConsoleDevice::defaultAddress
+	bool consoleDevice = false;
+	// directory of guests timed by --bench, empty for none
+	std::string benchDirectory;
+	// results --bench compares with, empty for none
+	std::string benchBaselinePath;
+	// results --bench writes, empty for none
+	std::string benchSavePath;
+	// slowdown in percent --bench accepts against the baseline, negative to only report it
+	double benchTolerance = -1;
+};
+
+void writeMetrics(const std::string& prometheusPath, const std::string& jsonPath) {
+	Metrics::Snapshot snapshot = Metrics::snapshot();
+	for (auto& [path, text] : { std::pair{ prometheusPath, Metrics::prometheus(snapshot) }, std::pair{ jsonPath, Metrics::json(snapshot) } }) {
+		if (path.empty()) {
+			continue;
+		}
+		if (path == "-") {
+			std::cout << text << std::flush;
+			continue;
+		}
+
+		std::ofstream file(path, std::ios::trunc);
+		if (!file.is_open()) {
+			throw std::runtime_error("Failed to write metrics");
+		}
+		file << text;
+	}
+}
 
-	ELFLoader loader("./elf/elf_test");
-	uint32_t entry = loader.load(mem);
+// SIGUSR1 is taken by a thread waiting for it, so the metrics are
+// not collected inside a signal handler.
+void watchMetricsSignal(const Options& options) {
+#ifdef VXM86_SIGNALS
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	// threads started later inherit the mask
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 
+	std::thread([signals, prometheusPath = options.metricsPath, jsonPath = options.metricsJsonPath]() {
+		while (true) {
+			int signal;
+			if (sigwait(&signals, &signal) == 0) {
+				try {
+					writeMetrics(prometheusPath, jsonPath);
+				}
+				catch (const std::exception& e) {
+					std::cout << e.what() << std::endl;
+				}
+			}
+		}
+	}).detach();
+#endif
+}
+
+void elf(Options& options) {
+	size_t memorySize = 0x0f'ff'ff'ff;
+	std::unique_ptr<Checkpoint> checkpoint;
+	if (!options.restorePath.empty()) {
+		checkpoint = std::make_unique<Checkpoint>(options.restorePath);
+		memorySize = checkpoint->getMemorySize();
+	}
+
+	Memory mem(memorySize, options.placement);
 	CPU cpu(&mem);
-	cpu.setDebug(true);
-	cpu.setIP(entry);
+	std::unique_ptr<DecodeCacheFile> decodeCacheFile;
+	std::unique_ptr<PerfCounters> perfCounters;
+
+	if (checkpoint) {
+		checkpoint->restore(cpu, mem);
+	}
+	else {
+		ELFLoader loader(options.path);
+		uint32_t entry = loader.load(mem);
+
+		cpu.setIP(entry);
+		cpu.getRegisters().set(Registers::Reg::ESP, 0x0f'ff'ff'00);
+
+		if (!options.decodeCacheDirectory.empty()) {
+			decodeCacheFile = std::make_unique<DecodeCacheFile>(options.decodeCacheDirectory, loader.hash(), &mem);
+			cpu.setDecodeCacheFile(decodeCacheFile.get());
+		}
+	}
+
+	if (options.debug) {
+		cpu.setDebug(true);
+	}
+	cpu.setSyscallLog(options.syscallLog.get());
+	if (options.perf) {
+		perfCounters = std::make_unique<PerfCounters>(options.perfSamplePeriod);
+		cpu.setPerfCounters(perfCounters.get());
+	}
+	std::unique_ptr<ReadCheck> readCheck;
+	if (options.checkReads) {
+		readCheck = std::make_unique<ReadCheck>(mem);
+		cpu.setInstrumentation(readCheck.get());
+	}
+
+	std::unique_ptr<ConsoleDevice> console;
+	if (options.consoleDevice) {
+		console = std::make_unique<ConsoleDevice>(mem, &std::cout);
+	}
+
+	// threads the guest starts run until it exited
+	GuestThreads threads;
+	cpu.setThreads(&threads);
+	threads.run(cpu);
+	mem.flushDevices();
+	// saving and printing the memory aren't guest reads
+	cpu.setInstrumentation(nullptr);
+
+	if (!options.savePath.empty()) {
+		Checkpoint::save(options.savePath, cpu, mem);
+	}
+	if (decodeCacheFile) {
+		decodeCacheFile->save(cpu.getDecodeCache());
+	}
+	if (options.syscallLog == nullptr || !options.syscallLog->isReplaying()) {
+		cpu.print();
+	}
+	if (perfCounters) {
+		perfCounters->print(cpu.getExecutionCounts());
+	}
+	if (readCheck) {
+		std::cout << "Instructions reading uninitialized memory: " << readCheck->getReportCount() << std::endl;
+	}
+	writeMetrics(options.metricsPath, options.metricsJsonPath);
+}
+
+// Run a guest for every file in the directory, in lockstep.
+void lockstep(Options& options) {
+	std::vector<std::filesystem::path> paths;
+	for (const auto& entry : std::filesystem::directory_iterator(options.lockstepDirectory)) {
+		if (entry.is_regular_file()) {
+			paths.push_back(entry.path());
+		}
+	}
+	std::sort(paths.begin(), paths.end());
+	if (paths.empty()) {
+		throw std::runtime_error("No inputs in " + options.lockstepDirectory);
+	}
+
+	std::vector<std::vector<uint8_t>> inputs;
+	for (const std::filesystem::path& path : paths) {
+		std::ifstream file(path, std::ios::binary);
+		inputs.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+
+	Lockstep group(options.path, std::move(inputs), options.placement);
+	auto start = std::chrono::steady_clock::now();
+	group.run();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (size_t i = 0; i < paths.size(); i++) {
+		const Lockstep::Result& result = group.getResult(i);
+		std::cout << paths[i].filename().string() << ": ";
+		if (result.faulted) {
+			std::cout << "fault " << (int)result.fault.exception << " at " << std::hex << result.fault.eip << std::dec << std::endl;
+		}
+		else {
+			std::cout << "exited with code " << result.exitCode << std::endl;
+		}
+	}
+
+	uint64_t issued = std::max<uint64_t>(group.getIssued(), 1);
+	std::cout << group.getLaneInstructions() << " instructions of " << paths.size() << " guests in " << seconds << " s, "
+		<< (double)group.getLaneInstructions() / issued << " guests per issued instruction, "
+		<< 100.0 * group.getScalarInstructions() / std::max<uint64_t>(group.getLaneInstructions(), 1) << "% on the CPUs of the guests" << std::endl;
+}
+
+// Result of one guest of --bench.
+struct BenchResult {
+	uint32_t exitCode = 0;
+	uint64_t instructions = 0;
+	double seconds = 0;
+
+	double mips() const {
+		return this->instructions / std::max(this->seconds, 1e-9) / 1e6;
+	}
+};
+
+// Run every guest in the directory once, without stdin and with its output
+// discarded, and report its instructions, wall time and MIPS. With a
+// baseline every guest has to exit with the same code after the same
+// instructions, its MIPS are compared too but fail it only with a
+// benchTolerance, timings vary too much between hosts and builds.
+// Returns false if a guest didn't pass.
+bool bench(Options& options) {
+	std::vector<std::filesystem::path> paths;
+	for (const auto& entry : std::filesystem::directory_iterator(options.benchDirectory)) {
+		if (entry.is_regular_file() && !entry.path().has_extension()) {
+			paths.push_back(entry.path());
+		}
+	}
+	std::sort(paths.begin(), paths.end());
+	if (paths.empty()) {
+		throw std::runtime_error("No guests in " + options.benchDirectory);
+	}
+
+	// name exit code, instructions and MIPS per line
+	std::map<std::string, BenchResult> baseline;
+	if (!options.benchBaselinePath.empty()) {
+		std::ifstream file(options.benchBaselinePath);
+		if (!file.is_open()) {
+			throw std::runtime_error("Failed to read " + options.benchBaselinePath);
+		}
+		std::string line;
+		while (std::getline(file, line)) {
+			std::istringstream fields(line);
+			std::string name;
+			BenchResult result;
+			double mips;
+			if (line.empty() || line[0] == '#' || !(fields >> name >> result.exitCode >> result.instructions >> mips)) {
+				continue;
+			}
+			result.seconds = result.instructions / (mips * 1e6);
+			baseline[name] = result;
+		}
+	}
+
+	std::cout << std::left << std::setw(12) << "guest" << std::right << std::setw(14) << "exit code" << std::setw(14) << "instructions"
+		<< std::setw(10) << "seconds" << std::setw(10) << "MIPS" << std::setw(12) << "baseline" << std::setw(10) << "change" << std::endl;
+
+	bool passed = true;
+	std::ostringstream saved;
+	saved << "# guest, exit code, instructions, MIPS of a Release build" << std::endl;
+	for (const std::filesystem::path& path : paths) {
+		std::string name = path.filename().string();
+		Memory mem(0x0f'ff'ff'ff, options.placement);
+		CPU cpu(&mem);
+		ELFLoader loader(path.string());
+		cpu.setIP(loader.load(mem));
+		cpu.getRegisters().set(Registers::Reg::ESP, 0x0f'ff'ff'00);
+		cpu.setInput({});
+		// guests can log through the console device, discarded like their writes
+		ConsoleDevice console(mem, nullptr);
+
+		auto start = std::chrono::steady_clock::now();
+		CPU::State state = cpu.run();
+		mem.flushDevices();
+		BenchResult result;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.exitCode = cpu.getRegisters().get(Registers::Reg::EBX);
+		result.instructions = cpu.getExecutionCounts().instructions;
+
+		std::cout << std::left << std::setw(12) << name << std::right << std::setw(14) << result.exitCode << std::setw(14) << result.instructions
+			<< std::fixed << std::setprecision(3) << std::setw(10) << result.seconds << std::setprecision(1) << std::setw(10) << result.mips();
+		saved << name << " " << result.exitCode << " " << result.instructions << " " << std::fixed << std::setprecision(1) << result.mips() << std::endl;
+
+		if (state != CPU::State::Stopped || cpu.getFault() != nullptr) {
+			std::cout << "  failed" << std::endl;
+			passed = false;
+			continue;
+		}
+
+		auto expected = baseline.find(name);
+		if (expected == baseline.end()) {
+			std::cout << std::endl;
+			continue;
+		}
+		double change = (result.mips() / expected->second.mips() - 1) * 100;
+		std::cout << std::setw(12) << expected->second.mips() << std::showpos << std::setw(9) << change << "%" << std::noshowpos;
+		if (result.exitCode != expected->second.exitCode || result.instructions != expected->second.instructions) {
+			std::cout << "  different result";
+			passed = false;
+		}
+		else if (options.benchTolerance >= 0 && change < -options.benchTolerance) {
+			std::cout << "  slower";
+			passed = false;
+		}
+		std::cout << std::endl;
+	}
+	std::cout << std::defaultfloat;
+
+	if (!options.benchSavePath.empty()) {
+		std::ofstream file(options.benchSavePath, std::ios::trunc);
+		if (!file.is_open()) {
+			throw std::runtime_error("Failed to write " + options.benchSavePath);
+		}
+		file << saved.str();
+	}
+	return passed;
+}
+
+#ifdef VXM86_SCHEDULER
+// instructions a guest runs before the others get their turn
+constexpr uint64_t timeSlice = 0x1'0000;
+
+// Socket of a connection, closed with the coroutine frame holding it. That
+// is also when a guest throws or the scheduler destroys the coroutine
+// before it finished or even started.
+struct ConnectionSocket {
+	int fd;
+
+	ConnectionSocket(int fd) :
+		fd(fd) {
+	}
+
+	ConnectionSocket(ConnectionSocket&& other) :
+		fd(other.fd) {
+		other.fd = -1;
+	}
+
+	ConnectionSocket(const ConnectionSocket&) = delete;
+	ConnectionSocket& operator=(const ConnectionSocket&) = delete;
+
+	~ConnectionSocket() {
+		if (this->fd >= 0) {
+			close(this->fd);
+		}
+	}
+};
+
+// Guest of one connection, reading and writing the socket as stdin and stdout.
+// The socket is a parameter, so it is destroyed after the guest.
+Scheduler::Task serveConnection(Scheduler& scheduler, const Options& options, ConnectionSocket socket) {
+	int connection = socket.fd;
+	Memory mem(0x0f'ff'ff'ff, options.placement);
+	CPU cpu(&mem);
+
+	ELFLoader loader(options.path);
+	cpu.setIP(loader.load(mem));
 	cpu.getRegisters().set(Registers::Reg::ESP, 0x0f'ff'ff'00);
+	cpu.setHostFiles(connection, connection);
+	cpu.setAsyncIo(scheduler.hasIoUring());
 
-	cpu.run();
-	cpu.print();
+	while (true) {
+		CPU::State state = cpu.run(timeSlice);
+		if (state == CPU::State::Blocked) {
+			co_await scheduler.wait(cpu.getWait().fd, cpu.getWait().output);
+		}
+		else if (state == CPU::State::Io) {
+			const CPU::IoRequest& request = cpu.getIoRequest();
+			int32_t result;
+			while ((result = co_await scheduler.io(request.output, request.fd, request.buffer, request.size, request.offset)) == -EAGAIN) {
+				// the connection is nonblocking
+				co_await scheduler.wait(request.fd, request.output);
+			}
+			cpu.completeIo(result);
+		}
+		else if (state == CPU::State::Yielded) {
+			co_await scheduler.yield();
+		}
+		else {
+			break;
+		}
+	}
 }
 
-int main() {
+Scheduler::Task acceptConnections(Scheduler& scheduler, const Options& options, int listener) {
+	while (true) {
+		int connection = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (connection >= 0) {
+			scheduler.spawn(serveConnection(scheduler, options, ConnectionSocket(connection)));
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			co_await scheduler.wait(listener, false);
+		}
+		else if (errno != EINTR && errno != ECONNABORTED) {
+			throw std::runtime_error("Failed to accept connection");
+		}
+	}
+}
+#endif
+
+// Run a guest for every connection to the port until the process is stopped.
+void serve(Options& options) {
+#ifdef VXM86_SCHEDULER
+	int listener = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listener < 0) {
+		throw std::runtime_error("Failed to create socket");
+	}
+	int on = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	sockaddr_in6 address = {};
+	address.sin6_family = AF_INET6;
+	address.sin6_port = htons(options.servePort);
+	address.sin6_addr = in6addr_any;
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0) {
+		close(listener);
+		throw std::runtime_error("Failed to listen on port " + std::to_string(options.servePort));
+	}
+
+	// a client closing its connection must not stop the others
+	signal(SIGPIPE, SIG_IGN);
+
+	std::cout << "Serving " << options.path << " on port " << options.servePort << std::endl;
+	Scheduler scheduler(options.workers, options.ioUring);
+	scheduler.spawn(acceptConnections(scheduler, options, listener));
+	scheduler.run();
+	close(listener);
+#else
+	throw std::runtime_error("--serve is not supported on this host");
+#endif
+}
+
+int main(int argc, char* argv[]) {
 	try {
+		Options options;
+
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg == "--no-debug") {
+				options.debug = false;
+			}
+			else if (arg == "--record" && i + 1 < argc) {
+				options.syscallLog = std::make_unique<SyscallLog>(argv[++i], SyscallLog::Mode::Record);
+			}
+			else if (arg == "--replay" && i + 1 < argc) {
+				// replay never waits for the user
+				options.syscallLog = std::make_unique<SyscallLog>(argv[++i], SyscallLog::Mode::Replay);
+				options.debug = false;
+			}
+			else if (arg == "--save" && i + 1 < argc) {
+				options.savePath = argv[++i];
+			}
+			else if (arg == "--restore" && i + 1 < argc) {
+				options.restorePath = argv[++i];
+			}
+			else if (arg == "--decode-cache" && i + 1 < argc) {
+				options.decodeCacheDirectory = argv[++i];
+			}
+			else if (arg == "--perf") {
+				options.perf = true;
+			}
+			else if (arg == "--perf-sample" && i + 1 < argc) {
+				options.perf = true;
+				options.perfSamplePeriod = std::stoul(argv[++i]);
+			}
+			else if (arg == "--metrics" && i + 1 < argc) {
+				options.metricsPath = argv[++i];
+			}
+			else if (arg == "--metrics-json" && i + 1 < argc) {
+				options.metricsJsonPath = argv[++i];
+			}
+			else if (arg == "--serve" && i + 1 < argc) {
+				options.servePort = (uint16_t)std::stoul(argv[++i]);
+			}
+			else if (arg == "--workers" && i + 1 < argc) {
+				options.workers = std::stoul(argv[++i]);
+			}
+			else if (arg == "--check-reads") {
+				options.checkReads = true;
+			}
+			else if (arg == "--fuzz" && i + 1 < argc) {
+				options.fuzzDirectory = argv[++i];
+			}
+			else if (arg == "--fuzz-runs" && i + 1 < argc) {
+				options.fuzzRuns = std::stoull(argv[++i]);
+			}
+			else if (arg == "--lockstep" && i + 1 < argc) {
+				options.lockstepDirectory = argv[++i];
+			}
+			else if (arg == "--console-device") {
+				options.consoleDevice = true;
+			}
+			else if (arg == "--bench" && i + 1 < argc) {
+				options.benchDirectory = argv[++i];
+			}
+			else if (arg == "--bench-baseline" && i + 1 < argc) {
+				options.benchBaselinePath = argv[++i];
+			}
+			else if (arg == "--bench-save" && i + 1 < argc) {
+				options.benchSavePath = argv[++i];
+			}
+			else if (arg == "--bench-tolerance" && i + 1 < argc) {
+				options.benchTolerance = std::stod(argv[++i]);
+			}
+			else if (arg == "--io-uring") {
+				options.ioUring = true;
+			}
+			else if (arg == "--huge-pages" && i + 1 < argc) {
+				std::string mode = argv[++i];
+				if (mode == "transparent") {
+					options.placement.hugePages = Memory::HugePages::Transparent;
+				}
+				else if (mode == "explicit") {
+					options.placement.hugePages = Memory::HugePages::Explicit;
+				}
+				else {
+					throw std::runtime_error("Invalid huge page mode: " + mode);
+				}
+			}
+			else if (arg == "--numa" && i + 1 < argc) {
+				std::string node = argv[++i];
+				if (node == "local") {
+					options.placement.numaNode = Memory::localNode;
+				}
+				else if (!node.empty() && node.find_first_not_of("0123456789") == std::string::npos) {
+					options.placement.numaNode = std::stoi(node);
+				}
+				else {
+					throw std::runtime_error("Invalid NUMA node: " + node);
+				}
+			}
+			else {
+				options.path = arg;
+			}
+		}
+
+		if (!options.metricsPath.empty() || !options.metricsJsonPath.empty()) {
+			watchMetricsSignal(options);
+		}
+
 		//codeArray();
-		elf();
+		if (!options.fuzzDirectory.empty()) {
+			Fuzzer fuzzer(options.path, options.fuzzDirectory, options.placement);
+			fuzzer.run(options.fuzzRuns);
+		}
+		else if (!options.lockstepDirectory.empty()) {
+			lockstep(options);
+		}
+		else if (!options.benchDirectory.empty()) {
+			if (!bench(options)) {
+				return 1;
+			}
+		}
+		else if (options.servePort != 0) {
+			serve(options);
+		}
+		else {
+			elf(options);
+		}
 	}
 	catch (const std::exception& e) {
 		std::cout << e.what() << std::endl;
@@ -64,4 +632,3 @@ int main() {
 
 	return 0;
 }
-